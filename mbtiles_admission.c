@@ -0,0 +1,90 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "apr_pools.h"
+#include "apr_time.h"
+#include "apr_atomic.h"
+
+#include "mbtiles_admission.h"
+
+apr_status_t mbtiles_admission_init(Admission* admission, int limit, int max_waiting, apr_interval_time_t max_wait, apr_pool_t* pool) {
+	memset(admission, 0, sizeof(Admission));
+	admission->limit = limit;
+	admission->max_waiting = max_waiting;
+	admission->max_wait = max_wait;
+#if APR_HAS_THREADS
+	apr_status_t rv = apr_thread_mutex_create(&admission->mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+	if (rv != APR_SUCCESS)
+		return rv;
+	return apr_thread_cond_create(&admission->cond, pool);
+#else
+	return APR_SUCCESS;
+#endif
+}
+
+bool mbtiles_admission_enter(Admission* admission) {
+#if APR_HAS_THREADS
+	if (!admission->mutex)
+		return true;
+
+	bool admitted = true;
+	apr_thread_mutex_lock(admission->mutex);
+	if (admission->running >= admission->limit) {
+		if (admission->waiting >= admission->max_waiting)
+			admitted = false;
+		else {
+			apr_time_t deadline = apr_time_now() + admission->max_wait;
+			admission->waiting++;
+			while (admission->running >= admission->limit) {
+				apr_interval_time_t left = deadline - apr_time_now();
+				if (left <= 0) {
+					admitted = false;
+					break;
+				}
+				apr_thread_cond_timedwait(admission->cond, admission->mutex, left);
+			}
+			admission->waiting--;
+			if (admitted)
+				apr_atomic_inc32(&admission->waited);
+		}
+	}
+	if (admitted)
+		admission->running++;
+	apr_thread_mutex_unlock(admission->mutex);
+
+	apr_atomic_inc32(admitted ? &admission->admitted : &admission->rejected);
+	return admitted;
+#else
+	// one request at a time per child anyway
+	return true;
+#endif
+}
+
+void mbtiles_admission_leave(Admission* admission) {
+#if APR_HAS_THREADS
+	if (!admission->mutex)
+		return;
+	apr_thread_mutex_lock(admission->mutex);
+	admission->running--;
+	if (admission->waiting)
+		apr_thread_cond_broadcast(admission->cond);
+	apr_thread_mutex_unlock(admission->mutex);
+#endif
+}
+
+void mbtiles_admission_get_stats(Admission* admission, AdmissionStats* stats) {
+#if APR_HAS_THREADS
+	if (admission->mutex)
+		apr_thread_mutex_lock(admission->mutex);
+#endif
+	stats->running = admission->running;
+	stats->waiting = admission->waiting;
+#if APR_HAS_THREADS
+	if (admission->mutex)
+		apr_thread_mutex_unlock(admission->mutex);
+#endif
+	stats->admitted = apr_atomic_read32(&admission->admitted);
+	stats->waited = apr_atomic_read32(&admission->waited);
+	stats->rejected = apr_atomic_read32(&admission->rejected);
+}
@@ -0,0 +1,47 @@
+#pragma once
+#ifndef MBTILES_ADMISSION_H
+#define MBTILES_ADMISSION_H
+
+#include <stdbool.h>
+
+#include "apr_pools.h"
+#include "apr_time.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+
+/*
+	Admission control for one tileset inside one child: at most limit threads read it at once,
+	at most max_waiting more wait up to max_wait for a turn, anything beyond that is turned away.
+	A slow tileset then holds a few threads instead of all of them.
+*/
+
+typedef struct AdmissionStats {
+	int running;
+	int waiting;
+	apr_uint32_t admitted;
+	apr_uint32_t waited;	// admitted after waiting
+	apr_uint32_t rejected;	// queue full or waited too long
+} AdmissionStats;
+
+typedef struct Admission {
+	int limit;
+	int max_waiting;
+	apr_interval_time_t max_wait;
+	int running;
+	int waiting;
+	volatile apr_uint32_t admitted;
+	volatile apr_uint32_t waited;
+	volatile apr_uint32_t rejected;
+#if APR_HAS_THREADS
+	apr_thread_mutex_t* mutex;
+	apr_thread_cond_t* cond;
+#endif
+} Admission;
+
+apr_status_t mbtiles_admission_init(Admission* admission, int limit, int max_waiting, apr_interval_time_t max_wait, apr_pool_t* pool);
+// false if the caller must give up; true must be paired with mbtiles_admission_leave
+bool mbtiles_admission_enter(Admission* admission);
+void mbtiles_admission_leave(Admission* admission);
+void mbtiles_admission_get_stats(Admission* admission, AdmissionStats* stats);
+
+#endif	// MBTILES_ADMISSION_H
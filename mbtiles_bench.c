@@ -0,0 +1,319 @@
+/*
+	Microbenchmarks of the helpers every tile request goes through, on a corpus of your own: one .mbtiles
+	(tilemaker's output is the usual one), its tiles and its metadata. Each benchmark calls its helper over the
+	same tiles, spread evenly over the file, repeats that until a round takes at least 100 ms and keeps the
+	fastest of 5 rounds, so two builds run on the same file compare helper by helper.
+
+	readTile cold reads each tile through a new SQLite handle, as after a child opens the file or replaces a
+	broken handle; warm reads it through one handle that has read every tile already. Neither drops the OS page
+	cache. readTile_tuned_cold and readTile_tuned_warm do the same through handles opened the way
+	MbtilesSqlite immutable mmap=1073741824 opens them, to compare with the plain ones. readTile_viewport reads
+	the BENCH_VIEWPORT x BENCH_VIEWPORT block of tiles around each one through a new handle, as a map view
+	fills a fresh child; run it on a file and on its mbtiles_repack output to see what the tile order does to
+	neighbouring reads. compressGzip packs the unpacked tiles again at the default composite level.
+
+	It includes mod_mbtiles.c with TEST_MOD, which makes the static helpers callable from here, and links
+	mbtiles_testmod.c for httpd's side, so it needs httpd's and APR's headers but no server.
+
+	To build:
+		cc -O2 -o mbtiles_bench -I$(apxs -q INCLUDEDIR) $(apr-1-config --cppflags --includes) \
+			mbtiles_bench.c mbtiles_testmod.c mbtiles_metadata.c mbtiles_pack.c mbtiles_pmtiles.c mbtiles_flight.c \
+			mbtiles_memtable.c mbtiles_cache.c mbtiles_hot.c mbtiles_readahead.c mbtiles_admission.c mbtiles_extract.c \
+			mbtiles_webp.c mbtiles_overzoom.c mbtiles_deflate.c $(apu-1-config --link-ld) $(apr-1-config --link-ld) -lsqlite3 -lz -lpcre2-8
+
+	Usage:
+		mbtiles_bench /path/to/corpus.mbtiles [tiles, 1000]
+
+	Prints one tab-separated line per helper: its name, the calls in a round and nanoseconds per call.
+*/
+
+#define TEST_MOD
+#include "mod_mbtiles.c"
+
+#include "apr_general.h"
+
+#include "mbtiles_testmod.h"
+
+#define BENCH_ROUNDS 5
+#define BENCH_ROUND_TIME 100	// ms, at least
+#define BENCH_NAMES 16			// tilesets for findTileset to look through
+#define BENCH_VIEWPORT 4			// tiles on a side of the block read by readTile_viewport
+#define BENCH_MMAP_SIZE (1024 * 1024 * 1024)	// bytes, for the tuned handles
+
+typedef struct BenchTile {
+	int z;
+	int x;
+	int y;	// TMS, as stored
+	char* uri;
+	unsigned char* data;
+	int size;
+	unsigned char* raw;
+	apr_size_t raw_size;
+} BenchTile;
+
+// one call of a helper, on the i-th tile where it takes one
+typedef void (*BenchCall)(int i, apr_pool_t* pool);
+
+static const char* bench_path;
+static BenchTile* bench_tiles;
+static int bench_tile_count = 0;
+static char* bench_names[BENCH_NAMES];
+static sqlite3* bench_db;	// warm
+static Tileset bench_tuned;	// the corpus with immutable and mmap set
+static sqlite3* bench_tuned_db;	// warm, opened as bench_tuned
+static char** bench_rows;	// metadata name, value, name, value...
+static int bench_row_count = 0;
+static TilesetMetadata bench_metadata;
+static unsigned char bench_buffer[MERGE_TILES_BUFFER_SIZE];
+static volatile apr_size_t bench_sink;	// keeps the compiler from dropping the calls
+
+static void benchExtract(int i, apr_pool_t* pool) {
+	TileRequest request;
+	bench_sink += extractTileRequest(bench_tiles[i].uri, &request);
+}
+
+static void benchFind(int i, apr_pool_t* pool) {
+	bench_sink += findTileset(DEFAULT_VERSION, bench_names[i % BENCH_NAMES]);
+}
+
+static void benchReadCold(int i, apr_pool_t* pool) {
+	sqlite3* db;
+	unsigned char* tile;
+	int size;
+	if (SQLITE_OK == sqlite3_open_v2(bench_path, &db, SQLITE_OPEN_READONLY, NULL))
+		bench_sink += readTile(db, bench_tiles[i].z, bench_tiles[i].x, bench_tiles[i].y, pool, &tile, &size);
+	sqlite3_close(db);
+}
+
+static void benchReadWarm(int i, apr_pool_t* pool) {
+	unsigned char* tile;
+	int size;
+	bench_sink += readTile(bench_db, bench_tiles[i].z, bench_tiles[i].x, bench_tiles[i].y, pool, &tile, &size);
+}
+
+static void benchReadTunedCold(int i, apr_pool_t* pool) {
+	sqlite3* db = NULL;
+	unsigned char* tile;
+	int size;
+	if (SQLITE_OK == openDatabase(&bench_tuned, &db, pool))
+		bench_sink += readTile(db, bench_tiles[i].z, bench_tiles[i].x, bench_tiles[i].y, pool, &tile, &size);
+	sqlite3_close(db);
+}
+
+static void benchReadTunedWarm(int i, apr_pool_t* pool) {
+	unsigned char* tile;
+	int size;
+	bench_sink += readTile(bench_tuned_db, bench_tiles[i].z, bench_tiles[i].x, bench_tiles[i].y, pool, &tile, &size);
+}
+
+// first column or row of a viewport around center that stays within the zoom
+static int viewportStart(int center, int side) {
+	int start = center - BENCH_VIEWPORT / 2;
+	if (start > side - BENCH_VIEWPORT)
+		start = side - BENCH_VIEWPORT;
+	return start < 0 ? 0 : start;
+}
+
+static void benchReadViewport(int i, apr_pool_t* pool) {
+	const BenchTile* center = &bench_tiles[i];
+	int side = 1 << center->z;
+	int x0 = viewportStart(center->x, side);
+	int y0 = viewportStart(center->y, side);
+	sqlite3* db;
+	unsigned char* tile;
+	int size;
+	if (SQLITE_OK == sqlite3_open_v2(bench_path, &db, SQLITE_OPEN_READONLY, NULL)) {
+		for (int y = y0; y < y0 + BENCH_VIEWPORT && y < side; y++) {
+			for (int x = x0; x < x0 + BENCH_VIEWPORT && x < side; x++)
+				bench_sink += readTile(db, center->z, x, y, pool, &tile, &size);
+		}
+	}
+	sqlite3_close(db);
+}
+
+static void benchDecompress(int i, apr_pool_t* pool) {
+	bench_sink += decompressGzip(bench_buffer, sizeof(bench_buffer), bench_tiles[i].data, bench_tiles[i].size);
+}
+
+static void benchCompress(int i, apr_pool_t* pool) {
+	bench_sink += compressGzip(bench_buffer, sizeof(bench_buffer), bench_tiles[i].raw, bench_tiles[i].raw_size, COMPOSITE_LEVEL);
+}
+
+static void benchMetadataParse(int i, apr_pool_t* pool) {
+	TilesetMetadata metadata = tileset_metadata_init_default;
+	for (int row = 0; row < bench_row_count; row++)
+		mbtiles_metadata_parse(bench_rows[2 * row], bench_rows[2 * row + 1], &metadata, pool);
+	bench_sink += metadata.max_zoom;
+}
+
+static void benchMetadataMerge(int i, apr_pool_t* pool) {
+	TilesetMetadata parts[2] = { bench_metadata, bench_metadata };
+	TilesetMetadata merged = mbtiles_metadata_merge(parts, 2, pool);
+	bench_sink += merged.max_zoom;
+}
+
+static void benchMetadataToJson(int i, apr_pool_t* pool) {
+	bench_sink += (apr_size_t)mbtiles_metadata_tojson(&bench_metadata, pool)[0];
+}
+
+static apr_interval_time_t benchRound(BenchCall call, int calls, int repeat, apr_pool_t* pool) {
+	apr_time_t start = apr_time_now();
+	for (int r = 0; r < repeat; r++) {
+		for (int i = 0; i < calls; i++)
+			call(i, pool);
+		apr_pool_clear(pool);
+	}
+	return apr_time_now() - start;
+}
+
+static void bench(const char* name, BenchCall call, int calls, apr_pool_t* pool) {
+	int repeat = 1;
+	while (benchRound(call, calls, repeat, pool) < apr_time_from_msec(BENCH_ROUND_TIME))
+		repeat *= 2;
+
+	apr_interval_time_t best = 0;
+	for (int round = 0; round < BENCH_ROUNDS; round++) {
+		apr_interval_time_t elapsed = benchRound(call, calls, repeat, pool);
+		if (round == 0 || elapsed < best)
+			best = elapsed;
+	}
+	printf("%s\t%d\t%.1f\n", name, calls * repeat, best * 1000.0 / ((double)calls * repeat));
+	fflush(stdout);
+}
+
+// tiles spread evenly over the index order, so the sample is the same on every run
+static bool sampleTiles(int wanted, apr_pool_t* pool) {
+	sqlite3_stmt* stmt;
+	int total = 0;
+	if (SQLITE_OK == sqlite3_prepare_v2(bench_db, "SELECT COUNT(*) FROM tiles", -1, &stmt, NULL)) {
+		if (SQLITE_ROW == sqlite3_step(stmt))
+			total = sqlite3_column_int(stmt, 0);
+		sqlite3_finalize(stmt);
+	}
+	if (total == 0)
+		return false;
+	int step = total > wanted ? total / wanted : 1;
+
+	bench_tiles = apr_pcalloc(pool, wanted * sizeof(BenchTile));
+	if (SQLITE_OK != sqlite3_prepare_v2(bench_db, "SELECT zoom_level, tile_column, tile_row, tile_data FROM tiles ORDER BY zoom_level, tile_column, tile_row", -1, &stmt, NULL))
+		return false;
+	for (int n = 0; bench_tile_count < wanted && SQLITE_ROW == sqlite3_step(stmt); n++) {
+		if (n % step)
+			continue;
+		BenchTile* tile = &bench_tiles[bench_tile_count++];
+		tile->z = sqlite3_column_int(stmt, 0);
+		tile->x = sqlite3_column_int(stmt, 1);
+		tile->y = sqlite3_column_int(stmt, 2);
+		tile->uri = apr_psprintf(pool, "/%s/%d/%d/%d.pbf", bench_names[0], tile->z, tile->x, mbtiles_flip_y(tile->z, tile->y));
+		tile->size = sqlite3_column_bytes(stmt, 3);
+		tile->data = apr_pmemdup(pool, sqlite3_column_blob(stmt, 3), tile->size);
+		tile->raw_size = decompressGzip(bench_buffer, sizeof(bench_buffer), tile->data, tile->size);
+		if (tile->raw_size == (apr_size_t)Z_BUF_ERROR)
+			tile->raw_size = 0;
+		tile->raw = apr_pmemdup(pool, bench_buffer, tile->raw_size);
+	}
+	sqlite3_finalize(stmt);
+	return bench_tile_count > 0;
+}
+
+static void readRows(apr_pool_t* pool) {
+	sqlite3_stmt* stmt;
+	if (SQLITE_OK != sqlite3_prepare_v2(bench_db, "SELECT name, value FROM metadata", -1, &stmt, NULL))
+		return;
+	int size = 16;
+	bench_rows = apr_palloc(pool, 2 * size * sizeof(char*));
+	while (SQLITE_ROW == sqlite3_step(stmt)) {
+		if (bench_row_count == size) {
+			char** rows = apr_palloc(pool, 4 * size * sizeof(char*));
+			memcpy(rows, bench_rows, 2 * size * sizeof(char*));
+			bench_rows = rows;
+			size *= 2;
+		}
+		const char* name = (const char*)sqlite3_column_text(stmt, 0);
+		const char* value = (const char*)sqlite3_column_text(stmt, 1);
+		bench_rows[2 * bench_row_count] = apr_pstrdup(pool, name ? name : "");
+		bench_rows[2 * bench_row_count + 1] = apr_pstrdup(pool, value ? value : "");
+		bench_row_count++;
+	}
+	sqlite3_finalize(stmt);
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s /path/to/corpus.mbtiles [tiles]\n", argv[0]);
+		return 1;
+	}
+	bench_path = argv[1];
+	int wanted = argc > 2 ? atoi(argv[2]) : 1000;
+	if (wanted < 1) {
+		fprintf(stderr, "tiles must be at least 1\n");
+		return 1;
+	}
+
+	apr_initialize();
+	atexit(apr_terminate);
+	apr_pool_t* pconf;
+	apr_pool_t* ptemp;
+	apr_pool_t* pool;
+	apr_pool_create(&pconf, NULL);
+	apr_pool_create(&ptemp, pconf);
+	apr_pool_create(&pool, pconf);
+	testmod_server.log.level = APLOG_WARNING;
+	testmod_server.server_hostname = "localhost";
+
+	// the corpus under BENCH_NAMES names, as the config would add it, then a starting child
+	cmd_parms cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.pool = pconf;
+	cmd.temp_pool = ptemp;
+	cmd.server = &testmod_server;
+	for (int i = 0; i < BENCH_NAMES; i++) {
+		bench_names[i] = apr_psprintf(pconf, "bench%02d", i);
+		mbtiles_add_path(&cmd, NULL, bench_names[i], bench_path);
+	}
+	mbtiles_post_config(pconf, pconf, ptemp, &testmod_server);
+	processStarting(pconf, &testmod_server);
+
+	if (SQLITE_OK != sqlite3_open_v2(bench_path, &bench_db, SQLITE_OPEN_READONLY, NULL) || !sampleTiles(wanted, pconf)) {
+		fprintf(stderr, "%s: couldn't read any tile\n", bench_path);
+		return 1;
+	}
+	readRows(pconf);
+	bench_metadata = (TilesetMetadata)tileset_metadata_init_default;
+	for (int row = 0; row < bench_row_count; row++)
+		mbtiles_metadata_parse(bench_rows[2 * row], bench_rows[2 * row + 1], &bench_metadata, pconf);
+	mbtiles_metadata_fill_tiles(&bench_metadata, "localhost", NULL, bench_names[0], pconf);
+
+	// through the module's own open, as MbtilesSqlite would set it up
+	bench_tuned = tilesets[0];
+	bench_tuned.sqlite_immutable = 1;
+	bench_tuned.sqlite_mmap_size = BENCH_MMAP_SIZE;
+	bench_tuned.sqlite_open_flags = 0;
+	if (SQLITE_OK != openDatabase(&bench_tuned, &bench_tuned_db, pconf)) {
+		fprintf(stderr, "%s: couldn't open it immutable with mmap\n", bench_path);
+		return 1;
+	}
+
+	printf("benchmark\tcalls\tns_per_call\n");
+	bench("extractTileRequest", benchExtract, bench_tile_count, pool);
+	bench("findTileset", benchFind, BENCH_NAMES, pool);
+	bench("readTile_cold", benchReadCold, bench_tile_count, pool);
+	for (int i = 0; i < bench_tile_count; i++)
+		benchReadWarm(i, pool);
+	bench("readTile_warm", benchReadWarm, bench_tile_count, pool);
+	bench("readTile_tuned_cold", benchReadTunedCold, bench_tile_count, pool);
+	for (int i = 0; i < bench_tile_count; i++)
+		benchReadTunedWarm(i, pool);
+	bench("readTile_tuned_warm", benchReadTunedWarm, bench_tile_count, pool);
+	bench("readTile_viewport", benchReadViewport, bench_tile_count, pool);
+	bench("decompressGzip", benchDecompress, bench_tile_count, pool);
+	bench("compressGzip", benchCompress, bench_tile_count, pool);
+	bench("mbtiles_metadata_parse", benchMetadataParse, 1, pool);
+	bench("mbtiles_metadata_merge", benchMetadataMerge, 1, pool);
+	bench("mbtiles_metadata_tojson", benchMetadataToJson, 1, pool);
+
+	sqlite3_close(bench_tuned_db);
+	sqlite3_close(bench_db);
+	apr_pool_destroy(pconf);
+	return 0;
+}
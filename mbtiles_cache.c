@@ -0,0 +1,210 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "apr_pools.h"
+#include "apr_strings.h"
+
+#include "mbtiles_cache.h"
+
+#define ENTRY_OVERHEAD (sizeof(CachedTile) + 16)
+
+#if APR_HAS_THREADS
+#define CACHE_LOCK(cache) apr_thread_mutex_lock((cache)->mutex)
+#define CACHE_UNLOCK(cache) apr_thread_mutex_unlock((cache)->mutex)
+#else
+#define CACHE_LOCK(cache)
+#define CACHE_UNLOCK(cache)
+#endif
+
+static uint64_t hash_key(const char* source, int z, int x, int y) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (; *source; source++) {
+		hash ^= (unsigned char)*source;
+		hash *= 1099511628211ULL;
+	}
+	hash ^= ((uint64_t)z << 58) ^ ((uint64_t)x << 29) ^ (uint64_t)y;
+	hash *= 1099511628211ULL;
+	return hash ^ (hash >> 29);
+}
+
+static apr_size_t entry_bytes(const CachedTile* entry) {
+	return ENTRY_OVERHEAD + strlen(entry->source) + entry->size;
+}
+
+// all below under the mutex
+
+static CachedTile** find_link(TileCache* cache, uint64_t hash, const char* source, int z, int x, int y) {
+	CachedTile** link = &cache->buckets[hash % TILE_CACHE_BUCKETS];
+	while (*link) {
+		CachedTile* entry = *link;
+		if (entry->hash == hash && entry->z == z && entry->x == x && entry->y == y && strcmp(entry->source, source) == 0)
+			return link;
+		link = &entry->next_in_bucket;
+	}
+	return link;
+}
+
+static void lru_unlink(TileCache* cache, CachedTile* entry) {
+	if (entry->newer) entry->newer->older = entry->older;
+	else cache->newest = entry->older;
+	if (entry->older) entry->older->newer = entry->newer;
+	else cache->oldest = entry->newer;
+	entry->newer = entry->older = NULL;
+}
+
+static void lru_push(TileCache* cache, CachedTile* entry) {
+	entry->older = cache->newest;
+	entry->newer = NULL;
+	if (cache->newest) cache->newest->newer = entry;
+	cache->newest = entry;
+	if (!cache->oldest) cache->oldest = entry;
+}
+
+static void remove_entry(TileCache* cache, CachedTile** link) {
+	CachedTile* entry = *link;
+	*link = entry->next_in_bucket;
+	lru_unlink(cache, entry);
+	cache->stats.bytes -= entry_bytes(entry);
+	cache->stats.entries--;
+	free(entry);
+}
+
+static apr_status_t cache_cleanup(void* data) {
+	TileCache* cache = (TileCache*)data;
+	while (cache->oldest) {
+		CachedTile* entry = cache->oldest;
+		remove_entry(cache, find_link(cache, entry->hash, entry->source, entry->z, entry->x, entry->y));
+	}
+	cache->max_bytes = 0;
+	return APR_SUCCESS;
+}
+
+apr_status_t mbtiles_cache_init(TileCache* cache, apr_size_t max_bytes, apr_pool_t* pool) {
+	memset(cache, 0, sizeof(TileCache));
+	if (max_bytes == 0)
+		return APR_SUCCESS;
+
+#if APR_HAS_THREADS
+	apr_status_t rv = apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+	if (rv != APR_SUCCESS)
+		return rv;
+#endif
+	cache->max_bytes = max_bytes;
+	apr_pool_cleanup_register(pool, cache, cache_cleanup, apr_pool_cleanup_null);
+	return APR_SUCCESS;
+}
+
+bool mbtiles_cache_enabled(const TileCache* cache) {
+	return cache->max_bytes > 0;
+}
+
+bool mbtiles_cache_get(TileCache* cache, const char* source, int z, int x, int y, apr_pool_t* pool, unsigned char** data, apr_size_t* size, int* flags) {
+	if (!cache->max_bytes)
+		return false;
+
+	uint64_t hash = hash_key(source, z, x, y);
+	bool found = false;
+
+	CACHE_LOCK(cache);
+	CachedTile* entry = *find_link(cache, hash, source, z, x, y);
+	if (entry) {
+		lru_unlink(cache, entry);
+		lru_push(cache, entry);
+		*data = entry->data ? apr_pmemdup(pool, entry->data, entry->size) : NULL;
+		*size = entry->size;
+		if (flags) {
+			*flags = entry->flags;
+			entry->flags = 0;	// flags are reported once
+		}
+		cache->stats.hits++;
+		found = true;
+	}
+	else
+		cache->stats.misses++;
+	CACHE_UNLOCK(cache);
+
+	return found;
+}
+
+void mbtiles_cache_put(TileCache* cache, const char* source, int z, int x, int y, const unsigned char* data, apr_size_t size, int flags) {
+	if (!cache->max_bytes)
+		return;
+
+	apr_size_t source_len = strlen(source);
+	if (!data)
+		size = 0;
+	if (ENTRY_OVERHEAD + source_len + size > cache->max_bytes / 8)
+		return;	// one tile mustn't flush a large part of the cache
+
+	CachedTile* entry = malloc(sizeof(CachedTile) + source_len + size);
+	if (!entry)
+		return;
+	memcpy(entry->source, source, source_len + 1);
+	entry->hash = hash_key(source, z, x, y);
+	entry->z = z;
+	entry->x = x;
+	entry->y = y;
+	entry->flags = flags;
+	entry->size = size;
+	entry->data = NULL;
+	if (data) {
+		entry->data = (unsigned char*)&entry->source[source_len + 1];
+		memcpy(entry->data, data, size);
+	}
+
+	CACHE_LOCK(cache);
+	CachedTile** link = find_link(cache, entry->hash, source, z, x, y);
+	if (*link)
+		remove_entry(cache, link);
+
+	while (cache->oldest && cache->stats.bytes + entry_bytes(entry) > cache->max_bytes) {
+		CachedTile* oldest = cache->oldest;
+		remove_entry(cache, find_link(cache, oldest->hash, oldest->source, oldest->z, oldest->x, oldest->y));
+		cache->stats.evictions++;
+	}
+
+	CachedTile** bucket = &cache->buckets[entry->hash % TILE_CACHE_BUCKETS];
+	entry->next_in_bucket = *bucket;
+	*bucket = entry;
+	lru_push(cache, entry);
+	cache->stats.bytes += entry_bytes(entry);
+	cache->stats.entries++;
+	cache->stats.inserts++;
+	CACHE_UNLOCK(cache);
+}
+
+bool mbtiles_cache_contains(TileCache* cache, const char* source, int z, int x, int y) {
+	if (!cache->max_bytes)
+		return false;
+
+	uint64_t hash = hash_key(source, z, x, y);
+	CACHE_LOCK(cache);
+	bool found = *find_link(cache, hash, source, z, x, y) != NULL;
+	CACHE_UNLOCK(cache);
+	return found;
+}
+
+void mbtiles_cache_remove(TileCache* cache, const char* source, int z, int x, int y) {
+	if (!cache->max_bytes)
+		return;
+
+	uint64_t hash = hash_key(source, z, x, y);
+	CACHE_LOCK(cache);
+	CachedTile** link = find_link(cache, hash, source, z, x, y);
+	if (*link)
+		remove_entry(cache, link);
+	CACHE_UNLOCK(cache);
+}
+
+void mbtiles_cache_get_stats(TileCache* cache, TileCacheStats* stats) {
+	if (!cache->max_bytes) {
+		memset(stats, 0, sizeof(TileCacheStats));
+		return;
+	}
+	CACHE_LOCK(cache);
+	*stats = cache->stats;
+	CACHE_UNLOCK(cache);
+}
@@ -0,0 +1,63 @@
+#pragma once
+#ifndef MBTILES_CACHE_H
+#define MBTILES_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "apr_pools.h"
+#include "apr_thread_mutex.h"
+
+/*
+	Bounded LRU cache of tile blobs inside one child, shared by its threads.
+	A tile is identified by a source string (file path, composite list...) and z/x/y.
+	Absent tiles can be cached too: they come back with *data == NULL.
+*/
+
+#define TILE_CACHE_BUCKETS 16384
+
+typedef struct CachedTile {
+	struct CachedTile* next_in_bucket;
+	struct CachedTile* newer;
+	struct CachedTile* older;
+	uint64_t hash;
+	int z;
+	int x;
+	int y;
+	int flags;
+	apr_size_t size;
+	unsigned char* data;	// NULL for an absent tile
+	char source[1];			// allocated with the entry, followed by data
+} CachedTile;
+
+typedef struct TileCacheStats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t inserts;
+	uint64_t evictions;
+	apr_size_t bytes;
+	apr_size_t entries;
+} TileCacheStats;
+
+typedef struct TileCache {
+	apr_size_t max_bytes;
+	CachedTile* buckets[TILE_CACHE_BUCKETS];
+	CachedTile* newest;
+	CachedTile* oldest;
+	TileCacheStats stats;
+#if APR_HAS_THREADS
+	apr_thread_mutex_t* mutex;
+#endif
+} TileCache;
+
+// max_bytes == 0 disables the cache
+apr_status_t mbtiles_cache_init(TileCache* cache, apr_size_t max_bytes, apr_pool_t* pool);
+bool mbtiles_cache_enabled(const TileCache* cache);
+// copies the tile into pool; the entry's flags are returned in *flags (if not NULL) and then cleared
+bool mbtiles_cache_get(TileCache* cache, const char* source, int z, int x, int y, apr_pool_t* pool, unsigned char** data, apr_size_t* size, int* flags);
+void mbtiles_cache_put(TileCache* cache, const char* source, int z, int x, int y, const unsigned char* data, apr_size_t size, int flags);
+bool mbtiles_cache_contains(TileCache* cache, const char* source, int z, int x, int y);
+void mbtiles_cache_remove(TileCache* cache, const char* source, int z, int x, int y);
+void mbtiles_cache_get_stats(TileCache* cache, TileCacheStats* stats);
+
+#endif	// MBTILES_CACHE_H
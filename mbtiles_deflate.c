@@ -0,0 +1,141 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "apr_pools.h"
+#include "apr_atomic.h"
+
+#include "mbtiles_deflate.h"
+
+void mbtiles_deflate_init(DeflateLevel* deflate, int fast_level, int normal_level, int best_level, int capacity) {
+	memset(deflate, 0, sizeof(DeflateLevel));
+	deflate->fast_level = fast_level;
+	deflate->normal_level = normal_level;
+	deflate->best_level = best_level;
+	deflate->capacity = capacity > 1 ? capacity : 1;
+	deflate->current = normal_level;
+}
+
+void mbtiles_deflate_enter(DeflateLevel* deflate) {
+	apr_atomic_inc32(&deflate->active);
+}
+
+void mbtiles_deflate_leave(DeflateLevel* deflate) {
+	apr_atomic_dec32(&deflate->active);
+}
+
+// in steps from the normal level with no other request to the fast one with every thread busy
+int mbtiles_deflate_level(DeflateLevel* deflate) {
+	int others = (int)apr_atomic_read32(&deflate->active) - 1;
+	int level = deflate->normal_level;
+	if (others > 0 && deflate->capacity > 1) {
+		if (others > deflate->capacity - 1)
+			others = deflate->capacity - 1;
+		level -= (deflate->normal_level - deflate->fast_level) * others / (deflate->capacity - 1);
+	}
+	apr_atomic_set32(&deflate->current, level);
+	return level;
+}
+
+#if APR_HAS_THREADS
+
+static void* APR_THREAD_FUNC deflate_thread(apr_thread_t* thread, void* data) {
+	DeflateLevel* deflate = (DeflateLevel*)data;
+
+	apr_thread_mutex_lock(deflate->mutex);
+	while (!deflate->stop) {
+		if (deflate->count == 0) {
+			apr_thread_cond_wait(deflate->cond, deflate->mutex);
+			continue;
+		}
+		// requests come first: the thread only works while the child has none
+		if (apr_atomic_read32(&deflate->active)) {
+			apr_thread_cond_timedwait(deflate->cond, deflate->mutex, apr_time_from_msec(DEFLATE_IDLE_CHECK));
+			continue;
+		}
+		DeflateJob job = deflate->queue[deflate->head];
+		deflate->head = (deflate->head + 1) % DEFLATE_QUEUE_SIZE;
+		deflate->count--;
+		apr_thread_mutex_unlock(deflate->mutex);
+
+		if (deflate->recompress(&job, deflate->best_level, deflate->job_pool))
+			apr_atomic_inc32(&deflate->stats.recompressed);
+		apr_pool_clear(deflate->job_pool);
+
+		apr_thread_mutex_lock(deflate->mutex);
+	}
+	apr_thread_mutex_unlock(deflate->mutex);
+
+	apr_thread_exit(thread, APR_SUCCESS);
+	return NULL;
+}
+
+static apr_status_t deflate_cleanup(void* data) {
+	DeflateLevel* deflate = (DeflateLevel*)data;
+	apr_status_t rv;
+
+	apr_thread_mutex_lock(deflate->mutex);
+	deflate->stop = 1;
+	deflate->running = 0;
+	apr_thread_cond_signal(deflate->cond);
+	apr_thread_mutex_unlock(deflate->mutex);
+	apr_thread_join(&rv, deflate->thread);
+	return APR_SUCCESS;
+}
+
+apr_status_t mbtiles_deflate_start(DeflateLevel* deflate, DeflateRecompress recompress, apr_pool_t* pool) {
+	deflate->recompress = recompress;
+
+	apr_status_t rv = apr_pool_create(&deflate->job_pool, pool);
+	if (rv == APR_SUCCESS)
+		rv = apr_thread_mutex_create(&deflate->mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+	if (rv == APR_SUCCESS)
+		rv = apr_thread_cond_create(&deflate->cond, pool);
+	if (rv == APR_SUCCESS)
+		rv = apr_thread_create(&deflate->thread, NULL, deflate_thread, deflate, pool);
+	if (rv != APR_SUCCESS)
+		return rv;
+
+	deflate->running = 1;
+	apr_pool_cleanup_register(pool, deflate, deflate_cleanup, apr_pool_cleanup_null);
+	return APR_SUCCESS;
+}
+
+void mbtiles_deflate_queue(DeflateLevel* deflate, const char* source, int z, int x, int y) {
+	if (!deflate->running)
+		return;
+
+	apr_thread_mutex_lock(deflate->mutex);
+	bool skip = false;
+	for (int i = 0; i < deflate->count && !skip; i++) {
+		DeflateJob* job = &deflate->queue[(deflate->head + i) % DEFLATE_QUEUE_SIZE];
+		skip = job->source == source && job->z == z && job->x == x && job->y == y;
+	}
+
+	if (!skip) {
+		if (deflate->count == DEFLATE_QUEUE_SIZE)
+			apr_atomic_inc32(&deflate->stats.dropped);
+		else {
+			DeflateJob* job = &deflate->queue[(deflate->head + deflate->count) % DEFLATE_QUEUE_SIZE];
+			job->source = source;
+			job->z = z;
+			job->x = x;
+			job->y = y;
+			deflate->count++;
+			apr_atomic_inc32(&deflate->stats.queued);
+			apr_thread_cond_signal(deflate->cond);
+		}
+	}
+	apr_thread_mutex_unlock(deflate->mutex);
+}
+
+#else
+
+apr_status_t mbtiles_deflate_start(DeflateLevel* deflate, DeflateRecompress recompress, apr_pool_t* pool) {
+	return APR_ENOTIMPL;
+}
+
+void mbtiles_deflate_queue(DeflateLevel* deflate, const char* source, int z, int x, int y) {
+}
+
+#endif
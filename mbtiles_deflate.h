@@ -0,0 +1,72 @@
+#pragma once
+#ifndef MBTILES_DEFLATE_H
+#define MBTILES_DEFLATE_H
+
+#include <stdbool.h>
+
+#include "apr_pools.h"
+#include "apr_thread_proc.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+
+/*
+	Deflate level of the tiles a child builds per request (composites), following its load: a tile is
+	compressed at the normal level while its request is the only one being served, and down to the fast level
+	as the other threads of the child get busy. A tile sent below the best level can be queued; a background
+	thread compresses it again at the best level once the child is idle, through the caller's callback,
+	which finds the tile and puts it back.
+*/
+
+#define DEFLATE_QUEUE_SIZE 256
+#define DEFLATE_IDLE_CHECK 100	// ms between looks at a busy child
+
+typedef struct DeflateJob {
+	const char* source;	// must outlive the queue
+	int z;
+	int x;
+	int y;
+} DeflateJob;
+
+// true if the tile was compressed again
+typedef bool (*DeflateRecompress)(const DeflateJob* job, int level, apr_pool_t* pool);
+
+typedef struct DeflateStats {
+	apr_uint32_t queued;
+	apr_uint32_t dropped;		// queue full
+	apr_uint32_t recompressed;
+} DeflateStats;
+
+typedef struct DeflateLevel {
+	int fast_level;			// with every thread busy
+	int normal_level;
+	int best_level;			// for the idle thread, 0 for none
+	int capacity;			// threads of the child
+	volatile apr_uint32_t active;	// requests being served
+	volatile apr_uint32_t current;	// level of the last tile
+	volatile DeflateStats stats;
+	int running;
+	DeflateRecompress recompress;
+	DeflateJob queue[DEFLATE_QUEUE_SIZE];
+	int head;
+	int count;
+	int stop;
+#if APR_HAS_THREADS
+	apr_thread_t* thread;
+	apr_thread_mutex_t* mutex;
+	apr_thread_cond_t* cond;
+#endif
+	apr_pool_t* job_pool;
+} DeflateLevel;
+
+void mbtiles_deflate_init(DeflateLevel* deflate, int fast_level, int normal_level, int best_level, int capacity);
+// starts the idle thread; it is stopped by a cleanup of pool
+apr_status_t mbtiles_deflate_start(DeflateLevel* deflate, DeflateRecompress recompress, apr_pool_t* pool);
+// around each request of the child, busy or not
+void mbtiles_deflate_enter(DeflateLevel* deflate);
+void mbtiles_deflate_leave(DeflateLevel* deflate);
+// for a tile about to be compressed, by a thread between enter and leave
+int mbtiles_deflate_level(DeflateLevel* deflate);
+// never blocks; a tile already queued is skipped
+void mbtiles_deflate_queue(DeflateLevel* deflate, const char* source, int z, int x, int y);
+
+#endif	// MBTILES_DEFLATE_H
@@ -0,0 +1,174 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "apr_pools.h"
+#include "apr_strings.h"
+#include "apr_time.h"
+
+#include <sqlite3.h>
+
+#include "mbtiles_extract.h"
+
+#define TAR_BLOCK 512
+
+typedef struct TarHeader {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char checksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+} TarHeader;
+
+static const char zero_block[TAR_BLOCK];
+
+static bool tar_write(TarWriter* tar, const void* data, apr_size_t size) {
+	if (tar->failed || !size)
+		return !tar->failed;
+	if (!tar->write(tar->ctx, data, size))
+		tar->failed = true;
+	tar->bytes += size;
+	return !tar->failed;
+}
+
+void mbtiles_tar_init(TarWriter* tar, ExtractWrite write, void* ctx, apr_time_t mtime) {
+	memset(tar, 0, sizeof(TarWriter));
+	tar->write = write;
+	tar->ctx = ctx;
+	tar->mtime = mtime;
+}
+
+bool mbtiles_tar_add(TarWriter* tar, const char* path, const void* data, apr_size_t size) {
+	TarHeader header;
+	memset(&header, 0, sizeof(header));
+
+	size_t len = strlen(path);
+	const char* name = path;
+	if (len >= sizeof(header.name)) {
+		// the last / that leaves a short enough name
+		const char* split = NULL;
+		for (const char* p = path; *p; p++)
+			if (*p == '/' && (size_t)(p - path) < sizeof(header.prefix) && len - (p - path) - 1 < sizeof(header.name))
+				split = p;
+		if (!split)
+			return false;
+		memcpy(header.prefix, path, split - path);
+		name = split + 1;
+	}
+	memcpy(header.name, name, strlen(name));
+
+	snprintf(header.mode, sizeof(header.mode), "%07o", 0644);
+	snprintf(header.uid, sizeof(header.uid), "%07o", 0);
+	snprintf(header.gid, sizeof(header.gid), "%07o", 0);
+	snprintf(header.size, sizeof(header.size), "%011llo", (unsigned long long)size);
+	snprintf(header.mtime, sizeof(header.mtime), "%011llo", (unsigned long long)apr_time_sec(tar->mtime));
+	header.typeflag = '0';
+	memcpy(header.magic, "ustar", 6);
+	memcpy(header.version, "00", 2);
+
+	// summed with the checksum field as spaces
+	memset(header.checksum, ' ', sizeof(header.checksum));
+	unsigned int checksum = 0;
+	for (size_t i = 0; i < sizeof(header); i++)
+		checksum += ((unsigned char*)&header)[i];
+	snprintf(header.checksum, sizeof(header.checksum), "%06o", checksum);
+	header.checksum[7] = ' ';
+
+	apr_size_t padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+	return tar_write(tar, &header, sizeof(header)) && tar_write(tar, data, size) && tar_write(tar, zero_block, padding);
+}
+
+bool mbtiles_tar_finish(TarWriter* tar) {
+	return tar_write(tar, zero_block, TAR_BLOCK) && tar_write(tar, zero_block, TAR_BLOCK);
+}
+
+static const char* writer_schema =
+	"PRAGMA page_size=16384;"
+	"PRAGMA journal_mode=OFF;"
+	"PRAGMA synchronous=OFF;"
+	"CREATE TABLE metadata (name TEXT, value TEXT);"
+	"CREATE UNIQUE INDEX name ON metadata (name);"
+	"CREATE TABLE tiles (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_data BLOB);"
+	"CREATE UNIQUE INDEX tile_index ON tiles (zoom_level, tile_column, tile_row);"
+	"BEGIN;";
+
+int mbtiles_writer_open(MbtilesWriter* writer, const char* path) {
+	memset(writer, 0, sizeof(MbtilesWriter));
+	int rc = sqlite3_open_v2(path, &writer->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+	if (rc == SQLITE_OK)
+		rc = sqlite3_exec(writer->db, writer_schema, NULL, NULL, NULL);
+	if (rc == SQLITE_OK)
+		rc = sqlite3_prepare_v2(writer->db, "INSERT INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?, ?, ?, ?);", -1, &writer->add_tile, NULL);
+	if (rc == SQLITE_OK)
+		rc = sqlite3_prepare_v2(writer->db, "INSERT OR REPLACE INTO metadata (name, value) VALUES (?, ?);", -1, &writer->add_metadata, NULL);
+	if (rc != SQLITE_OK)
+		mbtiles_writer_close(writer, false);
+	return rc;
+}
+
+int mbtiles_writer_metadata(MbtilesWriter* writer, const char* name, const char* value) {
+	sqlite3_bind_text(writer->add_metadata, 1, name, -1, SQLITE_STATIC);
+	sqlite3_bind_text(writer->add_metadata, 2, value, -1, SQLITE_STATIC);
+	int rc = sqlite3_step(writer->add_metadata);
+	sqlite3_reset(writer->add_metadata);
+	return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+int mbtiles_writer_put_metadata(MbtilesWriter* writer, const TilesetMetadata* metadata, apr_pool_t* pool) {
+	int rc = SQLITE_OK;
+	if (metadata->name)
+		rc = mbtiles_writer_metadata(writer, "name", metadata->name);
+	if (rc == SQLITE_OK && metadata->format)
+		rc = mbtiles_writer_metadata(writer, "format", metadata->format);
+	if (rc == SQLITE_OK && metadata->attribution && metadata->attribution[0])
+		rc = mbtiles_writer_metadata(writer, "attribution", metadata->attribution);
+	if (rc == SQLITE_OK && metadata->bounds[0] != NOT_SET_BOUNDS)
+		rc = mbtiles_writer_metadata(writer, "bounds", apr_psprintf(pool, "%.6f,%.6f,%.6f,%.6f",
+			metadata->bounds[0], metadata->bounds[1], metadata->bounds[2], metadata->bounds[3]));
+	if (rc == SQLITE_OK && metadata->center[0] != NOT_SET_CENTER)
+		rc = mbtiles_writer_metadata(writer, "center", apr_psprintf(pool, "%.6f,%.6f,%d", metadata->center[0], metadata->center[1], (int)metadata->center[2]));
+	if (rc == SQLITE_OK && metadata->min_zoom != NOT_SET_ZOOM)
+		rc = mbtiles_writer_metadata(writer, "minzoom", apr_itoa(pool, metadata->min_zoom));
+	if (rc == SQLITE_OK && metadata->max_zoom != NOT_SET_ZOOM)
+		rc = mbtiles_writer_metadata(writer, "maxzoom", apr_itoa(pool, metadata->max_zoom));
+	if (rc == SQLITE_OK && metadata->vector_layers && metadata->vector_layers[0])
+		rc = mbtiles_writer_metadata(writer, "json", apr_psprintf(pool, "{\"vector_layers\":[%s]}", metadata->vector_layers));
+	return rc;
+}
+
+int mbtiles_writer_add(MbtilesWriter* writer, int z, int x, int y, const void* data, apr_size_t size) {
+	sqlite3_bind_int(writer->add_tile, 1, z);
+	sqlite3_bind_int(writer->add_tile, 2, x);
+	sqlite3_bind_int(writer->add_tile, 3, y);
+	sqlite3_bind_blob(writer->add_tile, 4, data, (int)size, SQLITE_STATIC);
+	int rc = sqlite3_step(writer->add_tile);
+	sqlite3_reset(writer->add_tile);
+	if (rc != SQLITE_DONE)
+		return rc;
+	writer->tiles++;
+	return SQLITE_OK;
+}
+
+int mbtiles_writer_close(MbtilesWriter* writer, bool commit) {
+	if (!writer->db)
+		return SQLITE_MISUSE;
+	sqlite3_finalize(writer->add_tile);
+	sqlite3_finalize(writer->add_metadata);
+	int rc = commit ? sqlite3_exec(writer->db, "COMMIT;", NULL, NULL, NULL) : SQLITE_ABORT;
+	int close_rc = sqlite3_close(writer->db);
+	writer->db = NULL;
+	return rc == SQLITE_OK ? close_rc : rc;
+}
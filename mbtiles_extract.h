@@ -0,0 +1,53 @@
+#pragma once
+#ifndef MBTILES_EXTRACT_H
+#define MBTILES_EXTRACT_H
+
+#include <stdbool.h>
+
+#include <sqlite3.h>
+
+#include "apr_pools.h"
+#include "apr_time.h"
+
+#include "mbtiles_metadata.h"
+
+/*
+	Writers for region extracts. They are fed one tile at a time, in the order the tiles are scanned,
+	so only the current tile is ever held in memory:
+		TarWriter		a ustar stream sent through a callback as it's written
+		MbtilesWriter	an .mbtiles file written by SQLite in one transaction, without a journal
+*/
+
+// false if the data couldn't be written (the client went away)
+typedef bool (*ExtractWrite)(void* ctx, const void* data, apr_size_t size);
+
+typedef struct TarWriter {
+	ExtractWrite write;
+	void* ctx;
+	apr_time_t mtime;
+	apr_uint64_t bytes;
+	bool failed;
+} TarWriter;
+
+void mbtiles_tar_init(TarWriter* tar, ExtractWrite write, void* ctx, apr_time_t mtime);
+// path up to 255 characters, split between the ustar prefix and name at a /
+bool mbtiles_tar_add(TarWriter* tar, const char* path, const void* data, apr_size_t size);
+bool mbtiles_tar_finish(TarWriter* tar);
+
+typedef struct MbtilesWriter {
+	sqlite3* db;
+	sqlite3_stmt* add_tile;
+	sqlite3_stmt* add_metadata;
+	apr_uint64_t tiles;
+} MbtilesWriter;
+
+// path must be a new or empty file
+int mbtiles_writer_open(MbtilesWriter* writer, const char* path);
+int mbtiles_writer_metadata(MbtilesWriter* writer, const char* name, const char* value);
+// the metadata rows of the MBTiles spec, from parsed metadata
+int mbtiles_writer_put_metadata(MbtilesWriter* writer, const TilesetMetadata* metadata, apr_pool_t* pool);
+// y is a TMS row, like in the tiles table
+int mbtiles_writer_add(MbtilesWriter* writer, int z, int x, int y, const void* data, apr_size_t size);
+int mbtiles_writer_close(MbtilesWriter* writer, bool commit);
+
+#endif	// MBTILES_EXTRACT_H
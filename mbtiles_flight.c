@@ -0,0 +1,133 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "apr_pools.h"
+#include "apr_strings.h"
+#include "apr_time.h"
+
+#include "mbtiles_flight.h"
+
+apr_status_t mbtiles_flight_init(FlightTable* table, apr_pool_t* pool) {
+	memset(table, 0, sizeof(FlightTable));
+#if APR_HAS_THREADS
+	apr_status_t rv = apr_thread_mutex_create(&table->mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+	if (rv != APR_SUCCESS)
+		return rv;
+	return apr_thread_cond_create(&table->cond, pool);
+#else
+	return APR_SUCCESS;
+#endif
+}
+
+// under the mutex
+static void release_if_unused(TileFlight* flight) {
+	if (flight->leader_left && flight->waiters == 0) {
+		free(flight->data);
+		flight->data = NULL;
+		flight->in_use = 0;
+	}
+}
+
+TileFlight* mbtiles_flight_join(FlightTable* table, const char* key, bool* leader) {
+#if APR_HAS_THREADS
+	if (!table->mutex || strlen(key) >= MAX_FLIGHT_KEY)
+		return NULL;
+
+	TileFlight* free_slot = NULL;
+	TileFlight* flight = NULL;
+
+	apr_thread_mutex_lock(table->mutex);
+	for (int i = 0; i < MAX_FLIGHTS; i++) {
+		TileFlight* f = &table->flights[i];
+		if (!f->in_use) {
+			if (!free_slot) free_slot = f;
+		}
+		else if (!f->done && strcmp(f->key, key) == 0) {
+			flight = f;
+			break;
+		}
+	}
+
+	if (flight) {
+		flight->waiters++;
+		*leader = false;
+	}
+	else if (free_slot) {
+		flight = free_slot;
+		memset(flight, 0, sizeof(TileFlight));
+		strcpy(flight->key, key);
+		flight->in_use = 1;
+		*leader = true;
+	}
+	apr_thread_mutex_unlock(table->mutex);
+
+	return flight;
+#else
+	return NULL;
+#endif
+}
+
+bool mbtiles_flight_wait(FlightTable* table, TileFlight* flight, apr_pool_t* pool, unsigned char** data, apr_size_t* size, int* max_age, bool* immutable) {
+	bool ok = false;
+#if APR_HAS_THREADS
+	apr_time_t deadline = apr_time_now() + FLIGHT_WAIT_TIMEOUT;
+
+	apr_thread_mutex_lock(table->mutex);
+	while (!flight->done) {
+		apr_time_t left = deadline - apr_time_now();
+		if (left <= 0)
+			break;
+		apr_thread_cond_timedwait(table->cond, table->mutex, left);
+	}
+
+	if (flight->done && flight->data) {
+		*data = apr_pmemdup(pool, flight->data, flight->size);
+		*size = flight->size;
+		*max_age = flight->max_age;
+		*immutable = flight->immutable;
+		ok = true;
+	}
+
+	flight->waiters--;
+	release_if_unused(flight);
+	apr_thread_mutex_unlock(table->mutex);
+#endif
+	return ok;
+}
+
+void mbtiles_flight_publish(FlightTable* table, TileFlight* flight, const unsigned char* data, apr_size_t size, int max_age, bool immutable) {
+#if APR_HAS_THREADS
+	unsigned char* copy = malloc(size ? size : 1);
+
+	apr_thread_mutex_lock(table->mutex);
+	if (copy && !flight->done) {
+		memcpy(copy, data, size);
+		flight->data = copy;
+		flight->size = size;
+		flight->max_age = max_age;
+		flight->immutable = immutable;
+		copy = NULL;
+	}
+	flight->done = 1;
+	apr_thread_cond_broadcast(table->cond);
+	apr_thread_mutex_unlock(table->mutex);
+
+	free(copy);
+#endif
+}
+
+void mbtiles_flight_leave(FlightTable* table, TileFlight* flight) {
+#if APR_HAS_THREADS
+	apr_thread_mutex_lock(table->mutex);
+	if (!flight->done) {
+		// no result, the waiters compute their own
+		flight->done = 1;
+		apr_thread_cond_broadcast(table->cond);
+	}
+	flight->leader_left = 1;
+	release_if_unused(flight);
+	apr_thread_mutex_unlock(table->mutex);
+#endif
+}
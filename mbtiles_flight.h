@@ -0,0 +1,50 @@
+#pragma once
+#ifndef MBTILES_FLIGHT_H
+#define MBTILES_FLIGHT_H
+
+#include <stdbool.h>
+
+#include "apr_pools.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+
+/*
+	Single-flight for identical in-flight requests inside one child.
+	The first request for a key becomes the leader and computes the response,
+	the others wait for it and get a copy of the result.
+*/
+
+#define MAX_FLIGHTS 64
+#define MAX_FLIGHT_KEY 256
+#define FLIGHT_WAIT_TIMEOUT apr_time_from_sec(10)
+
+typedef struct TileFlight {
+	char key[MAX_FLIGHT_KEY];
+	int in_use;
+	int done;			// leader published or gave up
+	int leader_left;
+	int waiters;
+	unsigned char* data;
+	apr_size_t size;
+	int max_age;
+	int immutable;		// max_age is the immutable one
+} TileFlight;
+
+typedef struct FlightTable {
+#if APR_HAS_THREADS
+	apr_thread_mutex_t* mutex;
+	apr_thread_cond_t* cond;
+#endif
+	TileFlight flights[MAX_FLIGHTS];
+} FlightTable;
+
+apr_status_t mbtiles_flight_init(FlightTable* table, apr_pool_t* pool);
+// NULL if the request can't be coalesced (no threads, key too long, table full)
+TileFlight* mbtiles_flight_join(FlightTable* table, const char* key, bool* leader);
+// waiter side: false if the leader failed, the caller then computes the response itself
+bool mbtiles_flight_wait(FlightTable* table, TileFlight* flight, apr_pool_t* pool, unsigned char** data, apr_size_t* size, int* max_age, bool* immutable);
+// leader side
+void mbtiles_flight_publish(FlightTable* table, TileFlight* flight, const unsigned char* data, apr_size_t size, int max_age, bool immutable);
+void mbtiles_flight_leave(FlightTable* table, TileFlight* flight);
+
+#endif	// MBTILES_FLIGHT_H
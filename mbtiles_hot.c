@@ -0,0 +1,191 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "apr_pools.h"
+#include "apr_strings.h"
+#include "apr_file_io.h"
+#include "apr_atomic.h"
+
+#include "mbtiles_hot.h"
+
+static const uint64_t sketch_seeds[HOT_SKETCH_DEPTH] = {
+	0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL
+};
+
+static uint64_t hash_tile(const char* version, const char* name, int z, int x, int y) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (; *version; version++) {
+		hash ^= (unsigned char)*version;
+		hash *= 1099511628211ULL;
+	}
+	hash ^= '/';
+	hash *= 1099511628211ULL;
+	for (; *name; name++) {
+		hash ^= (unsigned char)*name;
+		hash *= 1099511628211ULL;
+	}
+	hash ^= ((uint64_t)z << 58) ^ ((uint64_t)x << 29) ^ (uint64_t)y;
+	return hash;
+}
+
+static apr_uint32_t sketch_column(uint64_t hash, int row) {
+	uint64_t h = (hash ^ sketch_seeds[row]) * 0xFF51AFD7ED558CCDULL;
+	return (apr_uint32_t)((h ^ (h >> 32)) % HOT_SKETCH_WIDTH);
+}
+
+apr_status_t mbtiles_hot_init(HotSketch* sketch, const char* path, apr_interval_time_t save_interval, apr_pool_t* pool) {
+	memset(sketch, 0, sizeof(HotSketch));
+	sketch->path = path;
+	sketch->save_interval = save_interval;
+	sketch->last_save = apr_time_now();
+	sketch->pool = pool;
+#if APR_HAS_THREADS
+	apr_status_t rv = apr_thread_mutex_create(&sketch->mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+	if (rv != APR_SUCCESS)
+		return rv;
+#endif
+	sketch->enabled = 1;
+	return APR_SUCCESS;
+}
+
+// under the mutex
+static void update_top(HotSketch* sketch, const char* version, const char* name, int z, int x, int y, apr_uint32_t estimate) {
+	int min_index = -1;
+	for (int i = 0; i < sketch->top_count; i++) {
+		HotTile* tile = &sketch->top[i];
+		if (tile->z == z && tile->x == x && tile->y == y && strcmp(tile->name, name) == 0 && strcmp(tile->version, version) == 0) {
+			tile->count = estimate;
+			return;
+		}
+		if (min_index == -1 || tile->count < sketch->top[min_index].count)
+			min_index = i;
+	}
+
+	HotTile* slot;
+	if (sketch->top_count < HOT_TOP_K)
+		slot = &sketch->top[sketch->top_count++];
+	else if (estimate > sketch->top[min_index].count)
+		slot = &sketch->top[min_index];
+	else
+		return;
+
+	apr_cpystrn(slot->version, version, HOT_NAME_SIZE);
+	apr_cpystrn(slot->name, name, HOT_NAME_SIZE);
+	slot->z = z;
+	slot->x = x;
+	slot->y = y;
+	slot->count = estimate;
+}
+
+void mbtiles_hot_record(HotSketch* sketch, const char* version, const char* name, int z, int x, int y) {
+	if (!sketch->enabled)
+		return;
+
+	uint64_t hash = hash_tile(version, name, z, x, y);
+	apr_uint32_t estimate = UINT32_MAX;
+	for (int row = 0; row < HOT_SKETCH_DEPTH; row++) {
+		apr_uint32_t count = apr_atomic_inc32(&sketch->counters[row][sketch_column(hash, row)]) + 1;
+		if (count < estimate)
+			estimate = count;
+	}
+
+	bool save = false;
+#if APR_HAS_THREADS
+	// never make a request wait for the sketch
+	if (apr_thread_mutex_trylock(sketch->mutex) != APR_SUCCESS)
+		return;
+#endif
+	update_top(sketch, version, name, z, x, y, estimate);
+	if (sketch->path && apr_time_now() - sketch->last_save >= sketch->save_interval) {
+		sketch->last_save = apr_time_now();
+		save = true;
+	}
+#if APR_HAS_THREADS
+	apr_thread_mutex_unlock(sketch->mutex);
+#endif
+
+	if (save)
+		mbtiles_hot_save(sketch);
+}
+
+static int compare_hot(const void* a, const void* b) {
+	const HotTile* ta = (const HotTile*)a;
+	const HotTile* tb = (const HotTile*)b;
+	if (ta->count > tb->count) return -1;
+	if (ta->count < tb->count) return 1;
+	return 0;
+}
+
+apr_status_t mbtiles_hot_save(HotSketch* sketch) {
+	HotTile top[HOT_TOP_K];
+	int count;
+
+#if APR_HAS_THREADS
+	apr_thread_mutex_lock(sketch->mutex);
+#endif
+	count = sketch->top_count;
+	memcpy(top, sketch->top, count * sizeof(HotTile));
+	// halve everything so the sketch follows changing traffic
+	for (int i = 0; i < sketch->top_count; i++)
+		sketch->top[i].count /= 2;
+#if APR_HAS_THREADS
+	apr_thread_mutex_unlock(sketch->mutex);
+#endif
+	for (int row = 0; row < HOT_SKETCH_DEPTH; row++)
+		for (int column = 0; column < HOT_SKETCH_WIDTH; column++)
+			apr_atomic_set32(&sketch->counters[row][column], apr_atomic_read32(&sketch->counters[row][column]) / 2);
+
+	qsort(top, count, sizeof(HotTile), compare_hot);
+
+	apr_pool_t* pool;
+	apr_status_t rv = apr_pool_create(&pool, sketch->pool);
+	if (rv != APR_SUCCESS)
+		return rv;
+
+	// every child writes its own temporary file, the rename makes the new list visible at once
+	apr_file_t* file;
+	char* tmp_path = apr_pstrcat(pool, sketch->path, ".XXXXXX", NULL);
+	rv = apr_file_mktemp(&file, tmp_path, APR_CREATE | APR_WRITE | APR_TRUNCATE | APR_BUFFERED, pool);
+	if (rv == APR_SUCCESS) {
+		const char* header = "# mod_mbtiles hot tiles: version name z x y(tms) count\n";
+		rv = apr_file_write_full(file, header, strlen(header), NULL);
+		for (int i = 0; i < count && rv == APR_SUCCESS; i++) {
+			char* line = apr_psprintf(pool, "%s %s %d %d %d %u\n", top[i].version, top[i].name, top[i].z, top[i].x, top[i].y, top[i].count);
+			rv = apr_file_write_full(file, line, strlen(line), NULL);
+		}
+		apr_file_close(file);
+
+		if (rv == APR_SUCCESS)
+			rv = apr_file_rename(tmp_path, sketch->path, pool);
+		else
+			apr_file_remove(tmp_path, pool);
+	}
+
+	apr_pool_destroy(pool);
+	return rv;
+}
+
+int mbtiles_hot_load(const char* path, HotTile* tiles, int max, apr_pool_t* pool) {
+	FILE* file = fopen(path, "r");
+	if (!file)
+		return 0;
+
+	char line[256];
+	int count = 0;
+	while (count < max && fgets(line, sizeof(line), file)) {
+		if (line[0] == '#')
+			continue;
+		HotTile* tile = &tiles[count];
+		// a file from before versions were saved has one field less and is skipped
+		if (sscanf(line, "%39s %39s %d %d %d %u", tile->version, tile->name, &tile->z, &tile->x, &tile->y, &tile->count) == 6)
+			count++;
+	}
+	fclose(file);
+
+	qsort(tiles, count, sizeof(HotTile), compare_hot);
+	return count;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#ifndef MBTILES_HOT_H
+#define MBTILES_HOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "apr_pools.h"
+#include "apr_time.h"
+#include "apr_thread_mutex.h"
+
+/*
+	Which tiles are hot: a count-min sketch of all requested tiles plus the top-K of its estimates.
+	Each child keeps its own and saves its top-K to a file every few minutes; a starting child
+	reads the file back to warm its caches. A tile is keyed by its tileset's version and name, so the same
+	name added under several versions counts apart. y is the TMS row, as stored in .mbtiles.
+*/
+
+#define HOT_SKETCH_DEPTH 4
+#define HOT_SKETCH_WIDTH 8192
+#define HOT_TOP_K 256
+#define HOT_NAME_SIZE 40
+
+typedef struct HotTile {
+	char version[HOT_NAME_SIZE];
+	char name[HOT_NAME_SIZE];
+	int z;
+	int x;
+	int y;
+	apr_uint32_t count;
+} HotTile;
+
+typedef struct HotSketch {
+	int enabled;
+	const char* path;
+	apr_interval_time_t save_interval;
+	apr_time_t last_save;
+	volatile apr_uint32_t counters[HOT_SKETCH_DEPTH][HOT_SKETCH_WIDTH];
+	HotTile top[HOT_TOP_K];
+	int top_count;
+#if APR_HAS_THREADS
+	apr_thread_mutex_t* mutex;
+#endif
+	apr_pool_t* pool;
+} HotSketch;
+
+apr_status_t mbtiles_hot_init(HotSketch* sketch, const char* path, apr_interval_time_t save_interval, apr_pool_t* pool);
+// cheap enough for every request; saves the top-K when it is due
+void mbtiles_hot_record(HotSketch* sketch, const char* version, const char* name, int z, int x, int y);
+apr_status_t mbtiles_hot_save(HotSketch* sketch);
+// reads up to max tiles, hottest first; returns how many
+int mbtiles_hot_load(const char* path, HotTile* tiles, int max, apr_pool_t* pool);
+
+#endif	// MBTILES_HOT_H
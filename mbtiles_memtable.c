@@ -0,0 +1,175 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "apr_pools.h"
+
+#include <sqlite3.h>
+
+#include "mbtiles_memtable.h"
+
+#define NO_BLOB ((uint64_t)-1)
+
+typedef struct BlobSlot {
+	uint64_t hash;
+	uint64_t offset;
+	uint32_t length;
+} BlobSlot;
+
+static uint64_t hash_blob(const unsigned char* data, apr_size_t length) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (apr_size_t i = 0; i < length; i++) {
+		hash ^= data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static int compare_entries(const void* a, const void* b) {
+	const MemtableEntry* ea = (const MemtableEntry*)a;
+	const MemtableEntry* eb = (const MemtableEntry*)b;
+	if (ea->tile_id < eb->tile_id) return -1;
+	if (ea->tile_id > eb->tile_id) return 1;
+	return 0;
+}
+
+static apr_status_t memtable_cleanup(void* data) {
+	TileMemtable* table = (TileMemtable*)data;
+	free(table->entries);
+	free(table->arena);
+	table->entries = NULL;
+	table->arena = NULL;
+	table->count = 0;
+	return APR_SUCCESS;
+}
+
+apr_status_t mbtiles_memtable_load(TileMemtable* table, sqlite3* db, int min_zoom, int max_zoom, apr_pool_t* pool) {
+	sqlite3_stmt* pStmt;
+	sqlite3_int64 count = 0;
+	sqlite3_int64 total = 0;
+
+	memset(table, 0, sizeof(TileMemtable));
+	table->min_zoom = min_zoom;
+	table->max_zoom = max_zoom;
+
+	// size everything up front
+	if (SQLITE_OK != sqlite3_prepare_v2(db, "SELECT COUNT(*), SUM(LENGTH(tile_data)) FROM tiles WHERE zoom_level BETWEEN ? AND ?;", -1, &pStmt, NULL))
+		return APR_EGENERAL;
+	sqlite3_bind_int(pStmt, 1, min_zoom);
+	sqlite3_bind_int(pStmt, 2, max_zoom);
+	if (sqlite3_step(pStmt) == SQLITE_ROW) {
+		count = sqlite3_column_int64(pStmt, 0);
+		total = sqlite3_column_int64(pStmt, 1);
+	}
+	sqlite3_finalize(pStmt);
+
+	table->entries = malloc((count ? count : 1) * sizeof(MemtableEntry));
+	table->arena = malloc(total ? total : 1);
+	apr_size_t slots_count = 16;
+	while (slots_count < (apr_size_t)count * 2)
+		slots_count *= 2;
+	BlobSlot* slots = malloc(slots_count * sizeof(BlobSlot));
+
+	apr_pool_cleanup_register(pool, table, memtable_cleanup, apr_pool_cleanup_null);
+
+	if (!table->entries || !table->arena || !slots) {
+		free(slots);
+		return APR_ENOMEM;
+	}
+	for (apr_size_t i = 0; i < slots_count; i++)
+		slots[i].offset = NO_BLOB;
+
+	apr_status_t rv = APR_SUCCESS;
+	if (SQLITE_OK != sqlite3_prepare_v2(db, "SELECT zoom_level, tile_column, tile_row, tile_data FROM tiles WHERE zoom_level BETWEEN ? AND ?;", -1, &pStmt, NULL)) {
+		free(slots);
+		return APR_EGENERAL;
+	}
+	sqlite3_bind_int(pStmt, 1, min_zoom);
+	sqlite3_bind_int(pStmt, 2, max_zoom);
+
+	int rc;
+	while ((rc = sqlite3_step(pStmt)) == SQLITE_ROW) {
+		if (table->count == (apr_size_t)count) {
+			rv = APR_EGENERAL;	// file changed under us
+			break;
+		}
+
+		int z = sqlite3_column_int(pStmt, 0);
+		int x = sqlite3_column_int(pStmt, 1);
+		int y = sqlite3_column_int(pStmt, 2);
+		const unsigned char* data = sqlite3_column_blob(pStmt, 3);
+		apr_size_t length = sqlite3_column_bytes(pStmt, 3);
+
+		MemtableEntry* entry = &table->entries[table->count++];
+		entry->tile_id = mbtiles_zxy_to_tileid(z, x, mbtiles_flip_y(z, y));
+		entry->length = (uint32_t)length;
+		entry->reserved = 0;
+
+		uint64_t hash = hash_blob(data, length);
+		apr_size_t s = hash & (slots_count - 1);
+		while (slots[s].offset != NO_BLOB) {
+			if (slots[s].hash == hash && slots[s].length == length && memcmp(&table->arena[slots[s].offset], data, length) == 0)
+				break;
+			s = (s + 1) & (slots_count - 1);
+		}
+
+		if (slots[s].offset == NO_BLOB) {
+			if (table->arena_size + length > (apr_size_t)total) {
+				rv = APR_EGENERAL;
+				break;
+			}
+			memcpy(&table->arena[table->arena_size], data, length);
+			slots[s].hash = hash;
+			slots[s].length = (uint32_t)length;
+			slots[s].offset = table->arena_size;
+			table->arena_size += length;
+		}
+		entry->offset = slots[s].offset;
+	}
+	if (rc != SQLITE_DONE && rv == APR_SUCCESS)
+		rv = APR_EGENERAL;
+
+	sqlite3_finalize(pStmt);
+	free(slots);
+
+	// give back what deduplication saved
+	if (table->arena_size < (apr_size_t)total) {
+		unsigned char* arena = realloc(table->arena, table->arena_size ? table->arena_size : 1);
+		if (arena)
+			table->arena = arena;
+	}
+
+	qsort(table->entries, table->count, sizeof(MemtableEntry), compare_entries);
+
+	return rv;
+}
+
+bool mbtiles_memtable_find(const TileMemtable* table, int z, int x, int y, const unsigned char** data, apr_size_t* size) {
+	if (!table->count || z < 0 || z > 31 || x < 0 || y < 0)
+		return false;
+
+	uint64_t tile_id = mbtiles_zxy_to_tileid(z, x, y);
+
+	apr_size_t low = 0;
+	apr_size_t high = table->count;
+	while (low < high) {
+		apr_size_t middle = low + (high - low) / 2;
+		if (table->entries[middle].tile_id < tile_id)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if (low == table->count || table->entries[low].tile_id != tile_id)
+		return false;
+
+	*data = &table->arena[table->entries[low].offset];
+	*size = table->entries[low].length;
+	return true;
+}
+
+apr_size_t mbtiles_memtable_bytes(const TileMemtable* table) {
+	return table->count * sizeof(MemtableEntry) + table->arena_size;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#ifndef MBTILES_MEMTABLE_H
+#define MBTILES_MEMTABLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "apr_pools.h"
+
+#include <sqlite3.h>
+
+#include "mbtiles_tileid.h"
+
+/*
+	Tiles of a zoom range held in memory: entries sorted by tile ID pointing into one blob arena.
+	Identical blobs (sea, land) are stored once. Loaded before the children fork so they share the pages.
+*/
+
+typedef struct MemtableEntry {
+	uint64_t tile_id;
+	uint64_t offset;
+	uint32_t length;
+	uint32_t reserved;
+} MemtableEntry;
+
+typedef struct TileMemtable {
+	int min_zoom;
+	int max_zoom;
+	MemtableEntry* entries;
+	apr_size_t count;
+	unsigned char* arena;
+	apr_size_t arena_size;
+} TileMemtable;
+
+// memory is released with pool
+apr_status_t mbtiles_memtable_load(TileMemtable* table, sqlite3* db, int min_zoom, int max_zoom, apr_pool_t* pool);
+// x/y are XYZ; false if not in the table
+bool mbtiles_memtable_find(const TileMemtable* table, int z, int x, int y, const unsigned char** data, apr_size_t* size);
+apr_size_t mbtiles_memtable_bytes(const TileMemtable* table);
+
+#endif	// MBTILES_MEMTABLE_H
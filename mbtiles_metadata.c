@@ -3,6 +3,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 #include "apr_pools.h"
 #include "apr_strings.h"
@@ -48,6 +49,7 @@ const char* vector_layers_pattern = "\"vector_layers\":[";
 
 int write_json_begin(char* json, unsigned int buffer_len);
 int write_json_prop(char* json, unsigned int buffer_len, char* name, char* value);
+static size_t json_escaped_length(const char* value);
 int write_json_object(char* json, unsigned int buffer_len, char* name, char* value);
 int write_json_end(char* json, unsigned int buffer_len);
 int write_json_next(char* json, unsigned int buffer_len);
@@ -88,7 +90,7 @@ void mbtiles_metadata_fill_tiles(TilesetMetadata* metadata, char* server_name, c
 	strcat_s(metadata->tiles, len, server_name);
 	strcat_s(metadata->tiles, len, "/");
 	if (version) {
-		strcat_s(metadata->tiles, len, server_name);
+		strcat_s(metadata->tiles, len, version);
 		strcat_s(metadata->tiles, len, "/");
 	}
 	strcat_s(metadata->tiles, len, full_name);
@@ -296,11 +298,11 @@ int find_pos(const char* string, const char* substring) {
 static size_t mbtiles_metadata_tojson_length(TilesetMetadata* metadata) {
 	size_t len = 0;
 	if (metadata->name)
-		len += strlen(metadata->name);
+		len += json_escaped_length(metadata->name);
 	if (metadata->attribution)
-		len += strlen(metadata->attribution);
+		len += json_escaped_length(metadata->attribution);
 	if (metadata->format)
-		len += strlen(metadata->format);
+		len += json_escaped_length(metadata->format);
 	if (metadata->vector_layers)
 		len += strlen(metadata->vector_layers);
 	len += (3 + 1 + 6) * 4;		// bounds
@@ -460,11 +462,19 @@ int write_json_next(char* json, unsigned int buffer_len) {
 	return size;
 }
 
+// length of value written inside a JSON string: " and \ escaped, control characters as \u00XX
+static size_t json_escaped_length(const char* value) {
+	size_t length = 0;
+	for (const unsigned char* c = (const unsigned char*)value; *c; c++)
+		length += *c == '"' || *c == '\\' ? 2 : *c < 0x20 ? 6 : 1;
+	return length;
+}
+
 int write_json_prop(char* json, unsigned int buffer_len, char* name, char* value) {
 	unsigned int name_length = strlen(name);
-	unsigned int value_length = strlen(value);
+	unsigned int value_length = json_escaped_length(value);
 
-	if (buffer_len < 1 + name_length + 3 + value_length + 1)
+	if (buffer_len < 1 + name_length + 3 + value_length + 1 + 1)
 		return 0;
 
 	char* json_start = json;
@@ -474,7 +484,19 @@ int write_json_prop(char* json, unsigned int buffer_len, char* name, char* value
 	*json = '"';	json++;
 	*json = ':';	json++;
 	*json = '"';	json++;
-	memcpy(json, value, value_length); json += value_length;
+	for (const unsigned char* c = (const unsigned char*)value; *c; c++) {
+		if (*c == '"' || *c == '\\') {
+			*json = '\\';	json++;
+			*json = *c;		json++;
+		}
+		else if (*c < 0x20) {
+			snprintf(json, 7, "\\u%04x", *c);
+			json += 6;
+		}
+		else {
+			*json = *c;		json++;
+		}
+	}
 	*json = '"';	json++;
 
 	*json = 0;
@@ -10,7 +10,7 @@ typedef struct TilesetMetadate {
 	char* format;
 	/* SHOULD */
 	float bounds[4];
-	int center[3];
+	double center[3];	// longitude, latitude, zoom
 	int min_zoom;
 	int max_zoom;
 	/* MAY */
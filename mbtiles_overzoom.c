@@ -0,0 +1,565 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "apr_pools.h"
+
+#include "mbtiles_overzoom.h"
+
+// protobuf wire types
+#define WIRE_VARINT	0
+#define WIRE_FIXED64	1
+#define WIRE_BYTES	2
+#define WIRE_FIXED32	5
+
+// fields of the vector tile spec
+#define TILE_LAYERS		3
+#define LAYER_FEATURES	2
+#define LAYER_EXTENT	5
+#define FEATURE_TYPE	3
+#define FEATURE_GEOMETRY	4
+
+#define GEOM_POINT		1
+#define GEOM_LINESTRING	2
+#define GEOM_POLYGON	3
+
+#define CMD_MOVE_TO		1
+#define CMD_LINE_TO		2
+#define CMD_CLOSE_PATH	7
+
+#define DEFAULT_EXTENT 4096
+
+typedef struct MvtBuffer {
+	unsigned char* data;	// malloc'd, reused from feature to feature
+	apr_size_t size;
+	apr_size_t capacity;
+} MvtBuffer;
+
+typedef struct MvtReader {
+	const unsigned char* p;
+	const unsigned char* end;
+} MvtReader;
+
+typedef struct MvtField {
+	uint32_t number;
+	int type;
+	uint64_t value;				// WIRE_VARINT
+	const unsigned char* data;	// WIRE_BYTES
+	apr_size_t size;
+	const unsigned char* start;	// the whole field, key included, to copy it
+	const unsigned char* end;
+} MvtField;
+
+typedef struct MvtPoint {
+	int64_t x;
+	int64_t y;
+} MvtPoint;
+
+typedef struct MvtPoints {
+	MvtPoint* points;	// malloc'd
+	apr_size_t count;
+	apr_size_t capacity;
+} MvtPoints;
+
+typedef struct Overzoom {
+	int dz;
+	uint32_t dx;
+	uint32_t dy;
+	int64_t offset_x;	// of the child, in the parent's coordinates scaled by 2^dz
+	int64_t offset_y;
+	int64_t min;		// the clip box, in the child's coordinates
+	int64_t max;
+	MvtBuffer out;
+	MvtBuffer layer;
+	MvtBuffer feature;
+	MvtBuffer geometry;
+	MvtPoints points;	// of the feature being cut, all parts one after the other
+	apr_size_t* parts;	// where each part starts in points
+	apr_size_t parts_count;
+	apr_size_t parts_capacity;
+	MvtPoints clipped[2];	// ping-pong buffers of polygon clipping
+	MvtPoint cursor;		// of the geometry being written
+	bool failed;			// out of memory
+} Overzoom;
+
+static bool grow(Overzoom* oz, void** data, apr_size_t* capacity, apr_size_t needed, apr_size_t item) {
+	if (needed <= *capacity)
+		return true;
+	apr_size_t capacity_new = *capacity ? *capacity * 2 : 256;
+	while (capacity_new < needed)
+		capacity_new *= 2;
+	void* grown = realloc(*data, capacity_new * item);
+	if (!grown) {
+		oz->failed = true;
+		return false;
+	}
+	*data = grown;
+	*capacity = capacity_new;
+	return true;
+}
+
+static void buffer_append(Overzoom* oz, MvtBuffer* buffer, const void* data, apr_size_t size) {
+	if (!grow(oz, (void**)&buffer->data, &buffer->capacity, buffer->size + size, 1))
+		return;
+	memcpy(buffer->data + buffer->size, data, size);
+	buffer->size += size;
+}
+
+static void buffer_varint(Overzoom* oz, MvtBuffer* buffer, uint64_t value) {
+	unsigned char bytes[10];
+	int count = 0;
+	do {
+		bytes[count++] = (unsigned char)((value & 0x7F) | (value > 0x7F ? 0x80 : 0));
+		value >>= 7;
+	} while (value);
+	buffer_append(oz, buffer, bytes, count);
+}
+
+static void buffer_message(Overzoom* oz, MvtBuffer* buffer, uint32_t number, const MvtBuffer* message) {
+	buffer_varint(oz, buffer, ((uint64_t)number << 3) | WIRE_BYTES);
+	buffer_varint(oz, buffer, message->size);
+	buffer_append(oz, buffer, message->data, message->size);
+}
+
+static bool read_varint(MvtReader* reader, uint64_t* value) {
+	*value = 0;
+	for (int shift = 0; shift < 64 && reader->p < reader->end; shift += 7) {
+		unsigned char byte = *reader->p++;
+		*value |= (uint64_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+// false at the end or on a malformed field; reader->p is then at the end
+static bool read_field(MvtReader* reader, MvtField* field) {
+	uint64_t key;
+	field->start = reader->p;
+	if (reader->p >= reader->end || !read_varint(reader, &key))
+		return false;
+	field->number = (uint32_t)(key >> 3);
+	field->type = (int)(key & 7);
+	apr_size_t skip = 0;
+	switch (field->type) {
+	case WIRE_VARINT:
+		if (!read_varint(reader, &field->value))
+			return false;
+		break;
+	case WIRE_BYTES:
+		if (!read_varint(reader, &field->value) || field->value > (uint64_t)(reader->end - reader->p))
+			return false;
+		field->data = reader->p;
+		field->size = (apr_size_t)field->value;
+		skip = field->size;
+		break;
+	case WIRE_FIXED64:
+		skip = 8;
+		break;
+	case WIRE_FIXED32:
+		skip = 4;
+		break;
+	default:
+		return false;
+	}
+	if (skip > (apr_size_t)(reader->end - reader->p))
+		return false;
+	reader->p += skip;
+	field->end = reader->p;
+	return true;
+}
+
+static void add_point(Overzoom* oz, MvtPoints* points, MvtPoint point) {
+	if (grow(oz, (void**)&points->points, &points->capacity, points->count + 1, sizeof(MvtPoint)))
+		points->points[points->count++] = point;
+}
+
+static void start_part(Overzoom* oz) {
+	if (grow(oz, (void**)&oz->parts, &oz->parts_capacity, oz->parts_count + 1, sizeof(apr_size_t)))
+		oz->parts[oz->parts_count++] = oz->points.count;
+}
+
+static apr_size_t part_end(const Overzoom* oz, apr_size_t part) {
+	return part + 1 < oz->parts_count ? oz->parts[part + 1] : oz->points.count;
+}
+
+// the feature's parts, moved into the child's coordinates; false if the geometry is malformed
+static bool decode_geometry(Overzoom* oz, const unsigned char* data, apr_size_t size, int type, MvtPoint* low, MvtPoint* high) {
+	MvtReader reader = { data, data + size };
+	int64_t x = 0, y = 0;
+	oz->points.count = 0;
+	oz->parts_count = 0;
+	low->x = low->y = INT64_MAX;
+	high->x = high->y = INT64_MIN;
+	while (reader.p < reader.end) {
+		uint64_t command;
+		if (!read_varint(&reader, &command))
+			return false;
+		int id = (int)(command & 7);
+		uint64_t count = command >> 3;
+		if (id == CMD_CLOSE_PATH)
+			continue;	// rings are closed anyway
+		if (id != CMD_MOVE_TO && id != CMD_LINE_TO)
+			return false;
+		for (uint64_t i = 0; i < count; i++) {
+			uint64_t zx, zy;
+			if (!read_varint(&reader, &zx) || !read_varint(&reader, &zy))
+				return false;
+			x += (int64_t)(zx >> 1) ^ -(int64_t)(zx & 1);
+			y += (int64_t)(zy >> 1) ^ -(int64_t)(zy & 1);
+			if (zx > UINT32_MAX || zy > UINT32_MAX || x < INT32_MIN || x > INT32_MAX || y < INT32_MIN || y > INT32_MAX)
+				return false;
+			// points are one part; a move starts a line or a ring
+			if (id == CMD_MOVE_TO && (type != GEOM_POINT || !oz->parts_count))
+				start_part(oz);
+			else if (!oz->parts_count)
+				return false;
+			MvtPoint point = { x * ((int64_t)1 << oz->dz) - oz->offset_x, y * ((int64_t)1 << oz->dz) - oz->offset_y };
+			add_point(oz, &oz->points, point);
+			if (point.x < low->x) low->x = point.x;
+			if (point.y < low->y) low->y = point.y;
+			if (point.x > high->x) high->x = point.x;
+			if (point.y > high->y) high->y = point.y;
+		}
+	}
+	return !oz->failed;
+}
+
+static void write_command(Overzoom* oz, int id, apr_size_t count) {
+	buffer_varint(oz, &oz->geometry, (uint64_t)((count << 3) | id));
+}
+
+static void write_point(Overzoom* oz, MvtPoint point) {
+	int64_t dx = point.x - oz->cursor.x;
+	int64_t dy = point.y - oz->cursor.y;
+	buffer_varint(oz, &oz->geometry, ((uint64_t)dx << 1) ^ (uint64_t)(dx >> 63));
+	buffer_varint(oz, &oz->geometry, ((uint64_t)dy << 1) ^ (uint64_t)(dy >> 63));
+	oz->cursor = point;
+}
+
+// without points repeated in a row (which rounding makes); for a ring, without the last one repeating the first
+static apr_size_t drop_repeats(MvtPoint* points, apr_size_t count, bool ring) {
+	apr_size_t kept = 0;
+	for (apr_size_t i = 0; i < count; i++)
+		if (!kept || points[i].x != points[kept - 1].x || points[i].y != points[kept - 1].y)
+			points[kept++] = points[i];
+	while (ring && kept > 1 && points[kept - 1].x == points[0].x && points[kept - 1].y == points[0].y)
+		kept--;
+	return kept;
+}
+
+static void write_line(Overzoom* oz, MvtPoint* points, apr_size_t count) {
+	count = drop_repeats(points, count, false);
+	if (count < 2)
+		return;
+	write_command(oz, CMD_MOVE_TO, 1);
+	write_point(oz, points[0]);
+	write_command(oz, CMD_LINE_TO, count - 1);
+	for (apr_size_t i = 1; i < count; i++)
+		write_point(oz, points[i]);
+}
+
+static double ring_area(const MvtPoint* points, apr_size_t count) {
+	double area = 0;
+	for (apr_size_t i = 0, j = count - 1; i < count; j = i++)
+		area += (double)points[j].x * points[i].y - (double)points[i].x * points[j].y;
+	return area / 2;
+}
+
+static bool write_ring(Overzoom* oz, MvtPoint* points, apr_size_t count) {
+	count = drop_repeats(points, count, true);
+	if (count < 3 || ring_area(points, count) == 0)
+		return false;
+	write_command(oz, CMD_MOVE_TO, 1);
+	write_point(oz, points[0]);
+	write_command(oz, CMD_LINE_TO, count - 1);
+	for (apr_size_t i = 1; i < count; i++)
+		write_point(oz, points[i]);
+	write_command(oz, CMD_CLOSE_PATH, 1);
+	return true;
+}
+
+static int64_t clamp(const Overzoom* oz, double value) {
+	int64_t rounded = llround(value);
+	return rounded < oz->min ? oz->min : rounded > oz->max ? oz->max : rounded;
+}
+
+// Liang-Barsky: the part of a-b inside the clip box, false if none
+static bool clip_segment(const Overzoom* oz, MvtPoint a, MvtPoint b, MvtPoint* ca, MvtPoint* cb) {
+	double t0 = 0, t1 = 1;
+	double dx = (double)(b.x - a.x), dy = (double)(b.y - a.y);
+	double p[4] = { -dx, dx, -dy, dy };
+	double q[4] = { (double)(a.x - oz->min), (double)(oz->max - a.x), (double)(a.y - oz->min), (double)(oz->max - a.y) };
+	for (int i = 0; i < 4; i++) {
+		if (p[i] == 0) {
+			if (q[i] < 0)
+				return false;
+			continue;
+		}
+		double t = q[i] / p[i];
+		if (p[i] < 0) {
+			if (t > t1)
+				return false;
+			if (t > t0)
+				t0 = t;
+		}
+		else {
+			if (t < t0)
+				return false;
+			if (t < t1)
+				t1 = t;
+		}
+	}
+	*ca = a;
+	*cb = b;
+	if (t0 > 0) {
+		ca->x = clamp(oz, a.x + t0 * dx);
+		ca->y = clamp(oz, a.y + t0 * dy);
+	}
+	if (t1 < 1) {
+		cb->x = clamp(oz, a.x + t1 * dx);
+		cb->y = clamp(oz, a.y + t1 * dy);
+	}
+	return true;
+}
+
+// a line leaving and entering the box again becomes several lines
+static void clip_line(Overzoom* oz, const MvtPoint* points, apr_size_t count) {
+	MvtPoints* line = &oz->clipped[0];
+	line->count = 0;
+	for (apr_size_t i = 1; i < count; i++) {
+		MvtPoint a, b;
+		if (!clip_segment(oz, points[i - 1], points[i], &a, &b))
+			continue;
+		if (line->count && (a.x != points[i - 1].x || a.y != points[i - 1].y)) {
+			// entered the box again
+			write_line(oz, line->points, line->count);
+			line->count = 0;
+		}
+		if (!line->count)
+			add_point(oz, line, a);
+		add_point(oz, line, b);
+		if (b.x != points[i].x || b.y != points[i].y) {
+			// left the box
+			write_line(oz, line->points, line->count);
+			line->count = 0;
+		}
+	}
+	write_line(oz, line->points, line->count);
+}
+
+static bool inside_edge(const Overzoom* oz, MvtPoint point, int edge) {
+	switch (edge) {
+	case 0: return point.x >= oz->min;
+	case 1: return point.x <= oz->max;
+	case 2: return point.y >= oz->min;
+	default: return point.y <= oz->max;
+	}
+}
+
+static MvtPoint cross_edge(const Overzoom* oz, MvtPoint a, MvtPoint b, int edge) {
+	MvtPoint point;
+	int64_t bound = (edge == 0 || edge == 2) ? oz->min : oz->max;
+	if (edge < 2) {
+		double t = (double)(bound - a.x) / (double)(b.x - a.x);
+		point.x = bound;
+		point.y = clamp(oz, a.y + t * (b.y - a.y));
+	}
+	else {
+		double t = (double)(bound - a.y) / (double)(b.y - a.y);
+		point.x = clamp(oz, a.x + t * (b.x - a.x));
+		point.y = bound;
+	}
+	return point;
+}
+
+// Sutherland-Hodgman, one edge of the box at a time; the result is in oz->clipped[0]
+static void clip_ring(Overzoom* oz, const MvtPoint* points, apr_size_t count) {
+	MvtPoints* in = &oz->clipped[1];
+	MvtPoints* out = &oz->clipped[0];
+	in->count = 0;
+	for (apr_size_t i = 0; i < count; i++)
+		add_point(oz, in, points[i]);
+
+	for (int edge = 0; edge < 4; edge++) {
+		out->count = 0;
+		for (apr_size_t i = 0; i < in->count; i++) {
+			MvtPoint current = in->points[i];
+			MvtPoint previous = in->points[(i + in->count - 1) % in->count];
+			bool current_in = inside_edge(oz, current, edge);
+			if (current_in != inside_edge(oz, previous, edge))
+				add_point(oz, out, cross_edge(oz, previous, current, edge));
+			if (current_in)
+				add_point(oz, out, current);
+		}
+		MvtPoints* swap = in;
+		in = out;
+		out = swap;
+	}
+	if (in != &oz->clipped[0]) {
+		MvtPoints swap = oz->clipped[0];
+		oz->clipped[0] = oz->clipped[1];
+		oz->clipped[1] = swap;
+	}
+}
+
+// the feature's geometry, cut to the child, into oz->geometry; left empty if nothing is inside
+static void clip_geometry(Overzoom* oz, int type, bool contained) {
+	oz->geometry.size = 0;
+	oz->cursor.x = oz->cursor.y = 0;
+
+	if (type == GEOM_POINT) {
+		apr_size_t kept = 0;
+		for (apr_size_t i = 0; i < oz->points.count; i++) {
+			MvtPoint point = oz->points.points[i];
+			if (point.x >= oz->min && point.x <= oz->max && point.y >= oz->min && point.y <= oz->max)
+				oz->points.points[kept++] = point;
+		}
+		if (!kept)
+			return;
+		write_command(oz, CMD_MOVE_TO, kept);
+		for (apr_size_t i = 0; i < kept; i++)
+			write_point(oz, oz->points.points[i]);
+		return;
+	}
+
+	bool exterior_kept = false;
+	for (apr_size_t part = 0; part < oz->parts_count; part++) {
+		MvtPoint* points = &oz->points.points[oz->parts[part]];
+		apr_size_t count = part_end(oz, part) - oz->parts[part];
+		if (type == GEOM_LINESTRING) {
+			if (contained)
+				write_line(oz, points, count);
+			else
+				clip_line(oz, points, count);
+			continue;
+		}
+		if (count < 3)
+			continue;
+		// holes follow their exterior ring, and go with it
+		bool exterior = ring_area(points, count) > 0;
+		if (!exterior && !exterior_kept)
+			continue;
+		if (!contained) {
+			clip_ring(oz, points, count);
+			points = oz->clipped[0].points;
+			count = oz->clipped[0].count;
+		}
+		bool kept = write_ring(oz, points, count);
+		if (exterior)
+			exterior_kept = kept;
+	}
+}
+
+// false if the feature is malformed; nothing is written if none of it is in the child
+static bool cut_feature(Overzoom* oz, const unsigned char* data, apr_size_t size) {
+	MvtReader reader = { data, data + size };
+	MvtField field;
+	int type = 0;
+	const unsigned char* geometry = NULL;
+	apr_size_t geometry_size = 0;
+	while (read_field(&reader, &field)) {
+		if (field.number == FEATURE_TYPE && field.type == WIRE_VARINT)
+			type = (int)field.value;
+		else if (field.number == FEATURE_GEOMETRY && field.type == WIRE_BYTES) {
+			geometry = field.data;
+			geometry_size = field.size;
+		}
+	}
+	if (reader.p != reader.end)
+		return false;
+	oz->feature.size = 0;
+	if (!geometry || type < GEOM_POINT || type > GEOM_POLYGON)
+		return true;	// nothing to draw
+
+	MvtPoint low, high;
+	if (!decode_geometry(oz, geometry, geometry_size, type, &low, &high))
+		return false;
+	if (high.x < oz->min || low.x > oz->max || high.y < oz->min || low.y > oz->max)
+		return true;
+	clip_geometry(oz, type, low.x >= oz->min && high.x <= oz->max && low.y >= oz->min && high.y <= oz->max);
+	if (!oz->geometry.size)
+		return true;
+
+	reader.p = data;
+	while (read_field(&reader, &field))
+		if (field.number == FEATURE_GEOMETRY)
+			buffer_message(oz, &oz->feature, FEATURE_GEOMETRY, &oz->geometry);
+		else
+			buffer_append(oz, &oz->feature, field.start, field.end - field.start);
+	return true;
+}
+
+static bool cut_layer(Overzoom* oz, const unsigned char* data, apr_size_t size) {
+	// the extent usually comes after the features
+	MvtReader reader = { data, data + size };
+	MvtField field;
+	int64_t extent = DEFAULT_EXTENT;
+	while (read_field(&reader, &field))
+		if (field.number == LAYER_EXTENT && field.type == WIRE_VARINT && field.value)
+			extent = (int64_t)field.value;
+	if (reader.p != reader.end)
+		return false;
+	oz->offset_x = (int64_t)oz->dx * extent;
+	oz->offset_y = (int64_t)oz->dy * extent;
+	oz->min = -extent * MVT_CLIP_BUFFER / 256;
+	oz->max = extent - oz->min;
+
+	oz->layer.size = 0;
+	bool features = false;
+	reader.p = data;
+	while (read_field(&reader, &field)) {
+		if (field.number != LAYER_FEATURES) {
+			buffer_append(oz, &oz->layer, field.start, field.end - field.start);
+			continue;
+		}
+		if (field.type != WIRE_BYTES || !cut_feature(oz, field.data, field.size))
+			return false;
+		if (oz->feature.size) {
+			buffer_message(oz, &oz->layer, LAYER_FEATURES, &oz->feature);
+			features = true;
+		}
+	}
+	if (features)
+		buffer_message(oz, &oz->out, TILE_LAYERS, &oz->layer);
+	return true;
+}
+
+bool mbtiles_mvt_overzoom(const unsigned char* parent, apr_size_t size, int dz, uint32_t dx, uint32_t dy,
+	apr_pool_t* pool, unsigned char** child, apr_size_t* child_size) {
+	Overzoom oz;
+	memset(&oz, 0, sizeof(oz));
+	oz.dz = dz;
+	oz.dx = dx;
+	oz.dy = dy;
+
+	MvtReader reader = { parent, parent + size };
+	MvtField field;
+	bool valid = dz > 0 && dz < 31;
+	while (valid && read_field(&reader, &field)) {
+		if (field.number == TILE_LAYERS && field.type == WIRE_BYTES)
+			valid = cut_layer(&oz, field.data, field.size);
+	}
+	valid = valid && reader.p == reader.end && !oz.failed;
+
+	*child = NULL;
+	*child_size = 0;
+	if (valid && oz.out.size) {
+		*child = apr_palloc(pool, oz.out.size);
+		memcpy(*child, oz.out.data, oz.out.size);
+		*child_size = oz.out.size;
+	}
+
+	free(oz.out.data);
+	free(oz.layer.data);
+	free(oz.feature.data);
+	free(oz.geometry.data);
+	free(oz.points.points);
+	free(oz.parts);
+	free(oz.clipped[0].points);
+	free(oz.clipped[1].points);
+	return valid;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#ifndef MBTILES_OVERZOOM_H
+#define MBTILES_OVERZOOM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "apr_pools.h"
+
+/*
+	Cuts a child tile out of a vector tile (MVT) for zooms past a tileset's maxzoom. In one pass over the
+	parent's layers, the geometry of each feature is scaled by 2^dz, moved to the child's origin and
+	clipped to the child's extent plus a buffer; features left with nothing are dropped, and so are layers.
+	Names, keys, values, tags and ids are copied as they are.
+*/
+
+#define MVT_CLIP_BUFFER 8	// kept around the child, in 1/256 of the layer's extent
+
+// parent is the uncompressed parent tile; the child is dx, dy (XYZ, 0 to 2^dz - 1) at dz zooms below it.
+// false if the parent isn't a valid tile; *child_size is 0 if nothing of it falls in the child
+bool mbtiles_mvt_overzoom(const unsigned char* parent, apr_size_t size, int dz, uint32_t dx, uint32_t dy,
+	apr_pool_t* pool, unsigned char** child, apr_size_t* child_size);
+
+#endif	// MBTILES_OVERZOOM_H
@@ -0,0 +1,120 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "apr_pools.h"
+#include "apr_strings.h"
+#include "apr_file_io.h"
+#include "apr_mmap.h"
+
+#include "mbtiles_pack.h"
+
+// the pack is little-endian whatever the host; on a little-endian one these are plain loads
+static uint64_t le64(const uint64_t* field) {
+	const unsigned char* b = (const unsigned char*)field;
+	return (uint64_t)b[0] | (uint64_t)b[1] << 8 | (uint64_t)b[2] << 16 | (uint64_t)b[3] << 24 |
+		(uint64_t)b[4] << 32 | (uint64_t)b[5] << 40 | (uint64_t)b[6] << 48 | (uint64_t)b[7] << 56;
+}
+
+static uint32_t le32(const uint32_t* field) {
+	const unsigned char* b = (const unsigned char*)field;
+	return (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
+}
+
+static apr_status_t map_file(const char* path, apr_mmap_t** map, apr_time_t* mtime, apr_pool_t* pool) {
+	apr_file_t* file;
+	apr_finfo_t finfo;
+	apr_status_t rv;
+
+	rv = apr_file_open(&file, path, APR_READ | APR_BINARY, APR_OS_DEFAULT, pool);
+	if (rv != APR_SUCCESS)
+		return rv;
+
+	rv = apr_file_info_get(&finfo, APR_FINFO_SIZE | APR_FINFO_MTIME, file);
+	if (rv == APR_SUCCESS && finfo.size == 0)
+		rv = APR_EGENERAL;
+	if (rv == APR_SUCCESS)
+		rv = apr_mmap_create(map, file, 0, (apr_size_t)finfo.size, APR_MMAP_READ, pool);
+	if (mtime)
+		*mtime = finfo.mtime;
+
+	// the mapping stays valid after the descriptor is closed
+	apr_file_close(file);
+	return rv;
+}
+
+apr_status_t mbtiles_pack_open(MbtilesPack* pack, const char* mbtiles_path, apr_pool_t* pool) {
+	apr_finfo_t source_info;
+	apr_time_t index_mtime;
+	apr_time_t blob_mtime;
+	apr_status_t rv;
+
+	memset(pack, 0, sizeof(MbtilesPack));
+
+	rv = apr_stat(&source_info, mbtiles_path, APR_FINFO_MTIME, pool);
+	if (rv != APR_SUCCESS)
+		return rv;
+
+	rv = map_file(apr_pstrcat(pool, mbtiles_path, MBTILES_PACK_INDEX_EXT, NULL), &pack->index_map, &index_mtime, pool);
+	if (rv != APR_SUCCESS)
+		return rv;
+	// sidecar older than the .mbtiles is stale
+	if (index_mtime < source_info.mtime)
+		return APR_EGENERAL;
+
+	rv = map_file(apr_pstrcat(pool, mbtiles_path, MBTILES_PACK_BLOB_EXT, NULL), &pack->blob_map, &blob_mtime, pool);
+	if (rv != APR_SUCCESS)
+		return rv;
+	// so is a blob file left from an older build next to a fresh index
+	if (blob_mtime < source_info.mtime)
+		return APR_EGENERAL;
+
+	const MbtilesPackHeader* header = (const MbtilesPackHeader*)pack->index_map->mm;
+	if (pack->index_map->size < sizeof(MbtilesPackHeader) ||
+		memcmp(header->magic, MBTILES_PACK_MAGIC, sizeof(header->magic)) != 0)
+		return APR_EGENERAL;
+	uint64_t count = le64(&header->count);
+	uint64_t blob_size = le64(&header->blob_size);
+	// an empty pack would answer 404 for every tile of the .mbtiles
+	if (count == 0 ||
+		pack->index_map->size != sizeof(MbtilesPackHeader) + count * sizeof(MbtilesPackEntry) ||
+		pack->blob_map->size != blob_size)
+		return APR_EGENERAL;
+
+	pack->entries = (const MbtilesPackEntry*)(header + 1);
+	pack->count = count;
+	pack->blob = (const unsigned char*)pack->blob_map->mm;
+	pack->blob_size = blob_size;
+
+	return APR_SUCCESS;
+}
+
+bool mbtiles_pack_find(const MbtilesPack* pack, int z, int x, int y, const unsigned char** data, apr_size_t* size) {
+	if (!pack->count || z < 0 || z > 31 || x < 0 || y < 0)
+		return false;
+
+	uint64_t tile_id = mbtiles_zxy_to_tileid(z, x, y);
+
+	uint64_t low = 0;
+	uint64_t high = pack->count;
+	while (low < high) {
+		uint64_t middle = low + (high - low) / 2;
+		if (le64(&pack->entries[middle].tile_id) < tile_id)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if (low == pack->count || le64(&pack->entries[low].tile_id) != tile_id)
+		return false;
+
+	uint64_t offset = le64(&pack->entries[low].offset);
+	uint32_t length = le32(&pack->entries[low].length);
+	if (offset + length > pack->blob_size)
+		return false;
+
+	*data = &pack->blob[offset];
+	*size = length;
+	return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#ifndef MBTILES_PACK_H
+#define MBTILES_PACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "apr_pools.h"
+#include "apr_mmap.h"
+
+#include "mbtiles_tileid.h"
+
+/*
+	Packed sidecar for an immutable .mbtiles, built by mbtiles_pack_build:
+		<path>.zxy	 - header + entries sorted by tile ID
+		<path>.blob	 - tile blobs as stored in the .mbtiles, concatenated in tile ID order
+	All integers are little-endian.
+*/
+
+#define MBTILES_PACK_MAGIC "MBTZXY01"
+#define MBTILES_PACK_INDEX_EXT ".zxy"
+#define MBTILES_PACK_BLOB_EXT ".blob"
+
+typedef struct MbtilesPackHeader {
+	char magic[8];
+	uint64_t count;
+	uint64_t blob_size;
+} MbtilesPackHeader;
+
+typedef struct MbtilesPackEntry {
+	uint64_t tile_id;
+	uint64_t offset;
+	uint32_t length;
+	uint32_t reserved;
+} MbtilesPackEntry;
+
+typedef struct MbtilesPack {
+	apr_mmap_t* index_map;
+	apr_mmap_t* blob_map;
+	const MbtilesPackEntry* entries;
+	uint64_t count;
+	const unsigned char* blob;
+	uint64_t blob_size;
+} MbtilesPack;
+
+apr_status_t mbtiles_pack_open(MbtilesPack* pack, const char* mbtiles_path, apr_pool_t* pool);
+bool mbtiles_pack_find(const MbtilesPack* pack, int z, int x, int y, const unsigned char** data, apr_size_t* size);
+
+#endif	// MBTILES_PACK_H
@@ -0,0 +1,333 @@
+/*
+	Builds the packed sidecar (see mbtiles_pack.h) next to an .mbtiles file.
+
+	To build:
+		cc -o mbtiles_pack_build mbtiles_pack_build.c $(apr-1-config --includes) -lsqlite3
+
+	Usage:
+		mbtiles_pack_build /path/to/my/vector_tiles.mbtiles
+
+	Rebuild the sidecar whenever the .mbtiles changes: mod_mbtiles ignores a sidecar whose .zxy or .blob is older than its .mbtiles.
+*/
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sqlite3.h>
+
+#include "mbtiles_pack.h"
+
+typedef struct PackKey {
+	uint64_t tile_id;
+	int column;
+	int row;
+} PackKey;
+
+static int compare_keys(const void* a, const void* b) {
+	const PackKey* ka = (const PackKey*)a;
+	const PackKey* kb = (const PackKey*)b;
+	if (ka->tile_id < kb->tile_id) return -1;
+	if (ka->tile_id > kb->tile_id) return 1;
+	return 0;
+}
+
+// the pack is little-endian whatever the host, field by field as laid out in mbtiles_pack.h
+static void put_le(unsigned char* bytes, uint64_t value, int size) {
+	for (int i = 0; i < size; i++)
+		bytes[i] = (unsigned char)(value >> (8 * i));
+}
+
+static void write_header(FILE* index, const MbtilesPackHeader* header) {
+	unsigned char bytes[sizeof(MbtilesPackHeader)];
+	memcpy(bytes, header->magic, sizeof(header->magic));
+	put_le(&bytes[offsetof(MbtilesPackHeader, count)], header->count, 8);
+	put_le(&bytes[offsetof(MbtilesPackHeader, blob_size)], header->blob_size, 8);
+	fwrite(bytes, sizeof(bytes), 1, index);
+}
+
+static void write_entry(FILE* index, const MbtilesPackEntry* entry) {
+	unsigned char bytes[sizeof(MbtilesPackEntry)];
+	put_le(&bytes[offsetof(MbtilesPackEntry, tile_id)], entry->tile_id, 8);
+	put_le(&bytes[offsetof(MbtilesPackEntry, offset)], entry->offset, 8);
+	put_le(&bytes[offsetof(MbtilesPackEntry, length)], entry->length, 4);
+	put_le(&bytes[offsetof(MbtilesPackEntry, reserved)], entry->reserved, 4);
+	fwrite(bytes, sizeof(bytes), 1, index);
+}
+
+typedef struct PackSeen {
+	uint64_t hash;
+	uint64_t offset;
+	uint32_t length;
+	bool used;
+} PackSeen;
+
+// the distinct blobs already written, by hash: open addressing, kept at most half full
+typedef struct PackBlobs {
+	PackSeen* slots;
+	size_t capacity;		// a power of two
+	size_t count;
+	unsigned char* stored;	// a blob read back from the blob file to compare bytes
+	size_t stored_size;
+} PackBlobs;
+
+static uint64_t hash_blob(const unsigned char* data, int length) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (int i = 0; i < length; i++) {
+		hash ^= data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// 1 and its offset if the blob file has the same bytes already, 0 if not, -1 on a read error
+static int find_blob(PackBlobs* blobs, FILE* blob, uint64_t hash, const unsigned char* data, int length, uint64_t* offset) {
+	if (!blobs->count)
+		return 0;
+	int found = 0;
+	bool moved = false;
+	for (size_t i = hash & (blobs->capacity - 1); blobs->slots[i].used && !found; i = (i + 1) & (blobs->capacity - 1)) {
+		const PackSeen* seen = &blobs->slots[i];
+		if (seen->hash != hash || seen->length != (uint32_t)length)
+			continue;
+		if ((size_t)length > blobs->stored_size) {
+			unsigned char* grown = realloc(blobs->stored, length);
+			if (!grown)
+				return -1;
+			blobs->stored = grown;
+			blobs->stored_size = length;
+		}
+		moved = true;
+		if (fseeko(blob, (off_t)seen->offset, SEEK_SET) != 0 || fread(blobs->stored, 1, length, blob) != (size_t)length)
+			return -1;
+		if (memcmp(blobs->stored, data, length) == 0) {
+			*offset = seen->offset;
+			found = 1;
+		}
+	}
+	// back to appending; only after a read, since seeking flushes what is buffered
+	if (moved && fseeko(blob, 0, SEEK_END) != 0)
+		return -1;
+	return found;
+}
+
+static int add_blob(PackBlobs* blobs, uint64_t hash, uint64_t offset, int length) {
+	if (2 * (blobs->count + 1) > blobs->capacity) {
+		size_t capacity = blobs->capacity ? 2 * blobs->capacity : 65536;
+		PackSeen* slots = calloc(capacity, sizeof(PackSeen));
+		if (!slots)
+			return 0;
+		for (size_t i = 0; i < blobs->capacity; i++) {
+			if (!blobs->slots[i].used)
+				continue;
+			size_t j = blobs->slots[i].hash & (capacity - 1);
+			while (slots[j].used)
+				j = (j + 1) & (capacity - 1);
+			slots[j] = blobs->slots[i];
+		}
+		free(blobs->slots);
+		blobs->slots = slots;
+		blobs->capacity = capacity;
+	}
+	size_t i = hash & (blobs->capacity - 1);
+	while (blobs->slots[i].used)
+		i = (i + 1) & (blobs->capacity - 1);
+	blobs->slots[i] = (PackSeen){ hash, offset, (uint32_t)length, true };
+	blobs->count++;
+	return 1;
+}
+
+static char* concat(const char* a, const char* b) {
+	size_t len = strlen(a) + strlen(b) + 1;
+	char* s = malloc(len);
+	if (s) {
+		strcpy(s, a);
+		strcat(s, b);
+	}
+	return s;
+}
+
+static int pack_zoom(sqlite3* db, int zoom, FILE* index, FILE* blob, MbtilesPackHeader* header, PackBlobs* blobs) {
+	sqlite3_stmt* pStmt;
+	size_t count = 0;
+	size_t capacity = 4096;
+	PackKey* keys = malloc(capacity * sizeof(PackKey));
+	if (!keys) return 0;
+
+	if (SQLITE_OK != sqlite3_prepare_v2(db, "SELECT tile_column, tile_row FROM tiles WHERE zoom_level=?;", -1, &pStmt, NULL)) {
+		fprintf(stderr, "Couldn't read zoom %d: %s\n", zoom, sqlite3_errmsg(db));
+		free(keys);
+		return 0;
+	}
+	sqlite3_bind_int(pStmt, 1, zoom);
+	int rc;
+	while ((rc = sqlite3_step(pStmt)) == SQLITE_ROW) {
+		if (count == capacity) {
+			capacity *= 2;
+			PackKey* grown = realloc(keys, capacity * sizeof(PackKey));
+			if (!grown) {
+				fprintf(stderr, "Out of memory at zoom %d\n", zoom);
+				free(keys);
+				sqlite3_finalize(pStmt);
+				return 0;
+			}
+			keys = grown;
+		}
+		keys[count].column = sqlite3_column_int(pStmt, 0);
+		keys[count].row = sqlite3_column_int(pStmt, 1);
+		keys[count].tile_id = mbtiles_zxy_to_tileid(zoom, keys[count].column, mbtiles_flip_y(zoom, keys[count].row));
+		count++;
+	}
+	sqlite3_finalize(pStmt);
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "Couldn't read zoom %d: %s\n", zoom, sqlite3_errmsg(db));
+		free(keys);
+		return 0;
+	}
+
+	qsort(keys, count, sizeof(PackKey), compare_keys);
+
+	if (SQLITE_OK != sqlite3_prepare_v2(db, "SELECT tile_data FROM tiles WHERE zoom_level=? AND tile_column=? AND tile_row=?;", -1, &pStmt, NULL)) {
+		fprintf(stderr, "Couldn't read zoom %d: %s\n", zoom, sqlite3_errmsg(db));
+		free(keys);
+		return 0;
+	}
+	int ok = 1;
+	for (size_t i = 0; i < count && ok; i++) {
+		sqlite3_bind_int(pStmt, 1, zoom);
+		sqlite3_bind_int(pStmt, 2, keys[i].column);
+		sqlite3_bind_int(pStmt, 3, keys[i].row);
+
+		rc = sqlite3_step(pStmt);
+		if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+			fprintf(stderr, "Couldn't read %d/%d/%d: %s\n", zoom, keys[i].column, keys[i].row, sqlite3_errmsg(db));
+			ok = 0;
+		}
+		else if (rc == SQLITE_ROW) {
+			const unsigned char* data = sqlite3_column_blob(pStmt, 0);
+			int length = sqlite3_column_bytes(pStmt, 0);
+
+			MbtilesPackEntry entry = { keys[i].tile_id, header->blob_size, (uint32_t)length, 0 };
+
+			// many tiles are identical (sea, land, empty), anywhere in the file: store each once
+			uint64_t hash = hash_blob(data, length);
+			int found = find_blob(blobs, blob, hash, data, length, &entry.offset);
+			if (found < 0) {
+				fprintf(stderr, "Couldn't read back the blob file\n");
+				ok = 0;
+			}
+			else if (!found) {
+				fwrite(data, 1, length, blob);
+				header->blob_size += length;
+				if (!add_blob(blobs, hash, entry.offset, length)) {
+					fprintf(stderr, "Out of memory at zoom %d\n", zoom);
+					ok = 0;
+				}
+			}
+
+			write_entry(index, &entry);
+			header->count++;
+		}
+		sqlite3_reset(pStmt);
+	}
+	sqlite3_finalize(pStmt);
+
+	free(keys);
+	return ok;
+}
+
+int main(int argc, char** argv) {
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s file.mbtiles\n", argv[0]);
+		return 1;
+	}
+
+	const char* path = argv[1];
+	sqlite3* db;
+	if (SQLITE_OK != sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL)) {
+		fprintf(stderr, "Couldn't open %s\n", path);
+		return 1;
+	}
+
+	char* index_path = concat(path, MBTILES_PACK_INDEX_EXT);
+	char* blob_path = concat(path, MBTILES_PACK_BLOB_EXT);
+	char* index_tmp = concat(index_path, ".tmp");
+	char* blob_tmp = concat(blob_path, ".tmp");
+
+	FILE* index = fopen(index_tmp, "wb");
+	FILE* blob = fopen(blob_tmp, "w+b");	// read back to compare identical tiles
+	if (!index || !blob) {
+		fprintf(stderr, "Couldn't create %s\n", index ? blob_tmp : index_tmp);
+		return 1;
+	}
+
+	MbtilesPackHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MBTILES_PACK_MAGIC, sizeof(header.magic));
+	write_header(index, &header);
+
+	PackBlobs blobs;
+	memset(&blobs, 0, sizeof(blobs));
+
+	// a file without a tiles table, or with nothing in it, gets no pack: the module would serve it empty
+	int ok = 1;
+	sqlite3_stmt* pStmt;
+	if (SQLITE_OK != sqlite3_prepare_v2(db, "SELECT DISTINCT zoom_level FROM tiles ORDER BY zoom_level;", -1, &pStmt, NULL)) {
+		fprintf(stderr, "Couldn't read the tiles of %s: %s\n", path, sqlite3_errmsg(db));
+		ok = 0;
+	}
+	else {
+		int rc;
+		while ((rc = sqlite3_step(pStmt)) == SQLITE_ROW) {
+			int zoom = sqlite3_column_int(pStmt, 0);
+			if (!pack_zoom(db, zoom, index, blob, &header, &blobs)) {
+				ok = 0;
+				break;
+			}
+			printf("z%d done, %llu tiles, %llu distinct, %llu bytes\n", zoom, (unsigned long long)header.count,
+				(unsigned long long)blobs.count, (unsigned long long)header.blob_size);
+		}
+		if (ok && rc != SQLITE_DONE) {
+			fprintf(stderr, "Couldn't read the tiles of %s: %s\n", path, sqlite3_errmsg(db));
+			ok = 0;
+		}
+		sqlite3_finalize(pStmt);
+	}
+	if (ok && header.count == 0) {
+		fprintf(stderr, "No tiles in %s\n", path);
+		ok = 0;
+	}
+	sqlite3_close(db);
+	free(blobs.slots);
+	free(blobs.stored);
+
+	fseek(index, 0, SEEK_SET);
+	write_header(index, &header);
+
+	if (ok && (ferror(index) || ferror(blob))) {
+		fprintf(stderr, "Write error\n");
+		ok = 0;
+	}
+	int closed = fclose(index) == 0;
+	closed = fclose(blob) == 0 && closed;
+	if (ok && !closed) {
+		fprintf(stderr, "Write error\n");
+		ok = 0;
+	}
+	if (!ok) {
+		remove(index_tmp);
+		remove(blob_tmp);
+		return 1;
+	}
+
+	// blob first: a new index must never point into an old blob
+	remove(blob_path);
+	remove(index_path);
+	rename(blob_tmp, blob_path);
+	rename(index_tmp, index_path);
+
+	printf("%s: %llu tiles packed\n", index_path, (unsigned long long)header.count);
+	return 0;
+}
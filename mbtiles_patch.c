@@ -0,0 +1,131 @@
+/*
+	Folds a patch into the .mbtiles it was made for.
+
+	A patch (see MbtilesPatch in mod_mbtiles.c) is a small .mbtiles holding only the tiles that changed
+	since the base was built: a tile with data replaces the base's, a tile with empty or NULL data deletes it.
+	mod_mbtiles serves the patch over the base; once it has grown, this applies it to the base in one
+	transaction, so the base can be deployed again and the patch emptied.
+
+	The base is changed in place: work on a copy, then rename it over the served file and reload Apache
+	(with MbtilesSqlite immutable the file must never change under a running server). A repacked base
+	(mbtiles_repack.c, where tiles is a view) can't be written to: fold the patch into the original, then repack.
+
+	To build:
+		cc -o mbtiles_patch mbtiles_patch.c -lsqlite3
+
+	Usage:
+		mbtiles_patch /path/to/base.mbtiles /path/to/patch.mbtiles
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sqlite3.h>
+
+typedef struct Patch {
+	sqlite3* base;
+	sqlite3* patch;
+	sqlite3_stmt* read;
+	sqlite3_stmt* remove;
+	sqlite3_stmt* add;
+	sqlite3_int64 replaced;
+	sqlite3_int64 deleted;
+} Patch;
+
+static int is_table(sqlite3* db, const char* name) {
+	sqlite3_stmt* pStmt;
+	int table = 0;
+	if (SQLITE_OK != sqlite3_prepare_v2(db, "SELECT type FROM sqlite_master WHERE name=?;", -1, &pStmt, NULL))
+		return 0;
+	sqlite3_bind_text(pStmt, 1, name, -1, SQLITE_STATIC);
+	if (sqlite3_step(pStmt) == SQLITE_ROW)
+		table = strcmp((const char*)sqlite3_column_text(pStmt, 0), "table") == 0;
+	sqlite3_finalize(pStmt);
+	return table;
+}
+
+// each tile of the patch goes through the base's index: the base is never scanned
+static int apply_tile(Patch* patch) {
+	int zoom = sqlite3_column_int(patch->read, 0);
+	int column = sqlite3_column_int(patch->read, 1);
+	int row = sqlite3_column_int(patch->read, 2);
+	const void* data = sqlite3_column_blob(patch->read, 3);
+	int length = sqlite3_column_bytes(patch->read, 3);
+
+	sqlite3_bind_int(patch->remove, 1, zoom);
+	sqlite3_bind_int(patch->remove, 2, column);
+	sqlite3_bind_int(patch->remove, 3, row);
+	int ok = sqlite3_step(patch->remove) == SQLITE_DONE;
+	sqlite3_reset(patch->remove);
+	if (!ok)
+		return 0;
+
+	if (!length) {
+		patch->deleted++;
+		return 1;
+	}
+	sqlite3_bind_int(patch->add, 1, zoom);
+	sqlite3_bind_int(patch->add, 2, column);
+	sqlite3_bind_int(patch->add, 3, row);
+	sqlite3_bind_blob(patch->add, 4, data, length, SQLITE_STATIC);
+	ok = sqlite3_step(patch->add) == SQLITE_DONE;
+	sqlite3_reset(patch->add);
+	patch->replaced++;
+	return ok;
+}
+
+int main(int argc, char** argv) {
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s base.mbtiles patch.mbtiles\n", argv[0]);
+		return 1;
+	}
+
+	const char* base_path = argv[1];
+	const char* patch_path = argv[2];
+	Patch patch;
+	memset(&patch, 0, sizeof(patch));
+
+	if (SQLITE_OK != sqlite3_open_v2(patch_path, &patch.patch, SQLITE_OPEN_READONLY, NULL)) {
+		fprintf(stderr, "Couldn't open %s\n", patch_path);
+		return 1;
+	}
+	if (SQLITE_OK != sqlite3_open_v2(base_path, &patch.base, SQLITE_OPEN_READWRITE, NULL)) {
+		fprintf(stderr, "Couldn't open %s\n", base_path);
+		return 1;
+	}
+	if (!is_table(patch.base, "tiles")) {
+		fprintf(stderr, "%s has no tiles table (repacked?), fold the patch into the original and repack it again\n", base_path);
+		return 1;
+	}
+
+	int ok = SQLITE_OK == sqlite3_prepare_v2(patch.patch, "SELECT zoom_level, tile_column, tile_row, tile_data FROM tiles;", -1, &patch.read, NULL)
+		&& SQLITE_OK == sqlite3_prepare_v2(patch.base, "DELETE FROM tiles WHERE zoom_level=? AND tile_column=? AND tile_row=?;", -1, &patch.remove, NULL)
+		&& SQLITE_OK == sqlite3_prepare_v2(patch.base, "INSERT INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?, ?, ?, ?);", -1, &patch.add, NULL)
+		&& SQLITE_OK == sqlite3_exec(patch.base, "BEGIN;", NULL, NULL, NULL);
+	if (!ok)
+		fprintf(stderr, "Couldn't read %s or write %s: %s\n", patch_path, base_path, sqlite3_errmsg(patch.base));
+
+	int rc = SQLITE_DONE;
+	while (ok && (rc = sqlite3_step(patch.read)) == SQLITE_ROW)
+		ok = apply_tile(&patch);
+	if (ok && rc != SQLITE_DONE)
+		ok = 0;
+	if (!ok)
+		fprintf(stderr, "Failed after %lld tiles: %s\n", patch.replaced + patch.deleted, sqlite3_errmsg(patch.base));
+
+	ok = ok && SQLITE_OK == sqlite3_exec(patch.base, "COMMIT;", NULL, NULL, NULL);
+	if (!ok)
+		sqlite3_exec(patch.base, "ROLLBACK;", NULL, NULL, NULL);
+
+	sqlite3_finalize(patch.read);
+	sqlite3_finalize(patch.remove);
+	sqlite3_finalize(patch.add);
+	sqlite3_close(patch.patch);
+	ok = (SQLITE_OK == sqlite3_close(patch.base)) && ok;
+	if (!ok)
+		return 1;
+
+	printf("%s: %lld tiles replaced, %lld deleted\n", base_path, patch.replaced, patch.deleted);
+	return 0;
+}
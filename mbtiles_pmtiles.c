@@ -0,0 +1,514 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "apr_pools.h"
+#include "apr_strings.h"
+#include "apr_file_io.h"
+#include "apr_mmap.h"
+
+#include <zlib.h>
+
+#include "mbtiles_tileid.h"
+#include "mbtiles_pmtiles.h"
+
+static uint64_t read_u64(const unsigned char* p) {
+	uint64_t v = 0;
+	for (int i = 7; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static int32_t read_i32(const unsigned char* p) {
+	return (int32_t)((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+static bool read_varint(const unsigned char** p, const unsigned char* end, uint64_t* value) {
+	uint64_t v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (*p >= end)
+			return false;
+		unsigned char b = **p;
+		(*p)++;
+		v |= (uint64_t)(b & 0x7F) << shift;
+		if (!(b & 0x80)) {
+			*value = v;
+			return true;
+		}
+	}
+	return false;
+}
+
+// decompress a directory or the metadata into a malloc'ed buffer
+static unsigned char* read_section(PmtilesArchive* archive, uint64_t offset, uint64_t length, apr_size_t* out_length) {
+	if (offset > archive->size || length > archive->size - offset)
+		return NULL;
+
+	const unsigned char* source = &archive->data[offset];
+
+	if (archive->header.internal_compression == PMTILES_COMPRESSION_NONE) {
+		unsigned char* copy = malloc(length ? length : 1);
+		if (copy) memcpy(copy, source, length);
+		*out_length = length;
+		return copy;
+	}
+	if (archive->header.internal_compression != PMTILES_COMPRESSION_GZIP)
+		return NULL;
+
+	apr_size_t capacity = length * 4 + 1024;
+	unsigned char* buffer = malloc(capacity);
+	if (!buffer)
+		return NULL;
+
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+		free(buffer);
+		return NULL;
+	}
+	zs.next_in = (Bytef*)source;
+	zs.avail_in = (uInt)length;
+
+	int ret;
+	do {
+		if (zs.total_out == capacity) {
+			unsigned char* grown = realloc(buffer, capacity * 2);
+			if (!grown) { ret = Z_MEM_ERROR; break; }
+			buffer = grown;
+			capacity *= 2;
+		}
+		zs.next_out = &buffer[zs.total_out];
+		zs.avail_out = (uInt)(capacity - zs.total_out);
+		ret = inflate(&zs, Z_NO_FLUSH);
+	} while (ret == Z_OK || (ret == Z_BUF_ERROR && zs.avail_out == 0));
+
+	*out_length = zs.total_out;
+	inflateEnd(&zs);
+
+	if (ret != Z_STREAM_END) {
+		free(buffer);
+		return NULL;
+	}
+	return buffer;
+}
+
+static bool decode_directory(const unsigned char* p, apr_size_t length, PmtilesDirectory* directory) {
+	const unsigned char* end = p + length;
+	uint64_t count, value;
+
+	directory->entries = NULL;
+	directory->count = 0;
+
+	// every entry takes at least 4 bytes
+	if (!read_varint(&p, end, &count) || count > length)
+		return false;
+
+	PmtilesEntry* entries = malloc((count ? count : 1) * sizeof(PmtilesEntry));
+	if (!entries)
+		return false;
+
+	uint64_t last_id = 0;
+	for (uint64_t i = 0; i < count; i++) {
+		if (!read_varint(&p, end, &value)) goto corrupt;
+		last_id += value;
+		entries[i].tile_id = last_id;
+	}
+	for (uint64_t i = 0; i < count; i++) {
+		if (!read_varint(&p, end, &value)) goto corrupt;
+		entries[i].run_length = (uint32_t)value;
+	}
+	for (uint64_t i = 0; i < count; i++) {
+		if (!read_varint(&p, end, &value)) goto corrupt;
+		entries[i].length = (uint32_t)value;
+	}
+	for (uint64_t i = 0; i < count; i++) {
+		if (!read_varint(&p, end, &value)) goto corrupt;
+		if (value == 0 && i > 0)
+			entries[i].offset = entries[i - 1].offset + entries[i - 1].length;
+		else
+			entries[i].offset = value - 1;
+	}
+
+	directory->entries = entries;
+	directory->count = count;
+	return true;
+
+corrupt:
+	free(entries);
+	return false;
+}
+
+static bool load_directory(PmtilesArchive* archive, uint64_t offset, uint64_t length, PmtilesDirectory* directory) {
+	apr_size_t raw_length;
+	unsigned char* raw = read_section(archive, offset, length, &raw_length);
+	if (!raw)
+		return false;
+	bool ok = decode_directory(raw, raw_length, directory);
+	free(raw);
+	return ok;
+}
+
+static const PmtilesEntry* find_entry(const PmtilesDirectory* directory, uint64_t tile_id) {
+	apr_ssize_t low = 0;
+	apr_ssize_t high = (apr_ssize_t)directory->count - 1;
+	while (low <= high) {
+		apr_ssize_t middle = (low + high) >> 1;
+		const PmtilesEntry* entry = &directory->entries[middle];
+		if (tile_id > entry->tile_id)
+			low = middle + 1;
+		else if (tile_id < entry->tile_id)
+			high = middle - 1;
+		else
+			return entry;
+	}
+
+	// high is now the last entry before tile_id
+	if (high >= 0) {
+		const PmtilesEntry* entry = &directory->entries[high];
+		if (entry->run_length == 0)
+			return entry;	// leaf directory covering tile_id
+		if (tile_id - entry->tile_id < entry->run_length)
+			return entry;
+	}
+	return NULL;
+}
+
+static apr_status_t pmtiles_cleanup(void* data) {
+	PmtilesArchive* archive = (PmtilesArchive*)data;
+	free(archive->root.entries);
+	archive->root.entries = NULL;
+	for (int i = 0; i < PMTILES_LEAF_CACHE_SIZE; i++) {
+		free(archive->leaves[i].directory.entries);
+		archive->leaves[i].directory.entries = NULL;
+	}
+	return APR_SUCCESS;
+}
+
+bool mbtiles_is_pmtiles_path(const char* path) {
+	const char ext[] = ".pmtiles";
+	size_t len = strlen(path);
+	return len >= sizeof(ext) - 1 && strcasecmp(&path[len - sizeof(ext) + 1], ext) == 0;
+}
+
+apr_status_t mbtiles_pmtiles_open(PmtilesArchive* archive, const char* path, apr_pool_t* pool) {
+	apr_file_t* file;
+	apr_finfo_t finfo;
+	apr_status_t rv;
+
+	memset(archive, 0, sizeof(PmtilesArchive));
+
+	rv = apr_file_open(&file, path, APR_READ | APR_BINARY, APR_OS_DEFAULT, pool);
+	if (rv != APR_SUCCESS)
+		return rv;
+	rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, file);
+	if (rv == APR_SUCCESS && finfo.size < PMTILES_HEADER_SIZE)
+		rv = APR_EGENERAL;
+	if (rv == APR_SUCCESS)
+		rv = apr_mmap_create(&archive->map, file, 0, (apr_size_t)finfo.size, APR_MMAP_READ, pool);
+	apr_file_close(file);
+	if (rv != APR_SUCCESS)
+		return rv;
+
+	archive->data = (const unsigned char*)archive->map->mm;
+	archive->size = archive->map->size;
+
+	const unsigned char* h = archive->data;
+	if (memcmp(h, "PMTiles", 7) != 0 || h[7] != 3)
+		return APR_EGENERAL;
+
+	PmtilesHeader* header = &archive->header;
+	header->root_offset = read_u64(&h[8]);
+	header->root_length = read_u64(&h[16]);
+	header->metadata_offset = read_u64(&h[24]);
+	header->metadata_length = read_u64(&h[32]);
+	header->leaf_offset = read_u64(&h[40]);
+	header->leaf_length = read_u64(&h[48]);
+	header->data_offset = read_u64(&h[56]);
+	header->data_length = read_u64(&h[64]);
+	header->addressed_tiles = read_u64(&h[72]);
+	header->internal_compression = h[97];
+	header->tile_compression = h[98];
+	header->tile_type = h[99];
+	header->min_zoom = h[100];
+	header->max_zoom = h[101];
+	for (int i = 0; i < 4; i++)
+		header->bounds_e7[i] = read_i32(&h[102 + i * 4]);
+	header->center_zoom = h[118];
+	header->center_e7[0] = read_i32(&h[119]);
+	header->center_e7[1] = read_i32(&h[123]);
+
+	apr_pool_cleanup_register(pool, archive, pmtiles_cleanup, apr_pool_cleanup_null);
+
+	if (!load_directory(archive, header->root_offset, header->root_length, &archive->root))
+		return APR_EGENERAL;
+
+#if APR_HAS_THREADS
+	rv = apr_thread_mutex_create(&archive->leaves_mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+	if (rv != APR_SUCCESS)
+		return rv;
+#endif
+
+	return APR_SUCCESS;
+}
+
+// Looks up tile_id in the leaf directory at offset, through the LRU. Must be called under leaves_mutex.
+static bool find_in_leaf(PmtilesArchive* archive, uint64_t offset, uint32_t length, uint64_t tile_id, PmtilesEntry* found) {
+	PmtilesLeafSlot* slot = NULL;
+	PmtilesLeafSlot* oldest = &archive->leaves[0];
+
+	for (int i = 0; i < PMTILES_LEAF_CACHE_SIZE; i++) {
+		PmtilesLeafSlot* s = &archive->leaves[i];
+		if (s->directory.entries && s->offset == offset) {
+			slot = s;
+			break;
+		}
+		if (!s->directory.entries || (oldest->directory.entries && s->last_used < oldest->last_used))
+			oldest = s;
+	}
+
+	if (!slot) {
+		slot = oldest;
+		free(slot->directory.entries);
+		slot->directory.entries = NULL;
+		if (!load_directory(archive, archive->header.leaf_offset + offset, length, &slot->directory))
+			return false;
+		slot->offset = offset;
+	}
+	slot->last_used = ++archive->tick;
+
+	const PmtilesEntry* entry = find_entry(&slot->directory, tile_id);
+	if (entry)
+		*found = *entry;
+	else
+		found->length = 0;
+	return true;
+}
+
+bool mbtiles_pmtiles_find(PmtilesArchive* archive, int z, int x, int y, const unsigned char** data, apr_size_t* size) {
+	*data = NULL;
+	if (z < 0 || z > 31 || x < 0 || y < 0)
+		return true;
+
+	uint64_t tile_id = mbtiles_zxy_to_tileid(z, x, y);
+
+	PmtilesEntry entry;
+	const PmtilesEntry* root_entry = find_entry(&archive->root, tile_id);
+	if (!root_entry)
+		return true;
+	entry = *root_entry;
+
+	for (int depth = 0; entry.run_length == 0; depth++) {
+		if (depth == PMTILES_MAX_DEPTH)
+			return false;
+
+		bool ok;
+#if APR_HAS_THREADS
+		apr_thread_mutex_lock(archive->leaves_mutex);
+#endif
+		ok = find_in_leaf(archive, entry.offset, entry.length, tile_id, &entry);
+#if APR_HAS_THREADS
+		apr_thread_mutex_unlock(archive->leaves_mutex);
+#endif
+		if (!ok)
+			return false;
+		if (entry.length == 0)
+			return true;	// not in the leaf
+	}
+
+	uint64_t offset = archive->header.data_offset + entry.offset;
+	if (offset > archive->size || entry.length > archive->size - offset)
+		return false;
+
+	*data = &archive->data[offset];
+	*size = entry.length;
+	return true;
+}
+
+const char* mbtiles_pmtiles_format(const PmtilesArchive* archive) {
+	switch (archive->header.tile_type) {
+		case PMTILES_TYPE_MVT: return "pbf";
+		case PMTILES_TYPE_PNG: return "png";
+		case PMTILES_TYPE_JPEG: return "jpg";
+		case PMTILES_TYPE_WEBP: return "webp";
+		case PMTILES_TYPE_AVIF: return "avif";
+	}
+	return "unknown";
+}
+
+// end of the JSON value starting at p (string, object, array or literal)
+static const char* skip_json_value(const char* p, const char* end) {
+	if (p >= end)
+		return end;
+	if (*p == '"') {
+		for (p++; p < end && *p != '"'; p++)
+			if (*p == '\\') p++;
+		return p < end ? p + 1 : end;
+	}
+	if (*p == '{' || *p == '[') {
+		int depth = 0;
+		for (; p < end; p++) {
+			if (*p == '"') {
+				p = skip_json_value(p, end) - 1;
+				continue;
+			}
+			if (*p == '{' || *p == '[') depth++;
+			else if (*p == '}' || *p == ']') {
+				if (--depth == 0) return p + 1;
+			}
+		}
+		return end;
+	}
+	while (p < end && *p != ',' && *p != '}' && *p != ']')
+		p++;
+	return p;
+}
+
+static void put_utf8(char** out, unsigned long c) {
+	char* o = *out;
+	if (c < 0x80)
+		*o++ = (char)c;
+	else if (c < 0x800) {
+		*o++ = (char)(0xc0 | c >> 6);
+		*o++ = (char)(0x80 | (c & 0x3f));
+	}
+	else if (c < 0x10000) {
+		*o++ = (char)(0xe0 | c >> 12);
+		*o++ = (char)(0x80 | (c >> 6 & 0x3f));
+		*o++ = (char)(0x80 | (c & 0x3f));
+	}
+	else {
+		*o++ = (char)(0xf0 | c >> 18);
+		*o++ = (char)(0x80 | (c >> 12 & 0x3f));
+		*o++ = (char)(0x80 | (c >> 6 & 0x3f));
+		*o++ = (char)(0x80 | (c & 0x3f));
+	}
+	*out = o;
+}
+
+static bool read_hex4(const char* p, const char* end, unsigned long* value) {
+	if (end - p < 4)
+		return false;
+	*value = 0;
+	for (int i = 0; i < 4; i++) {
+		char h = p[i];
+		int digit = h >= '0' && h <= '9' ? h - '0' : h >= 'a' && h <= 'f' ? h - 'a' + 10 : h >= 'A' && h <= 'F' ? h - 'A' + 10 : -1;
+		if (digit < 0)
+			return false;
+		*value = *value << 4 | digit;
+	}
+	return true;
+}
+
+// the text of the JSON string from p (its opening quote) to end (past its closing one), unescaped
+static char* read_json_string(const char* p, const char* end, apr_pool_t* pool) {
+	p++;
+	if (end > p)
+		end--;	// an unterminated string runs to the end of the metadata
+	// unescaping never makes it longer: \uXXXX is 6 bytes for at most 3, a surrogate pair 12 for 4
+	char* text = apr_palloc(pool, end - p + 1);
+	char* o = text;
+	while (p < end) {
+		if (*p != '\\') {
+			*o++ = *p++;
+			continue;
+		}
+		if (++p >= end)
+			break;
+		char c = *p++;
+		unsigned long code;
+		switch (c) {
+			case 'b': *o++ = '\b'; break;
+			case 'f': *o++ = '\f'; break;
+			case 'n': *o++ = '\n'; break;
+			case 'r': *o++ = '\r'; break;
+			case 't': *o++ = '\t'; break;
+			case 'u':
+				if (!read_hex4(p, end, &code))
+					break;
+				p += 4;
+				if (code >= 0xd800 && code < 0xdc00) {
+					unsigned long low;
+					if (end - p >= 6 && p[0] == '\\' && p[1] == 'u' && read_hex4(p + 2, end, &low) && low >= 0xdc00 && low < 0xe000) {
+						code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+						p += 6;
+					}
+					else
+						code = 0xfffd;	// unpaired surrogate
+				}
+				else if (code >= 0xdc00 && code < 0xe000)
+					code = 0xfffd;
+				put_utf8(&o, code);
+				break;
+			default: *o++ = c; break;	// \" \\ \/
+		}
+	}
+	*o = '\0';
+	return text;
+}
+
+static const char* skip_json_space(const char* p, const char* end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+		p++;
+	return p;
+}
+
+bool mbtiles_pmtiles_read_metadata(PmtilesArchive* archive, TilesetMetadata* metadata, apr_pool_t* pool) {
+	PmtilesHeader* header = &archive->header;
+
+	metadata->format = apr_pstrdup(pool, mbtiles_pmtiles_format(archive));
+	metadata->min_zoom = header->min_zoom;
+	metadata->max_zoom = header->max_zoom;
+	for (int i = 0; i < 4; i++)
+		metadata->bounds[i] = header->bounds_e7[i] / 10000000.0f;
+	metadata->center[0] = header->center_e7[0] / 10000000.0;
+	metadata->center[1] = header->center_e7[1] / 10000000.0;
+	metadata->center[2] = header->center_zoom;
+
+	apr_size_t length;
+	char* json = (char*)read_section(archive, header->metadata_offset, header->metadata_length, &length);
+	if (!json)
+		return false;
+
+	// walk the top level object: strings go through the usual metadata rows, vector_layers through "json"
+	const char* end = json + length;
+	const char* p = skip_json_space(json, end);
+	if (p < end && *p == '{') p++;
+
+	while (p < end) {
+		p = skip_json_space(p, end);
+		if (p >= end || *p != '"')
+			break;
+
+		const char* key_end = skip_json_value(p, end);
+		char* name = read_json_string(p, key_end, pool);
+
+		p = skip_json_space(key_end, end);
+		if (p >= end || *p != ':')
+			break;
+		p = skip_json_space(p + 1, end);
+
+		const char* value_end = skip_json_value(p, end);
+
+		if (*p == '"') {
+			char* value = read_json_string(p, value_end, pool);
+			// the header wins over the JSON copies
+			if (strcmp(name, "minzoom") && strcmp(name, "maxzoom") && strcmp(name, "bounds") && strcmp(name, "format"))
+				mbtiles_metadata_parse(name, value, metadata, pool);
+		}
+		else if (strcmp(name, "vector_layers") == 0) {
+			char* value = apr_pstrcat(pool, "\"vector_layers\":", apr_pstrmemdup(pool, p, value_end - p), NULL);
+			mbtiles_metadata_parse("json", value, metadata, pool);
+		}
+
+		p = skip_json_space(value_end, end);
+		if (p < end && *p == ',')
+			p++;
+		else
+			break;
+	}
+
+	free(json);
+	return true;
+}
@@ -0,0 +1,92 @@
+#pragma once
+#ifndef MBTILES_PMTILES_H
+#define MBTILES_PMTILES_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "apr_pools.h"
+#include "apr_mmap.h"
+#include "apr_thread_mutex.h"
+
+#include "mbtiles_metadata.h"
+
+/*
+	Read-only PMTiles v3 archive (https://github.com/protomaps/PMTiles/blob/main/spec/v3/spec.md)
+	The file is mmap'd, the root directory is decoded once, leaf directories go through a small LRU.
+*/
+
+#define PMTILES_HEADER_SIZE 127
+#define PMTILES_LEAF_CACHE_SIZE 64
+#define PMTILES_MAX_DEPTH 4
+
+#define PMTILES_COMPRESSION_UNKNOWN 0
+#define PMTILES_COMPRESSION_NONE 1
+#define PMTILES_COMPRESSION_GZIP 2
+
+#define PMTILES_TYPE_UNKNOWN 0
+#define PMTILES_TYPE_MVT 1
+#define PMTILES_TYPE_PNG 2
+#define PMTILES_TYPE_JPEG 3
+#define PMTILES_TYPE_WEBP 4
+#define PMTILES_TYPE_AVIF 5
+
+typedef struct PmtilesHeader {
+	uint64_t root_offset;
+	uint64_t root_length;
+	uint64_t metadata_offset;
+	uint64_t metadata_length;
+	uint64_t leaf_offset;
+	uint64_t leaf_length;
+	uint64_t data_offset;
+	uint64_t data_length;
+	uint64_t addressed_tiles;
+	int internal_compression;
+	int tile_compression;
+	int tile_type;
+	int min_zoom;
+	int max_zoom;
+	int32_t bounds_e7[4];
+	int center_zoom;
+	int32_t center_e7[2];
+} PmtilesHeader;
+
+typedef struct PmtilesEntry {
+	uint64_t tile_id;
+	uint64_t offset;
+	uint32_t length;
+	uint32_t run_length;
+} PmtilesEntry;
+
+typedef struct PmtilesDirectory {
+	PmtilesEntry* entries;
+	apr_size_t count;
+} PmtilesDirectory;
+
+typedef struct PmtilesLeafSlot {
+	uint64_t offset;		// offset inside the leaf section, key of the slot
+	uint64_t last_used;
+	PmtilesDirectory directory;
+} PmtilesLeafSlot;
+
+typedef struct PmtilesArchive {
+	apr_mmap_t* map;
+	const unsigned char* data;
+	uint64_t size;
+	PmtilesHeader header;
+	PmtilesDirectory root;
+	PmtilesLeafSlot leaves[PMTILES_LEAF_CACHE_SIZE];
+	uint64_t tick;
+#if APR_HAS_THREADS
+	apr_thread_mutex_t* leaves_mutex;
+#endif
+} PmtilesArchive;
+
+apr_status_t mbtiles_pmtiles_open(PmtilesArchive* archive, const char* path, apr_pool_t* pool);
+// returns false on a corrupt archive, *data == NULL if the tile isn't there
+bool mbtiles_pmtiles_find(PmtilesArchive* archive, int z, int x, int y, const unsigned char** data, apr_size_t* size);
+bool mbtiles_pmtiles_read_metadata(PmtilesArchive* archive, TilesetMetadata* metadata, apr_pool_t* pool);
+const char* mbtiles_pmtiles_format(const PmtilesArchive* archive);
+bool mbtiles_is_pmtiles_path(const char* path);
+
+#endif	// MBTILES_PMTILES_H
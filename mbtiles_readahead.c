@@ -0,0 +1,114 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "apr_pools.h"
+#include "apr_atomic.h"
+
+#include "mbtiles_readahead.h"
+
+#if APR_HAS_THREADS
+
+static bool overlaps(const ReadAheadJob* job, int source, int z, int x, int y) {
+	return job->source == source && job->z == z && abs(job->x - x) <= job->radius && abs(job->y - y) <= job->radius;
+}
+
+static void* APR_THREAD_FUNC readahead_thread(apr_thread_t* thread, void* data) {
+	ReadAhead* readahead = (ReadAhead*)data;
+
+	apr_thread_mutex_lock(readahead->mutex);
+	while (!readahead->stop) {
+		if (readahead->count == 0) {
+			apr_thread_cond_wait(readahead->cond, readahead->mutex);
+			continue;
+		}
+		readahead->current = readahead->queue[readahead->head];
+		readahead->head = (readahead->head + 1) % READAHEAD_QUEUE_SIZE;
+		readahead->count--;
+		readahead->busy = 1;
+		apr_thread_mutex_unlock(readahead->mutex);
+
+		readahead->fetch(&readahead->current, readahead->job_pool);
+		apr_pool_clear(readahead->job_pool);
+		apr_atomic_inc32(&readahead->stats.windows);
+
+		apr_thread_mutex_lock(readahead->mutex);
+		readahead->busy = 0;
+	}
+	apr_thread_mutex_unlock(readahead->mutex);
+
+	apr_thread_exit(thread, APR_SUCCESS);
+	return NULL;
+}
+
+static apr_status_t readahead_cleanup(void* data) {
+	ReadAhead* readahead = (ReadAhead*)data;
+	apr_status_t rv;
+
+	apr_thread_mutex_lock(readahead->mutex);
+	readahead->stop = 1;
+	readahead->running = 0;
+	apr_thread_cond_signal(readahead->cond);
+	apr_thread_mutex_unlock(readahead->mutex);
+	apr_thread_join(&rv, readahead->thread);
+	return APR_SUCCESS;
+}
+
+apr_status_t mbtiles_readahead_start(ReadAhead* readahead, ReadAheadFetch fetch, apr_pool_t* pool) {
+	memset(readahead, 0, sizeof(ReadAhead));
+	readahead->fetch = fetch;
+
+	apr_status_t rv = apr_pool_create(&readahead->job_pool, pool);
+	if (rv == APR_SUCCESS)
+		rv = apr_thread_mutex_create(&readahead->mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+	if (rv == APR_SUCCESS)
+		rv = apr_thread_cond_create(&readahead->cond, pool);
+	if (rv == APR_SUCCESS)
+		rv = apr_thread_create(&readahead->thread, NULL, readahead_thread, readahead, pool);
+	if (rv != APR_SUCCESS)
+		return rv;
+
+	readahead->running = 1;
+	apr_pool_cleanup_register(pool, readahead, readahead_cleanup, apr_pool_cleanup_null);
+	return APR_SUCCESS;
+}
+
+void mbtiles_readahead_queue(ReadAhead* readahead, int source, int z, int x, int y, int radius) {
+	if (!readahead->running)
+		return;
+
+	apr_thread_mutex_lock(readahead->mutex);
+	bool skip = readahead->busy && overlaps(&readahead->current, source, z, x, y);
+	for (int i = 0; i < readahead->count && !skip; i++)
+		skip = overlaps(&readahead->queue[(readahead->head + i) % READAHEAD_QUEUE_SIZE], source, z, x, y);
+
+	if (!skip) {
+		if (readahead->count == READAHEAD_QUEUE_SIZE)
+			apr_atomic_inc32(&readahead->stats.dropped);
+		else {
+			ReadAheadJob* job = &readahead->queue[(readahead->head + readahead->count) % READAHEAD_QUEUE_SIZE];
+			job->source = source;
+			job->z = z;
+			job->x = x;
+			job->y = y;
+			job->radius = radius;
+			readahead->count++;
+			apr_atomic_inc32(&readahead->stats.queued);
+			apr_thread_cond_signal(readahead->cond);
+		}
+	}
+	apr_thread_mutex_unlock(readahead->mutex);
+}
+
+#else
+
+apr_status_t mbtiles_readahead_start(ReadAhead* readahead, ReadAheadFetch fetch, apr_pool_t* pool) {
+	memset(readahead, 0, sizeof(ReadAhead));
+	return APR_ENOTIMPL;
+}
+
+void mbtiles_readahead_queue(ReadAhead* readahead, int source, int z, int x, int y, int radius) {
+}
+
+#endif
@@ -0,0 +1,62 @@
+#pragma once
+#ifndef MBTILES_READAHEAD_H
+#define MBTILES_READAHEAD_H
+
+#include <stdbool.h>
+
+#include "apr_pools.h"
+#include "apr_thread_proc.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+
+/*
+	Spatial read-ahead inside one child: after a tile cache miss, the window of tiles around it
+	is fetched by a background thread, so the neighbours a map client asks for next are already cached.
+	The thread only runs jobs; what a job reads and where it puts the tiles is up to the fetch callback.
+*/
+
+#define READAHEAD_QUEUE_SIZE 64
+#define READAHEAD_MAX_RADIUS 8
+
+typedef struct ReadAheadJob {
+	int source;		// whatever the caller uses to find the tileset
+	int z;
+	int x;
+	int y;
+	int radius;
+} ReadAheadJob;
+
+typedef void (*ReadAheadFetch)(const ReadAheadJob* job, apr_pool_t* pool);
+
+typedef struct ReadAheadStats {
+	apr_uint32_t queued;
+	apr_uint32_t dropped;	// queue full
+	apr_uint32_t windows;	// range queries run
+	apr_uint32_t tiles;		// tiles put in the cache
+	apr_uint32_t hits;		// requests answered by a prefetched tile
+} ReadAheadStats;
+
+typedef struct ReadAhead {
+	int running;
+	ReadAheadFetch fetch;
+	ReadAheadJob queue[READAHEAD_QUEUE_SIZE];
+	int head;
+	int count;
+	ReadAheadJob current;
+	int busy;
+	int stop;
+	volatile ReadAheadStats stats;
+#if APR_HAS_THREADS
+	apr_thread_t* thread;
+	apr_thread_mutex_t* mutex;
+	apr_thread_cond_t* cond;
+#endif
+	apr_pool_t* job_pool;
+} ReadAhead;
+
+// starts the thread; it is stopped by a cleanup of pool
+apr_status_t mbtiles_readahead_start(ReadAhead* readahead, ReadAheadFetch fetch, apr_pool_t* pool);
+// never blocks; a job overlapping a queued or running window is skipped
+void mbtiles_readahead_queue(ReadAhead* readahead, int source, int z, int x, int y, int radius);
+
+#endif	// MBTILES_READAHEAD_H
@@ -0,0 +1,255 @@
+/*
+	Rewrites an .mbtiles file so that tiles close on the map are close on disk.
+
+	Generators write tiles in whatever order they render them, so the tiles of one map view end up
+	on pages all over the file. This copies them into a new file in tile ID order (the Hilbert curve
+	of mbtiles_tileid.h, zoom by zoom), storing identical tiles once:
+
+		images(tile_id INTEGER PRIMARY KEY, tile_data BLOB)		one row per distinct tile, in Hilbert order
+		map(zoom_level, tile_column, tile_row, tile_id)			WITHOUT ROWID, keyed by the tile coordinates
+		tiles													view joining the two, as the MBTiles spec allows
+
+	mod_mbtiles reads the result like any other .mbtiles, through the tiles view.
+
+	To build:
+		cc -o mbtiles_repack mbtiles_repack.c -lsqlite3
+
+	Usage:
+		mbtiles_repack /path/to/input.mbtiles /path/to/output.mbtiles
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sqlite3.h>
+
+#include "mbtiles_tileid.h"
+
+typedef struct RepackKey {
+	uint64_t tile_id;
+	int column;
+	int row;
+} RepackKey;
+
+static int compare_keys(const void* a, const void* b) {
+	const RepackKey* ka = (const RepackKey*)a;
+	const RepackKey* kb = (const RepackKey*)b;
+	if (ka->tile_id < kb->tile_id) return -1;
+	if (ka->tile_id > kb->tile_id) return 1;
+	return 0;
+}
+
+static uint64_t hash_blob(const unsigned char* data, int length) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (int i = 0; i < length; i++) {
+		hash ^= data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static const char* schema =
+	"PRAGMA page_size=16384;"
+	"PRAGMA journal_mode=OFF;"
+	"PRAGMA synchronous=OFF;"
+	"CREATE TABLE metadata (name TEXT, value TEXT);"
+	"CREATE UNIQUE INDEX name ON metadata (name);"
+	"CREATE TABLE images (tile_id INTEGER PRIMARY KEY, tile_data BLOB);"
+	"CREATE TABLE map (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_id INTEGER,"
+	" PRIMARY KEY (zoom_level, tile_column, tile_row)) WITHOUT ROWID;"
+	"CREATE VIEW tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, map.tile_row AS tile_row,"
+	" images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id;"
+	"CREATE TEMP TABLE seen (hash INTEGER, tile_id INTEGER);"
+	"CREATE INDEX temp.seen_hash ON seen (hash);";
+
+typedef struct Repack {
+	sqlite3* in;
+	sqlite3* out;
+	sqlite3_stmt* read;
+	sqlite3_stmt* find;		// an image with the same hash and bytes
+	sqlite3_stmt* add_image;
+	sqlite3_stmt* add_seen;
+	sqlite3_stmt* add_map;
+	sqlite3_int64 images;
+	sqlite3_int64 tiles;
+	sqlite3_int64 bytes;
+} Repack;
+
+// the image of a tile, stored now unless the same bytes already are
+static sqlite3_int64 store_image(Repack* repack, const unsigned char* data, int length) {
+	sqlite3_int64 hash = (sqlite3_int64)hash_blob(data, length);
+
+	sqlite3_bind_int64(repack->find, 1, hash);
+	sqlite3_bind_blob(repack->find, 2, data, length, SQLITE_STATIC);
+	sqlite3_int64 tile_id = 0;
+	if (sqlite3_step(repack->find) == SQLITE_ROW)
+		tile_id = sqlite3_column_int64(repack->find, 0);
+	sqlite3_reset(repack->find);
+	if (tile_id)
+		return tile_id;
+
+	tile_id = ++repack->images;
+	sqlite3_bind_int64(repack->add_image, 1, tile_id);
+	sqlite3_bind_blob(repack->add_image, 2, data, length, SQLITE_STATIC);
+	if (sqlite3_step(repack->add_image) != SQLITE_DONE)
+		tile_id = 0;
+	sqlite3_reset(repack->add_image);
+
+	sqlite3_bind_int64(repack->add_seen, 1, hash);
+	sqlite3_bind_int64(repack->add_seen, 2, tile_id);
+	sqlite3_step(repack->add_seen);
+	sqlite3_reset(repack->add_seen);
+
+	repack->bytes += length;
+	return tile_id;
+}
+
+static int repack_zoom(Repack* repack, int zoom) {
+	sqlite3_stmt* pStmt;
+	size_t count = 0;
+	size_t capacity = 4096;
+	RepackKey* keys = malloc(capacity * sizeof(RepackKey));
+	if (!keys) return 0;
+
+	sqlite3_prepare_v2(repack->in, "SELECT tile_column, tile_row FROM tiles WHERE zoom_level=?;", -1, &pStmt, NULL);
+	sqlite3_bind_int(pStmt, 1, zoom);
+	while (sqlite3_step(pStmt) == SQLITE_ROW) {
+		if (count == capacity) {
+			capacity *= 2;
+			RepackKey* grown = realloc(keys, capacity * sizeof(RepackKey));
+			if (!grown) { free(keys); sqlite3_finalize(pStmt); return 0; }
+			keys = grown;
+		}
+		keys[count].column = sqlite3_column_int(pStmt, 0);
+		keys[count].row = sqlite3_column_int(pStmt, 1);
+		keys[count].tile_id = mbtiles_zxy_to_tileid(zoom, keys[count].column, mbtiles_flip_y(zoom, keys[count].row));
+		count++;
+	}
+	sqlite3_finalize(pStmt);
+
+	qsort(keys, count, sizeof(RepackKey), compare_keys);
+
+	int ok = 1;
+	for (size_t i = 0; i < count && ok; i++) {
+		sqlite3_bind_int(repack->read, 1, zoom);
+		sqlite3_bind_int(repack->read, 2, keys[i].column);
+		sqlite3_bind_int(repack->read, 3, keys[i].row);
+
+		if (sqlite3_step(repack->read) == SQLITE_ROW) {
+			const unsigned char* data = sqlite3_column_blob(repack->read, 0);
+			int length = sqlite3_column_bytes(repack->read, 0);
+
+			sqlite3_int64 tile_id = store_image(repack, data, length);
+			sqlite3_bind_int(repack->add_map, 1, zoom);
+			sqlite3_bind_int(repack->add_map, 2, keys[i].column);
+			sqlite3_bind_int(repack->add_map, 3, keys[i].row);
+			sqlite3_bind_int64(repack->add_map, 4, tile_id);
+			ok = tile_id && sqlite3_step(repack->add_map) == SQLITE_DONE;
+			sqlite3_reset(repack->add_map);
+			repack->tiles++;
+		}
+		sqlite3_reset(repack->read);
+	}
+
+	free(keys);
+	return ok;
+}
+
+static int copy_metadata(Repack* repack) {
+	sqlite3_stmt* select;
+	sqlite3_stmt* insert;
+	if (SQLITE_OK != sqlite3_prepare_v2(repack->in, "SELECT name, value FROM metadata;", -1, &select, NULL))
+		return 0;
+	sqlite3_prepare_v2(repack->out, "INSERT OR REPLACE INTO metadata (name, value) VALUES (?, ?);", -1, &insert, NULL);
+
+	int ok = 1;
+	while (ok && sqlite3_step(select) == SQLITE_ROW) {
+		sqlite3_bind_value(insert, 1, sqlite3_column_value(select, 0));
+		sqlite3_bind_value(insert, 2, sqlite3_column_value(select, 1));
+		ok = sqlite3_step(insert) == SQLITE_DONE;
+		sqlite3_reset(insert);
+	}
+	sqlite3_finalize(select);
+	sqlite3_finalize(insert);
+	return ok;
+}
+
+int main(int argc, char** argv) {
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s input.mbtiles output.mbtiles\n", argv[0]);
+		return 1;
+	}
+
+	const char* path = argv[1];
+	const char* out_path = argv[2];
+	Repack repack;
+	memset(&repack, 0, sizeof(repack));
+
+	if (SQLITE_OK != sqlite3_open_v2(path, &repack.in, SQLITE_OPEN_READONLY, NULL)) {
+		fprintf(stderr, "Couldn't open %s\n", path);
+		return 1;
+	}
+
+	size_t tmp_len = strlen(out_path) + 5;
+	char* out_tmp = malloc(tmp_len);
+	if (!out_tmp)
+		return 1;
+	snprintf(out_tmp, tmp_len, "%s.tmp", out_path);
+	remove(out_tmp);
+
+	char* error = NULL;
+	if (SQLITE_OK != sqlite3_open(out_tmp, &repack.out) || SQLITE_OK != sqlite3_exec(repack.out, schema, NULL, NULL, &error)) {
+		fprintf(stderr, "Couldn't create %s: %s\n", out_tmp, error ? error : sqlite3_errmsg(repack.out));
+		return 1;
+	}
+
+	sqlite3_prepare_v2(repack.in, "SELECT tile_data FROM tiles WHERE zoom_level=? AND tile_column=? AND tile_row=?;", -1, &repack.read, NULL);
+	sqlite3_prepare_v2(repack.out, "SELECT images.tile_id FROM seen JOIN images ON images.tile_id = seen.tile_id"
+									" WHERE seen.hash=? AND images.tile_data=?;", -1, &repack.find, NULL);
+	sqlite3_prepare_v2(repack.out, "INSERT INTO images (tile_id, tile_data) VALUES (?, ?);", -1, &repack.add_image, NULL);
+	sqlite3_prepare_v2(repack.out, "INSERT INTO seen (hash, tile_id) VALUES (?, ?);", -1, &repack.add_seen, NULL);
+	sqlite3_prepare_v2(repack.out, "INSERT INTO map (zoom_level, tile_column, tile_row, tile_id) VALUES (?, ?, ?, ?);", -1, &repack.add_map, NULL);
+
+	sqlite3_exec(repack.out, "BEGIN;", NULL, NULL, NULL);
+	int ok = copy_metadata(&repack);
+	if (!ok)
+		fprintf(stderr, "Couldn't copy the metadata\n");
+
+	sqlite3_stmt* pStmt;
+	sqlite3_prepare_v2(repack.in, "SELECT DISTINCT zoom_level FROM tiles ORDER BY zoom_level;", -1, &pStmt, NULL);
+	while (ok && sqlite3_step(pStmt) == SQLITE_ROW) {
+		int zoom = sqlite3_column_int(pStmt, 0);
+		if (!repack_zoom(&repack, zoom)) {
+			fprintf(stderr, "Failed at zoom %d: %s\n", zoom, sqlite3_errmsg(repack.out));
+			ok = 0;
+			break;
+		}
+		printf("z%d done, %lld tiles, %lld distinct, %lld bytes\n", zoom, repack.tiles, repack.images, repack.bytes);
+	}
+	sqlite3_finalize(pStmt);
+
+	ok = ok && SQLITE_OK == sqlite3_exec(repack.out, "COMMIT; DROP TABLE seen; ANALYZE;", NULL, NULL, NULL);
+
+	sqlite3_finalize(repack.read);
+	sqlite3_finalize(repack.find);
+	sqlite3_finalize(repack.add_image);
+	sqlite3_finalize(repack.add_seen);
+	sqlite3_finalize(repack.add_map);
+	sqlite3_close(repack.in);
+	ok = (SQLITE_OK == sqlite3_close(repack.out)) && ok;
+
+	if (!ok) {
+		remove(out_tmp);
+		return 1;
+	}
+
+	remove(out_path);
+	if (rename(out_tmp, out_path) != 0) {
+		fprintf(stderr, "Couldn't rename %s to %s\n", out_tmp, out_path);
+		return 1;
+	}
+
+	printf("%s: %lld tiles, %lld distinct\n", out_path, repack.tiles, repack.images);
+	return 0;
+}
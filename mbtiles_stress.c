@@ -0,0 +1,231 @@
+/*
+	Stress test of the request path: runs mbtiles_composite_handler from many threads at once against shared
+	tilesets, as a worker or event MPM child does, and prints the throughput for 1, 2, 4 ... up to N threads.
+
+	Each thread mixes single tiles, composites of two tilesets, a versioned tileset, metadata.json and requests
+	that fail (an unknown tileset, a missing layer of a composite, a zoom the file doesn't have), over tiles
+	picked at random from the file. Built with ThreadSanitizer, a race on the module's shared state (tilesets[],
+	the caches, the pools) is reported as soon as two threads hit it; the throughput column tells whether a
+	cache or a pool scales with the threads or serializes them.
+
+	It includes mod_mbtiles.c with TEST_MOD and links mbtiles_testmod.c, which stands in for the httpd functions
+	the handler calls, so it needs httpd's and APR's headers but no server. Its tilesets are a.mbtiles added
+	three times: stress_a, stress_b and stress_a under version v2.
+
+	To build (add mbtiles_webp.c's -DMBTILES_WITH_WEBP libraries if the module is built with them):
+		cc -O1 -g -fsanitize=thread -o mbtiles_stress -I$(apxs -q INCLUDEDIR) $(apr-1-config --cppflags --includes) \
+			mbtiles_stress.c mbtiles_testmod.c mbtiles_metadata.c mbtiles_pack.c mbtiles_pmtiles.c mbtiles_flight.c \
+			mbtiles_memtable.c mbtiles_cache.c mbtiles_hot.c mbtiles_readahead.c mbtiles_admission.c mbtiles_extract.c \
+			mbtiles_webp.c mbtiles_overzoom.c mbtiles_deflate.c $(apu-1-config --link-ld) $(apr-1-config --link-ld) -lsqlite3 -lz -lpcre2-8
+
+	Usage:
+		mbtiles_stress /path/to/a.mbtiles [max threads, 8] [seconds per run, 5] [tile cache size, e.g. 64M]
+
+	Prints one tab-separated line per run: threads, requests per second, speedup over one thread, then how many
+	requests were served, not found, and failed otherwise (a 500 is a bug unless the file is broken).
+*/
+
+#define TEST_MOD
+#include "mod_mbtiles.c"
+
+#include "apr_general.h"
+#include "apr_thread_proc.h"
+
+#include "mbtiles_testmod.h"
+
+#define STRESS_SAMPLE 4096	// tiles picked from the file
+
+typedef struct StressTile {
+	int z;
+	int x;
+	int y;	// XYZ, as in the URL
+} StressTile;
+
+typedef struct Worker {
+	apr_pool_t* pool;
+	apr_time_t deadline;
+	unsigned int seed;
+	long requests;
+	long served;
+	long not_found;
+	long failed;
+} Worker;
+
+static conn_rec stress_connection;
+static StressTile stress_tiles[STRESS_SAMPLE];
+static int stress_tile_count = 0;
+
+static bool sampleTiles(const char* path) {
+	sqlite3* db;
+	sqlite3_stmt* stmt;
+	if (SQLITE_OK != sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL))
+		return false;
+	if (SQLITE_OK == sqlite3_prepare_v2(db, "SELECT zoom_level, tile_column, tile_row FROM tiles ORDER BY random() LIMIT ?", -1, &stmt, NULL)) {
+		sqlite3_bind_int(stmt, 1, STRESS_SAMPLE);
+		while (SQLITE_ROW == sqlite3_step(stmt)) {
+			StressTile* tile = &stress_tiles[stress_tile_count++];
+			tile->z = sqlite3_column_int(stmt, 0);
+			tile->x = sqlite3_column_int(stmt, 1);
+			tile->y = (1 << tile->z) - 1 - sqlite3_column_int(stmt, 2);
+		}
+		sqlite3_finalize(stmt);
+	}
+	sqlite3_close(db);
+	return stress_tile_count > 0;
+}
+
+// out of every 20 requests: 10 single, 4 composite, 2 versioned, 1 metadata, 3 that fail
+static const char* nextUri(Worker* worker, apr_pool_t* pool) {
+	const StressTile* tile = &stress_tiles[rand_r(&worker->seed) % stress_tile_count];
+	int kind = rand_r(&worker->seed) % 20;
+	if (kind < 10)
+		return apr_psprintf(pool, "/stress_a/%d/%d/%d.pbf", tile->z, tile->x, tile->y);
+	if (kind < 14)
+		return apr_psprintf(pool, "/stress_a,stress_b/%d/%d/%d.pbf", tile->z, tile->x, tile->y);
+	if (kind < 16)
+		return apr_psprintf(pool, "/v2/stress_a/%d/%d/%d.pbf", tile->z, tile->x, tile->y);
+	if (kind < 17)
+		return tile->x % 2 ? "/stress_a/metadata.json" : "/stress_a,stress_b/metadata.json";
+	if (kind < 18)
+		return apr_psprintf(pool, "/stress_none/%d/%d/%d.pbf", tile->z, tile->x, tile->y);
+	if (kind < 19)
+		return apr_psprintf(pool, "/stress_a,stress_none/%d/%d/%d.pbf", tile->z, tile->x, tile->y);
+	return apr_psprintf(pool, "/stress_a/30/%d/%d.pbf", tile->x, tile->y);
+}
+
+static int stressRequest(apr_pool_t* pool, const char* uri) {
+	request_rec* r = apr_pcalloc(pool, sizeof(request_rec));
+	r->pool = pool;
+	r->server = &testmod_server;
+	r->connection = &stress_connection;
+	r->log = &testmod_server.log;
+	r->method = "GET";
+	r->method_number = M_GET;
+	r->hostname = "localhost";
+	r->uri = apr_pstrdup(pool, uri);
+	r->request_time = apr_time_now();
+	r->headers_in = apr_table_make(pool, 4);
+	r->headers_out = apr_table_make(pool, 8);
+	r->err_headers_out = apr_table_make(pool, 4);
+	r->notes = apr_table_make(pool, 4);
+	r->subprocess_env = apr_table_make(pool, 4);
+	return mbtiles_composite_handler(r);
+}
+
+static void* APR_THREAD_FUNC stressThread(apr_thread_t* thread, void* data) {
+	Worker* worker = (Worker*)data;
+	while (apr_time_now() < worker->deadline) {
+		int status = stressRequest(worker->pool, nextUri(worker, worker->pool));
+		worker->requests++;
+		if (status == OK)
+			worker->served++;
+		else if (status == HTTP_NOT_FOUND)
+			worker->not_found++;
+		else
+			worker->failed++;
+		apr_pool_clear(worker->pool);
+	}
+	apr_thread_exit(thread, APR_SUCCESS);
+	return NULL;
+}
+
+static double stressRun(int threads, int seconds, double base, apr_pool_t* pool) {
+	Worker* workers = apr_pcalloc(pool, threads * sizeof(Worker));
+	apr_thread_t** handles = apr_pcalloc(pool, threads * sizeof(apr_thread_t*));
+	apr_time_t deadline = apr_time_now() + apr_time_from_sec(seconds);
+	for (int i = 0; i < threads; i++) {
+		apr_pool_create(&workers[i].pool, pool);
+		workers[i].deadline = deadline;
+		workers[i].seed = (unsigned int)(i + 1) * 2654435761u;
+		apr_thread_create(&handles[i], NULL, stressThread, &workers[i], pool);
+	}
+
+	long requests = 0, served = 0, not_found = 0, failed = 0;
+	for (int i = 0; i < threads; i++) {
+		apr_status_t rv;
+		apr_thread_join(&rv, handles[i]);
+		requests += workers[i].requests;
+		served += workers[i].served;
+		not_found += workers[i].not_found;
+		failed += workers[i].failed;
+	}
+
+	double rate = (double)requests / seconds;
+	printf("%d\t%.0f\t%.2f\t%ld\t%ld\t%ld\n", threads, rate, base > 0 ? rate / base : 1.0, served, not_found, failed);
+	fflush(stdout);
+	return rate;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s /path/to/a.mbtiles [max threads] [seconds per run] [tile cache size]\n", argv[0]);
+		return 1;
+	}
+	const char* path = argv[1];
+	testmod_threads = argc > 2 ? atoi(argv[2]) : 8;
+	int seconds = argc > 3 ? atoi(argv[3]) : 5;
+	if (testmod_threads < 1 || seconds < 1) {
+		fprintf(stderr, "threads and seconds must be at least 1\n");
+		return 1;
+	}
+
+	apr_initialize();
+	atexit(apr_terminate);
+	if (!sampleTiles(path)) {
+		fprintf(stderr, "%s: couldn't read any tile\n", path);
+		return 1;
+	}
+
+	apr_pool_t* pconf;
+	apr_pool_t* ptemp;
+	apr_pool_create(&pconf, NULL);
+	apr_pool_create(&ptemp, pconf);
+	testmod_server.log.level = APLOG_WARNING;
+	testmod_server.server_hostname = "localhost";
+	stress_connection.base_server = &testmod_server;
+	stress_connection.log = &testmod_server.log;
+
+	// as the config would, then as a starting child
+	cmd_parms cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.pool = pconf;
+	cmd.temp_pool = ptemp;
+	cmd.server = &testmod_server;
+	mbtiles_add_path(&cmd, NULL, "stress_a", path);
+	mbtiles_add_path(&cmd, NULL, "stress_b", path);
+	mbtiles_add_path_ext(&cmd, NULL, "v2", "stress_a", path);
+	if (argc > 4) {
+		const char* error = mbtiles_set_tile_cache(&cmd, NULL, argv[4]);
+		if (error) {
+			fprintf(stderr, "%s\n", error);
+			return 1;
+		}
+	}
+	mbtiles_post_config(pconf, pconf, ptemp, &testmod_server);
+	processStarting(pconf, &testmod_server);
+	for (int i = 0; i < numLoaded; i++) {
+		if (!tilesets[i].opened) {
+			fprintf(stderr, "%s: couldn't open it\n", path);
+			return 1;
+		}
+	}
+
+	// the requests that fail are expected, their errors aren't worth a line each
+	testmod_server.log.level = APLOG_CRIT;
+	printf("threads\trequests/s\tspeedup\tserved\tnot_found\tfailed\n");
+	double base = 0;
+	// doubling, and always ending with the maximum
+	for (int threads = 1; ; threads = threads * 2 < testmod_threads ? threads * 2 : testmod_threads) {
+		apr_pool_t* run_pool;
+		apr_pool_create(&run_pool, pconf);
+		double rate = stressRun(threads, seconds, base, run_pool);
+		if (threads == 1)
+			base = rate;
+		apr_pool_destroy(run_pool);
+		if (threads == testmod_threads)
+			break;
+	}
+
+	apr_pool_destroy(pconf);
+	return 0;
+}
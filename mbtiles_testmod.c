@@ -0,0 +1,156 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "apr_pools.h"
+#include "apr_strings.h"
+
+#include "httpd.h"
+#include "http_config.h"
+#include "http_log.h"
+#include "http_protocol.h"
+#include "ap_mpm.h"
+
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+
+#include "mbtiles_testmod.h"
+
+server_rec testmod_server;
+int testmod_threads = 1;
+
+AP_DECLARE(void) ap_log_error_(const char* file, int line, int module_index, int level, apr_status_t status, const server_rec* s, const char* fmt, ...) {
+	if ((level & APLOG_LEVELMASK) > testmod_server.log.level)
+		return;
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	fputc('\n', stderr);
+	va_end(args);
+}
+
+AP_DECLARE(void) ap_log_rerror_(const char* file, int line, int module_index, int level, apr_status_t status, const request_rec* r, const char* fmt, ...) {
+	if ((level & APLOG_LEVELMASK) > testmod_server.log.level)
+		return;
+	va_list args;
+	va_start(args, fmt);
+	fprintf(stderr, "%s: ", r->uri);
+	vfprintf(stderr, fmt, args);
+	fputc('\n', stderr);
+	va_end(args);
+}
+
+AP_DECLARE(void) ap_log_assert(const char* szExp, const char* szFile, int nLine) {
+	fprintf(stderr, "assertion \"%s\" failed at %s:%d\n", szExp, szFile, nLine);
+	abort();
+}
+
+AP_DECLARE(void) ap_allow_methods(request_rec* r, int reset, ...) {
+}
+
+AP_DECLARE(int) ap_send_http_options(request_rec* r) {
+	return OK;
+}
+
+AP_DECLARE(void) ap_set_content_type(request_rec* r, const char* ct) {
+	r->content_type = ct;
+}
+
+AP_DECLARE(void) ap_set_content_length(request_rec* r, apr_off_t length) {
+	r->clength = length;
+}
+
+AP_DECLARE(int) ap_rwrite(const void* buf, int nbyte, request_rec* r) {
+	r->bytes_sent += nbyte;
+	return nbyte;
+}
+
+AP_DECLARE_NONSTD(int) ap_rprintf(request_rec* r, const char* fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	int written = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+	r->bytes_sent += written;
+	return written;
+}
+
+AP_DECLARE(apr_status_t) ap_send_fd(apr_file_t* fd, request_rec* r, apr_off_t offset, apr_size_t length, apr_size_t* nbytes) {
+	*nbytes = 0;
+	return APR_ENOTIMPL;	// only the extract handler sends files
+}
+
+AP_DECLARE(int) ap_cstr_casecmp(const char* s1, const char* s2) {
+	return strcasecmp(s1, s2);
+}
+
+AP_DECLARE(char*) ap_strcasestr(const char* s1, const char* s2) {
+	size_t len = strlen(s2);
+	for (; *s1; s1++)
+		if (strncasecmp(s1, s2, len) == 0)
+			return (char*)s1;
+	return len ? NULL : (char*)s1;
+}
+
+AP_DECLARE(int) ap_unescape_url(char* url) {
+	return OK;	// nothing is escaped in the URLs of these programs
+}
+
+AP_DECLARE(char*) ap_server_root_relative(apr_pool_t* p, const char* fname) {
+	return apr_pstrdup(p, fname);
+}
+
+AP_DECLARE(apr_status_t) ap_mpm_query(int query_code, int* result) {
+	if (query_code == AP_MPMQ_MAX_THREADS)
+		*result = testmod_threads;
+	else if (query_code == AP_MPMQ_IS_THREADED)
+		*result = testmod_threads > 1 ? AP_MPMQ_STATIC : AP_MPMQ_NOT_SUPPORTED;
+	else
+		*result = 0;
+	return APR_SUCCESS;
+}
+
+AP_DECLARE(ap_regex_t*) ap_pregcomp(apr_pool_t* p, const char* pattern, int cflags) {
+	int error;
+	PCRE2_SIZE offset;
+	pcre2_code* code = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED, (cflags & AP_REG_ICASE) ? PCRE2_CASELESS : 0, &error, &offset, NULL);
+	if (!code)
+		return NULL;
+	ap_regex_t* preg = apr_pcalloc(p, sizeof(ap_regex_t));
+	preg->re_pcre = code;
+	return preg;
+}
+
+AP_DECLARE(void) ap_regfree(ap_regex_t* preg) {
+	pcre2_code_free(preg->re_pcre);
+}
+
+AP_DECLARE(int) ap_regexec(const ap_regex_t* preg, const char* string, apr_size_t nmatch, ap_regmatch_t* pmatch, int eflags) {
+	pcre2_match_data* match = pcre2_match_data_create_from_pattern(preg->re_pcre, NULL);
+	int rc = pcre2_match(preg->re_pcre, (PCRE2_SPTR)string, PCRE2_ZERO_TERMINATED, 0, 0, match, NULL);
+	if (rc >= 0) {
+		PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(match);
+		for (apr_size_t i = 0; i < nmatch; i++) {
+			bool set = (int)i < rc && ovector[2 * i] != PCRE2_UNSET;
+			pmatch[i].rm_so = set ? (int)ovector[2 * i] : -1;
+			pmatch[i].rm_eo = set ? (int)ovector[2 * i + 1] : -1;
+		}
+	}
+	pcre2_match_data_free(match);
+	return rc >= 0 ? 0 : AP_REG_NOMATCH;
+}
+
+AP_DECLARE(void) ap_hook_handler(ap_HOOK_handler_t* pf, const char* const* aszPre, const char* const* aszSucc, int nOrder) {
+}
+
+AP_DECLARE(void) ap_hook_child_init(ap_HOOK_child_init_t* pf, const char* const* aszPre, const char* const* aszSucc, int nOrder) {
+}
+
+AP_DECLARE(void) ap_hook_post_config(ap_HOOK_post_config_t* pf, const char* const* aszPre, const char* const* aszSucc, int nOrder) {
+}
+
+AP_DECLARE(void) ap_hook_pre_config(ap_HOOK_pre_config_t* pf, const char* const* aszPre, const char* const* aszSucc, int nOrder) {
+}
@@ -0,0 +1,16 @@
+#pragma once
+#ifndef MBTILES_TESTMOD_H
+#define MBTILES_TESTMOD_H
+
+#include "httpd.h"
+
+/*
+	httpd's side of the programs that run mod_mbtiles.c outside Apache with TEST_MOD (mbtiles_stress.c,
+	mbtiles_bench.c): mbtiles_testmod.c stands in for the few server functions the module calls. Output is
+	only counted in the request, and messages up to the level of testmod_server go to stderr.
+*/
+
+extern server_rec testmod_server;
+extern int testmod_threads;	// what ap_mpm_query answers for AP_MPMQ_MAX_THREADS; above 1 the MPM is threaded
+
+#endif	// MBTILES_TESTMOD_H
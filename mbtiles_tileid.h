@@ -0,0 +1,68 @@
+#pragma once
+#ifndef MBTILES_TILEID_H
+#define MBTILES_TILEID_H
+
+#include <stdint.h>
+
+/*
+	64-bit tile ID: tiles of all lower zooms first, then the Hilbert curve index inside the zoom.
+	Same numbering as PMTiles v3, so neighbouring tiles get neighbouring IDs.
+	x/y are XYZ (not TMS) coordinates.
+*/
+
+static inline void mbtiles_tileid_rotate(uint64_t n, uint64_t* x, uint64_t* y, uint64_t rx, uint64_t ry) {
+	if (ry == 0) {
+		if (rx != 0) {
+			*x = n - 1 - *x;
+			*y = n - 1 - *y;
+		}
+		uint64_t t = *x;
+		*x = *y;
+		*y = t;
+	}
+}
+
+static inline uint64_t mbtiles_zxy_to_tileid(int z, uint32_t tx, uint32_t ty) {
+	uint64_t acc = (((uint64_t)1 << (z * 2)) - 1) / 3;
+	uint64_t x = tx;
+	uint64_t y = ty;
+	for (int a = z - 1; a >= 0; a--) {
+		uint64_t s = (uint64_t)1 << a;
+		uint64_t rx = s & x;
+		uint64_t ry = s & y;
+		acc += ((3 * rx) ^ ry) << a;
+		mbtiles_tileid_rotate(s, &x, &y, rx, ry);
+	}
+	return acc;
+}
+
+// first tile ID of the zoom level
+static inline uint64_t mbtiles_tileid_zoom_base(int z) {
+	return (((uint64_t)1 << (z * 2)) - 1) / 3;
+}
+
+// inverse of mbtiles_zxy_to_tileid
+static inline void mbtiles_tileid_to_zxy(uint64_t tile_id, int* z, uint32_t* tx, uint32_t* ty) {
+	int zoom = 0;
+	while (zoom < 31 && mbtiles_tileid_zoom_base(zoom + 1) <= tile_id)
+		zoom++;
+	uint64_t t = tile_id - mbtiles_tileid_zoom_base(zoom);
+	uint64_t x = 0;
+	uint64_t y = 0;
+	for (uint64_t s = 1; s < ((uint64_t)1 << zoom); s *= 2) {
+		uint64_t rx = 1 & (t / 2);
+		uint64_t ry = 1 & (t ^ rx);
+		mbtiles_tileid_rotate(s, &x, &y, rx, ry);
+		x += s * rx;
+		y += s * ry;
+		t /= 4;
+	}
+	*z = zoom;
+	*tx = (uint32_t)x;
+	*ty = (uint32_t)y;
+}
+
+// TMS row as stored in .mbtiles <-> XYZ row as used in tile IDs
+#define mbtiles_flip_y(z, y) ((1 << (z)) - (y) - 1)
+
+#endif	// MBTILES_TILEID_H
@@ -0,0 +1,135 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "apr_pools.h"
+
+#include "mbtiles_webp.h"
+
+bool mbtiles_is_webp(const unsigned char* data, apr_size_t size) {
+	return size >= 12 && memcmp(data, "RIFF", 4) == 0 && memcmp(data + 8, "WEBP", 4) == 0;
+}
+
+#ifdef MBTILES_WITH_WEBP
+
+#include <setjmp.h>
+
+#include <png.h>
+#include <jpeglib.h>
+#include <webp/encode.h>
+
+typedef struct JpegError {
+	struct jpeg_error_mgr manager;
+	jmp_buf escape;
+} JpegError;
+
+static void jpeg_error_exit(j_common_ptr info) {
+	longjmp(((JpegError*)info->err)->escape, 1);
+}
+
+// RGBA pixels, malloc'd
+static unsigned char* decode_png(const unsigned char* data, apr_size_t size, int* width, int* height) {
+	png_image image;
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+	if (!png_image_begin_read_from_memory(&image, data, size))
+		return NULL;
+
+	image.format = PNG_FORMAT_RGBA;
+	unsigned char* pixels = malloc(PNG_IMAGE_SIZE(image));
+	if (!pixels) {
+		png_image_free(&image);
+		return NULL;
+	}
+	if (!png_image_finish_read(&image, NULL, pixels, 0, NULL)) {
+		free(pixels);
+		return NULL;
+	}
+	*width = image.width;
+	*height = image.height;
+	return pixels;
+}
+
+// RGB pixels, malloc'd
+static unsigned char* decode_jpeg(const unsigned char* data, apr_size_t size, int* width, int* height) {
+	struct jpeg_decompress_struct info;
+	JpegError error;
+	unsigned char* volatile pixels = NULL;
+
+	info.err = jpeg_std_error(&error.manager);
+	error.manager.error_exit = jpeg_error_exit;
+	if (setjmp(error.escape)) {
+		jpeg_destroy_decompress(&info);
+		free(pixels);
+		return NULL;
+	}
+
+	jpeg_create_decompress(&info);
+	jpeg_mem_src(&info, (unsigned char*)data, (unsigned long)size);
+	jpeg_read_header(&info, TRUE);
+	info.out_color_space = JCS_RGB;
+	jpeg_start_decompress(&info);
+
+	apr_size_t stride = (apr_size_t)info.output_width * 3;
+	pixels = malloc(stride * info.output_height);
+	if (pixels) {
+		while (info.output_scanline < info.output_height) {
+			JSAMPROW row = pixels + info.output_scanline * stride;
+			jpeg_read_scanlines(&info, &row, 1);
+		}
+		jpeg_finish_decompress(&info);
+		*width = info.output_width;
+		*height = info.output_height;
+	}
+	jpeg_destroy_decompress(&info);
+	return pixels;
+}
+
+bool mbtiles_webp_supported(void) {
+	return true;
+}
+
+bool mbtiles_webp_encode(const unsigned char* data, apr_size_t size, int quality, apr_pool_t* pool, unsigned char** webp, apr_size_t* webp_size) {
+	int width, height;
+	uint8_t* encoded = NULL;
+	size_t encoded_size = 0;
+
+	if (size >= 8 && memcmp(data, "\x89PNG\r\n\x1A\n", 8) == 0) {
+		unsigned char* pixels = decode_png(data, size, &width, &height);
+		if (!pixels)
+			return false;
+		encoded_size = quality == WEBP_LOSSLESS ? WebPEncodeLosslessRGBA(pixels, width, height, width * 4, &encoded)
+			: WebPEncodeRGBA(pixels, width, height, width * 4, (float)quality, &encoded);
+		free(pixels);
+	}
+	else if (size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF) {
+		unsigned char* pixels = decode_jpeg(data, size, &width, &height);
+		if (!pixels)
+			return false;
+		encoded_size = quality == WEBP_LOSSLESS ? WebPEncodeLosslessRGB(pixels, width, height, width * 3, &encoded)
+			: WebPEncodeRGB(pixels, width, height, width * 3, (float)quality, &encoded);
+		free(pixels);
+	}
+
+	if (!encoded_size)
+		return false;
+	*webp = apr_palloc(pool, encoded_size);
+	memcpy(*webp, encoded, encoded_size);
+	*webp_size = encoded_size;
+	WebPFree(encoded);
+	return true;
+}
+
+#else
+
+bool mbtiles_webp_supported(void) {
+	return false;
+}
+
+bool mbtiles_webp_encode(const unsigned char* data, apr_size_t size, int quality, apr_pool_t* pool, unsigned char** webp, apr_size_t* webp_size) {
+	return false;
+}
+
+#endif
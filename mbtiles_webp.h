@@ -0,0 +1,21 @@
+#pragma once
+#ifndef MBTILES_WEBP_H
+#define MBTILES_WEBP_H
+
+#include <stdbool.h>
+
+#include "apr_pools.h"
+
+/*
+	Re-encodes PNG and JPEG raster tiles as WebP. Only built in with -DMBTILES_WITH_WEBP, which needs
+	libwebp, libpng and libjpeg; without it mbtiles_webp_supported() is false and nothing is encoded.
+*/
+
+#define WEBP_LOSSLESS -1	// quality for tiles whose pixel values matter (DEM, masks)
+
+bool mbtiles_webp_supported(void);
+// false if the tile isn't a PNG or JPEG or couldn't be encoded; the WebP is allocated in pool
+bool mbtiles_webp_encode(const unsigned char* data, apr_size_t size, int quality, apr_pool_t* pool, unsigned char** webp, apr_size_t* webp_size);
+bool mbtiles_is_webp(const unsigned char* data, apr_size_t size);
+
+#endif	// MBTILES_WEBP_H
@@ -4,16 +4,106 @@
 	see also https://github.com/kd2org/apache-sqliteblob
 
 	To install:
-		sudo apxs -lsqlite3 -lzlib -i -a -c mod_mbtiles.c mbtiles_metadata.c && sudo service apache2 restart
+		sudo apxs -lsqlite3 -lzlib -i -a -c mod_mbtiles.c mbtiles_metadata.c mbtiles_pack.c mbtiles_pmtiles.c mbtiles_flight.c mbtiles_memtable.c mbtiles_cache.c mbtiles_hot.c mbtiles_readahead.c mbtiles_admission.c mbtiles_extract.c mbtiles_webp.c mbtiles_overzoom.c mbtiles_deflate.c && sudo service apache2 restart
 
 	To configure Apache:
 		MbtilesEnabled true
 		MbtilesAdd vt "/path/to/my/vector_tiles.mbtiles"
 		MbtilesAdd dem "/path/to/my/dem.mbtiles"
 		MbtilesAddEx v2 vt "/path/to/my/vector_tiles_v2.mbtiles"
+		MbtilesAdd contours "/path/to/my/contours.pmtiles"
 		MbtilesReturnEmptyTile Off
+		MbtilesCacheMaxAge * 0-8 86400
+		MbtilesCacheMaxAge vt 9-14 3600
+		MbtilesImmutableMaxAge 31536000
+		MbtilesPreload vt 0-8
+		MbtilesInMemory boundaries
+		MbtilesSqlite vt immutable mmap=1073741824 cache=-16384 threading=serialized
+		MbtilesTileCache 64M
+		MbtilesHotTiles "/var/cache/apache2/mbtiles_hot.txt" 300
+		MbtilesReadAhead vt 2
+		MbtilesShard planet 0-10 "/path/to/planet_0-10.mbtiles"
+		MbtilesShard planet 11-14 -11,35,30,72 "/path/to/europe_11-14.mbtiles"
+		MbtilesSharedPages On
+		MbtilesTileBudget 200 empty
+		MbtilesConcurrency dem 4 8 100
+		MbtilesExtractLimit 1000000
+		MbtilesWebP dem lossless
+		MbtilesPatch vt "/path/to/vt.patch.mbtiles"
+		MbtilesOverzoom vt 18
+		MbtilesComposite osm vt,contours
+		MbtilesCompositeCompression 1 6 9
+
+	and for the counters:
+		<Location "/mbtiles-status">
+			SetHandler mbtiles-status
+		</Location>
+
+	and for offline extracts (/mbtiles-extract?tileset=vt&bbox=-1.5,50.5,1.5,52&zoom=0-14&format=mbtiles):
+		<Location "/mbtiles-extract">
+			SetHandler mbtiles-extract
+		</Location>
 
 	Note that MbtilesEnabled applies per-directory, while MbtilesAdd is global (across all virtual hosts)
+
+	If a packed sidecar (.mbtiles.zxy + .mbtiles.blob, see mbtiles_pack_build.c) sits next to the .mbtiles,
+	tiles are served from it and SQLite is only used for metadata.
+
+	Tiles of a tileset added under a version (MbtilesAddEx, /v2/vt/z/x/y.pbf) never change, so they are sent as
+	immutable; other tiles, an unknown version's included, get the max-age of the first MbtilesCacheMaxAge rule
+	matching the tileset (or *) and zoom.
+	The directives naming a tileset (MbtilesPreload, MbtilesSqlite, MbtilesShard and the others) take version/name,
+	e.g. v2/vt, for one added with MbtilesAddEx.
+
+	MbtilesPreload loads a zoom range of a tileset into memory when the configuration is loaded, before the
+	children are forked, so they share it; those zooms are then never read from SQLite.
+
+	MbtilesSqlite tunes how a tileset's SQLite handle is opened:
+		immutable			open read-only with immutable=1: no locking, no change checks (the file must never change)
+		mmap=<bytes>		PRAGMA mmap_size
+		cache=<n>			PRAGMA cache_size (pages, or KiB if negative)
+		threading=<mode>	serialized (safe with threaded MPMs) or multi (prefork only, serialized otherwise)
+
+	Files ending in .pmtiles are served as PMTiles v3 archives, with the same URLs (composites and metadata.json included).
+
+	MbtilesTileCache keeps recently read SQLite tiles (found or not) in each child, up to the given size.
+	MbtilesHotTiles counts requested tiles in a small sketch and saves the hottest ones to a file every few
+	minutes (300 seconds by default); a starting child reads them back so its caches are warm before traffic arrives.
+
+	MbtilesReadAhead makes a tile cache miss fetch the tiles within the given radius around it, in the background
+	and with one range query, into the tile cache (which gets a default size if MbtilesTileCache isn't set).
+
+	Vector tiles stored uncompressed or zlib compressed are gzipped when first served and kept in the tile cache
+	(which then also gets a default size), so they are always sent with a correct Content-Encoding: gzip.
+
+	MbtilesShard splits one tileset over several files by zoom range and optionally bounds (west,south,east,north).
+	Each tile goes to the first shard covering it; tiles no shard covers come from the MbtilesAdd file of the
+	same name, if there is one. metadata.json is merged from all of them.
+
+	Each tileset's metadata is read once when it is opened. Tiles outside its minzoom/maxzoom or bounds are
+	answered as missing without touching the file, which saves most lookups of overlays in composites.
+
+	The mbtiles-extract handler sends the tiles of a tileset (or a composite) within a bbox and zoom range as a tar,
+	or as an .mbtiles with format=mbtiles, read by range scans in index order. Extracts covering more than
+	MbtilesExtractLimit tiles (1000000 by default) are refused.
+
+	MbtilesWebP sends the PNG or JPEG tiles of a tileset as WebP (lossless, or lossy at a quality of 1-100) to clients
+	whose Accept has image/webp, when that is smaller. Encoded tiles are kept in the tile cache. It needs the module
+	built with -DMBTILES_WITH_WEBP -lwebp -lpng -ljpeg.
+
+	MbtilesPatch serves the tiles of a small .mbtiles over those of the tileset's file; a tile with empty data there
+	is deleted. Each child checks the file every few seconds and reads it again when it was replaced (renamed over)
+	or removed. mbtiles_patch.c folds a patch into its base.
+
+	MbtilesOverzoom serves a vector tileset past its maxzoom: a deeper tile is cut out of its ancestor at maxzoom,
+	its geometry clipped and scaled to the child (mbtiles_overzoom.c), then gzipped and kept in the tile cache.
+
+	MbtilesComposite names a composite, served at /osm/z/x/y.pbf like /vt,contours/z/x/y.pbf; its tilesets,
+	zooms, max-ages and merged metadata are worked out once in post_config instead of from the URL each time.
+
+	MbtilesCompositeCompression sets the deflate levels of merged composite tiles: the more of a child's threads
+	are busy, the closer to the first level (mbtiles_deflate.c). The tiles of named composites are kept in the
+	tile cache, and those sent below the third level are compressed again at it when the child is idle.
 */
 
 #include "httpd.h"
@@ -25,15 +115,19 @@
 #include "http_request.h"
 #include "util_script.h"
 #include "http_connection.h"
+#include "ap_mpm.h"
 
 #include "mod_core.h"
 
 #include "apr_strings.h"
+#include "apr_time.h"
+#include "apr_atomic.h"
 
 #include <sqlite3.h>
 //#define SQLITE_API __declspec(dllimport)
 
 #include <zlib.h>
+#include <math.h>
 
 #include <synchapi.h>
 
@@ -42,6 +136,18 @@
 #define MOD_GZIP_ZLIB_BSIZE 8096
 
 #include "mbtiles_metadata.h"
+#include "mbtiles_pack.h"
+#include "mbtiles_pmtiles.h"
+#include "mbtiles_flight.h"
+#include "mbtiles_memtable.h"
+#include "mbtiles_cache.h"
+#include "mbtiles_hot.h"
+#include "mbtiles_readahead.h"
+#include "mbtiles_admission.h"
+#include "mbtiles_extract.h"
+#include "mbtiles_webp.h"
+#include "mbtiles_overzoom.h"
+#include "mbtiles_deflate.h"
 
 #define ON 1
 #define OFF 0
@@ -52,10 +158,72 @@
 #define MATCH_LONG_NAME 3
 
 #define MAX_TILESETS 20
+#define MAX_COMPOSITES 20
+#define MAX_SHARDS 16	// per tileset, each one also takes a tileset slot
+#define MAX_ZOOM 30
+#define SHARED_PAGES_CACHE_SIZE -256	// KiB of page cache per handle with MbtilesSharedPages
+#define BUDGET_CHECK_OPS 1000	// SQLite VM steps between deadline checks
+#define MAX_REOPEN_BACKOFF 60	// seconds
+#define DEFAULT_ADMISSION_WAIT 100	// ms
+#define DEFAULT_EXTRACT_MAX_TILES 1000000
+#define MAX_CACHE_RULES 32
 #define MAX_TILESET_NAME 40
 #define MAX_FORMAT_NAME 8
 #define MERGE_TILES_BUFFER_SIZE (4096 * 256)	// 1MB
 #define METADATE_JSON_BUFFER_SIZE (4096 * 1)	// 1 page
+#define HOT_TILES_SAVE_INTERVAL 300	// seconds
+#define MAX_RAW_TILE_SIZE (64 * 1024 * 1024)
+#define DEFAULT_TILE_CACHE_SIZE (32 * 1024 * 1024)
+#define PATCH_CHECK_INTERVAL 10	// seconds between looks at a patch file
+#define COMPOSITE_FAST_LEVEL 1	// deflate levels of merged composite tiles: with every thread of the child busy,
+#define COMPOSITE_LEVEL 6		// with none but the tile's own,
+#define COMPOSITE_BEST_LEVEL 9	// and when compressed again while the child is idle
+
+#define TILE_PREFETCHED 1	// tile cache flag
+#define TILE_REJECTED -1	// getTile: turned away by MbtilesConcurrency, not an SQLite code
+
+#define TILE_ENCODING_RAW	0
+#define TILE_ENCODING_GZIP	1
+#define TILE_ENCODING_ZLIB	2
+
+typedef struct TileRange {
+	int min_x;
+	int max_x;
+	int min_y;	// TMS rows
+	int max_y;
+} TileRange;
+
+typedef struct Shard {
+	int tileset;	// index of the shard's own Tileset
+	int min_zoom;
+	int max_zoom;
+	TileRange ranges[MAX_ZOOM + 1];	// precomputed from the bounds
+} Shard;
+
+// which shards cover each zoom, in the order they were added
+typedef struct ShardRouting {
+	int count;
+	Shard shards[MAX_SHARDS];
+	int zoom_count[MAX_ZOOM + 1];
+	int by_zoom[MAX_ZOOM + 1][MAX_SHARDS];
+} ShardRouting;
+
+// the tiles of an MbtilesPatch file, in memory; replaced whole when the file is, and freed once its last reader is done
+typedef struct TilePatch {
+	apr_pool_t* pool;		// of the patch alone
+	TileMemtable tiles;		// a tile of length 0 is deleted
+	apr_time_t mtime;		// of the file it was read from
+	apr_off_t size;
+	int users;				// under open_mutex
+	int replaced;			// no longer the tileset's, freed by its last user
+} TilePatch;
+
+// a child's SQLite handle of a tileset; replaced after an error, and closed once its last user is done
+typedef struct TilesetHandle {
+	sqlite3* db;
+	int users;				// under open_mutex
+	apr_time_t deadline;	// of the read running on it, 0 for none
+} TilesetHandle;
 
 typedef struct Tileset {
 	int opened;
@@ -64,16 +232,76 @@ typedef struct Tileset {
 	char name[MAX_TILESET_NAME];
 	char format[MAX_FORMAT_NAME];
 	int isPBF;
-	sqlite3 *db;
+	sqlite3 *db;			// parent only
+	TilesetHandle* handle;	// child only, NULL until first use or after an error
+	int failures;			// in a row, for the reopen backoff
+	apr_time_t reopen_at;
+	int hasPack;
+	MbtilesPack pack;
+	int isPmtiles;
+	PmtilesArchive* pmtiles;
+	int sqlite_immutable;
+	apr_int64_t sqlite_mmap_size;	// -1 for SQLite's default
+	int sqlite_cache_size;
+	int sqlite_cache_size_set;
+	int sqlite_open_flags;	// SQLITE_OPEN_FULLMUTEX, SQLITE_OPEN_NOMUTEX or 0 for SQLite's default
+	int preload_min_zoom;	// NOT_SET_ZOOM if no MbtilesPreload
+	int preload_max_zoom;
+	TileMemtable preload;
+	int inMemory;			// MbtilesInMemory: every tile is in preload, SQLite is only read at startup
+	int read_ahead;			// window radius, 0 for none
+	sqlite3* read_ahead_db;	// the read-ahead thread's own handle
+	int concurrency;		// MbtilesConcurrency: threads of a child reading the file at once, 0 for no limit
+	int concurrency_queue;
+	int concurrency_wait;	// ms
+	int webp;				// MbtilesWebP: PNG or JPEG tiles are sent as WebP to clients accepting it
+	int webp_quality;		// 1-100 or WEBP_LOSSLESS
+	char* webp_source;		// tile cache source of the WebP tiles
+	int overzoom;			// MbtilesOverzoom: deepest zoom cut from the tiles at max_zoom, 0 for none
+	char* overzoom_source;	// tile cache source of the cut tiles
+	Admission* admission;	// child only
+	const char* patch_path;	// MbtilesPatch: tiles read over the file's, NULL for none
+	TilePatch* patch;		// NULL while there's no patch file; swapped under open_mutex
+	apr_time_t patch_checked;
+	int patch_loads;		// by this child
+	int encoding;			// TILE_ENCODING_* of the vector tiles, from a sample tile
+	ShardRouting* shards;	// NULL unless MbtilesShard; path is empty if there's no file besides the shards
+	int isShard;			// served only through the tileset it belongs to
+	TilesetMetadata* metadata;	// read once at open, NULL if it couldn't be
+	int min_zoom;			// from the metadata, NOT_SET_ZOOM if not given
+	int max_zoom;
+	TileRange* coverage;	// per zoom up to MAX_ZOOM, from the metadata bounds; NULL if not given
 } Tileset;
 
+// a named composite (MbtilesComposite): which tilesets to read, and what to answer, worked out once in post_config
+typedef struct Composite {
+	char name[MAX_TILESET_NAME];
+	const char* names;		// as configured, for the status page
+	int sources[MAX_TILESETS];	// in layer order; only the open ones after post_config
+	int count;
+	int isPBF;				// layers are merged; raster composites send the first source having the tile
+	int min_zoom;			// outside of these no source has tiles, and none is read
+	int max_zoom;
+	int max_age[MAX_ZOOM + 1];	// shortest of the sources' MbtilesCacheMaxAge, -1 if none
+	TilesetMetadata* metadata;	// merged, NULL if no source had any
+	char* cache_source;		// tile cache source of its merged tiles, NULL if they aren't kept
+} Composite;
+
 typedef struct DirectoryConfig {
 	char context[256];
 	int enabled;
 	int return_empty_tile;
 } DirectoryConfig;
 
+typedef struct CacheRule {
+	char name[MAX_TILESET_NAME];	// "*" for any tileset
+	int min_zoom;
+	int max_zoom;
+	int max_age;
+} CacheRule;
+
 typedef struct TileRequest {
+	ap_regmatch_t version_position;	// rm_so == -1 if not versioned
 	ap_regmatch_t name_position;
 	int zoom;
 	int x;
@@ -102,14 +330,68 @@ const char *mbtiles_add_path(cmd_parms *cmd, void *cfg, const char *name, const
 const char *mbtiles_add_path_ext(cmd_parms *cmd, void *cfg, const char* version, const char *name, const char *path);
 const char *mbtiles_set_enabled(cmd_parms *cmd, void *cfg, const char *arg);
 const char* mbtiles_set_empty_tile(cmd_parms* cmd, void* cfg, const char* arg);
+const char* mbtiles_add_cache_rule(cmd_parms* cmd, void* cfg, const char* name, const char* zooms, const char* max_age);
+const char* mbtiles_set_immutable_max_age(cmd_parms* cmd, void* cfg, const char* arg);
+const char* mbtiles_set_preload(cmd_parms* cmd, void* cfg, const char* name, const char* zooms);
+const char* mbtiles_set_in_memory(cmd_parms* cmd, void* cfg, const char* name);
+const char* mbtiles_set_tile_budget(cmd_parms* cmd, void* cfg, const char* ms, const char* action);
+const char* mbtiles_set_concurrency(cmd_parms* cmd, void* cfg, int argc, char* const argv[]);
+const char* mbtiles_set_sqlite_option(cmd_parms* cmd, void* cfg, const char* name, const char* option);
+const char* mbtiles_set_tile_cache(cmd_parms* cmd, void* cfg, const char* arg);
+const char* mbtiles_set_hot_tiles(cmd_parms* cmd, void* cfg, const char* path, const char* interval);
+const char* mbtiles_set_read_ahead(cmd_parms* cmd, void* cfg, const char* name, const char* radius);
+const char* mbtiles_add_shard(cmd_parms* cmd, void* cfg, int argc, char* const argv[]);
+const char* mbtiles_set_shared_pages(cmd_parms* cmd, void* cfg, const char* arg);
+const char* mbtiles_set_extract_limit(cmd_parms* cmd, void* cfg, const char* arg);
+const char* mbtiles_set_webp(cmd_parms* cmd, void* cfg, const char* name, const char* quality);
+const char* mbtiles_set_patch(cmd_parms* cmd, void* cfg, const char* name, const char* path);
+const char* mbtiles_set_overzoom(cmd_parms* cmd, void* cfg, const char* name, const char* zoom);
+const char* mbtiles_add_composite(cmd_parms* cmd, void* cfg, const char* name, const char* sources);
+const char* mbtiles_set_composite_compression(cmd_parms* cmd, void* cfg, const char* fast, const char* normal, const char* best);
+int mbtiles_status_handler(request_rec* r);
+int mbtiles_extract_handler(request_rec* r);
 static int extractTileRequest(char* uri, TileRequest* tileRequest);
+static int getTile(Tileset* tileset, const int z, const int x, const int y, apr_pool_t* pool, unsigned char** pTile, int* psTile);
+static int serveTile(const request_rec* r, const DirectoryConfig* config, TileRequest tileRequest, const Composite* composite, TileFlight* flight);
 static apr_size_t decompressGzip(unsigned char* dest, apr_size_t buffer_size, unsigned char* source, apr_size_t size);
 static apr_size_t compressGzip(unsigned char* dest, apr_size_t dsize, unsigned char* source, apr_size_t ssize, int compressionlevel);
+static int cacheMaxAge(const char* name, int zoom);
 bool mbtile_read_metadata(sqlite3* db, TilesetMetadata* metadata, apr_pool_t* pool);
 
 static Tileset tilesets[MAX_TILESETS];
 static int numLoaded = 0;
-static apr_size_t dynamic_tiles_size = MERGE_TILES_BUFFER_SIZE;
+static Composite composites[MAX_COMPOSITES];
+static int numComposites = 0;
+static volatile apr_uint32_t dynamic_tiles_size = MERGE_TILES_BUFFER_SIZE;	// grows to the largest merge seen, shared by threads
+static CacheRule cache_rules[MAX_CACHE_RULES];
+static int numCacheRules = 0;
+static int immutable_max_age = 31536000;	// 1 year
+static FlightTable composite_flights;
+static apr_size_t tile_cache_size = 0;	// per child, 0 = no cache
+static TileCache tile_cache;
+static const char* hot_tiles_path = NULL;
+static int hot_tiles_interval = HOT_TILES_SAVE_INTERVAL;
+static HotSketch hot_tiles;
+static ReadAhead read_ahead;
+static int shared_pages = OFF;
+static apr_interval_time_t tile_budget = 0;	// 0 = no limit
+static int tile_budget_empty = OFF;
+static volatile apr_uint32_t over_budget_count = 0;
+static apr_uint64_t extract_max_tiles = DEFAULT_EXTRACT_MAX_TILES;
+static volatile apr_uint32_t webp_tiles = 0;	// encoded smaller than the original
+static volatile apr_uint64_t webp_bytes_saved = 0;
+static volatile apr_uint32_t overzoom_tiles = 0;	// cut from their ancestor
+static int composite_fast_level = COMPOSITE_FAST_LEVEL;
+static int composite_level = COMPOSITE_LEVEL;
+static int composite_best_level = COMPOSITE_BEST_LEVEL;	// 0: never compressed again
+static DeflateLevel composite_deflate;
+static bool need_tile_cache = false;	// decided in post_config
+static bool use_read_ahead = false;
+static apr_pool_t* open_pool = NULL;	// child: for opening SQLite handles lazily
+static server_rec* main_server = NULL;	// child: for logging outside of requests
+#if APR_HAS_THREADS
+static apr_thread_mutex_t* open_mutex = NULL;
+#endif
 //static DirectoryConfig config;
 
 static ap_regex_t* regexpc_match_uri = NULL;
@@ -123,6 +405,24 @@ static const command_rec mbtiles_directives[] = {
 	AP_INIT_TAKE2("MbtilesAdd", mbtiles_add_path, NULL, OR_ALL, "The tileset name and path to an .mbtiles file."),
 	AP_INIT_TAKE3("MbtilesAddEx", mbtiles_add_path_ext, NULL, OR_ALL, "The tileset name and path to an .mbtiles file."),
 	AP_INIT_TAKE1("MbtilesReturnEmptyTile", mbtiles_set_empty_tile, NULL, OR_ALL, "Return empty tile if tile not found."),
+	AP_INIT_TAKE3("MbtilesCacheMaxAge", mbtiles_add_cache_rule, NULL, OR_ALL, "Tileset name (or *), zoom range (8 or 0-8) and Cache-Control max-age in seconds."),
+	AP_INIT_TAKE1("MbtilesImmutableMaxAge", mbtiles_set_immutable_max_age, NULL, OR_ALL, "Cache-Control max-age in seconds for versioned (immutable) tiles."),
+	AP_INIT_TAKE2("MbtilesPreload", mbtiles_set_preload, NULL, OR_ALL, "Tileset name and zoom range (0-8) to keep in memory."),
+	AP_INIT_TAKE1("MbtilesInMemory", mbtiles_set_in_memory, NULL, OR_ALL, "Tileset name to load whole into memory."),
+	AP_INIT_TAKE_ARGV("MbtilesConcurrency", mbtiles_set_concurrency, NULL, OR_ALL, "Tileset name, threads of a child reading it at once, optional number of requests that may wait and how long in milliseconds."),
+	AP_INIT_TAKE12("MbtilesTileBudget", mbtiles_set_tile_budget, NULL, OR_ALL, "Milliseconds a tile may take to read from SQLite, and whether to answer 503 (default) or empty when it takes longer."),
+	AP_INIT_ITERATE2("MbtilesSqlite", mbtiles_set_sqlite_option, NULL, OR_ALL, "Tileset name followed by immutable, mmap=<bytes>, cache=<n>, threading=serialized|multi."),
+	AP_INIT_TAKE1("MbtilesTileCache", mbtiles_set_tile_cache, NULL, OR_ALL, "Size of the tile cache of each child, in bytes (K, M or G suffix allowed)."),
+	AP_INIT_TAKE12("MbtilesHotTiles", mbtiles_set_hot_tiles, NULL, OR_ALL, "File to keep the hottest tiles in, and how often to save it in seconds."),
+	AP_INIT_TAKE_ARGV("MbtilesShard", mbtiles_add_shard, NULL, OR_ALL, "Tileset name, zoom range, optional bounds (west,south,east,north) and path to an .mbtiles file holding that part."),
+	AP_INIT_TAKE2("MbtilesReadAhead", mbtiles_set_read_ahead, NULL, OR_ALL, "Tileset name and radius of the tile window to read ahead around a cache miss."),
+	AP_INIT_TAKE1("MbtilesSharedPages", mbtiles_set_shared_pages, NULL, OR_ALL, "Read SQLite pages through a memory map shared by all children instead of a page cache in each."),
+	AP_INIT_TAKE1("MbtilesExtractLimit", mbtiles_set_extract_limit, NULL, OR_ALL, "Most tiles an extract may cover, counted over its bounding box and zooms."),
+	AP_INIT_TAKE2("MbtilesWebP", mbtiles_set_webp, NULL, OR_ALL, "Tileset name and lossless or a quality (1-100) to send its PNG or JPEG tiles as WebP to clients accepting it."),
+	AP_INIT_TAKE2("MbtilesOverzoom", mbtiles_set_overzoom, NULL, OR_ALL, "Tileset name and the deepest zoom to serve past its maxzoom, by cutting its vector tiles at maxzoom."),
+	AP_INIT_TAKE2("MbtilesComposite", mbtiles_add_composite, NULL, OR_ALL, "Composite name and the comma separated tilesets it merges, served at /name/z/x/y like a tileset."),
+	AP_INIT_TAKE23("MbtilesCompositeCompression", mbtiles_set_composite_compression, NULL, OR_ALL, "Deflate levels of composite tiles: with the child busy, idle, and optionally for named composites compressed again when it's idle (0 for never)."),
+	AP_INIT_TAKE2("MbtilesPatch", mbtiles_set_patch, NULL, OR_ALL, "Tileset name and path to an .mbtiles of changed tiles to serve over its file, picked up again whenever it's replaced."),
 	{ NULL }
 };
 
@@ -181,7 +481,11 @@ const char *mbtiles_add_path(cmd_parms *cmd, void *cfg, const char *name, const
 		return NULL;
 	}
 	Tileset tileset;
+	memset(&tileset, 0, sizeof(Tileset));
 	tileset.opened = OFF;
+	tileset.preload_min_zoom = tileset.preload_max_zoom = NOT_SET_ZOOM;
+	tileset.min_zoom = tileset.max_zoom = NOT_SET_ZOOM;
+	tileset.sqlite_mmap_size = -1;
 	strcpy(tileset.version, DEFAULT_VERSION);
 	strcpy(tileset.path, path);
 	strcpy(tileset.name, name);
@@ -199,7 +503,11 @@ const char *mbtiles_add_path_ext(cmd_parms *cmd, void *cfg, const char* version,
 		return NULL;
 	}
 	Tileset tileset;
+	memset(&tileset, 0, sizeof(Tileset));
 	tileset.opened = OFF;
+	tileset.preload_min_zoom = tileset.preload_max_zoom = NOT_SET_ZOOM;
+	tileset.min_zoom = tileset.max_zoom = NOT_SET_ZOOM;
+	tileset.sqlite_mmap_size = -1;
 	strcpy(tileset.version, version);
 	strcpy(tileset.path, path);
 	strcpy(tileset.name, name);
@@ -217,43 +525,1151 @@ const char* mbtiles_set_empty_tile(cmd_parms* cmd, void* cfg, const char* arg) {
 	return NULL;
 }
 
+static bool parseZoomRange(const char* arg, int* min_zoom, int* max_zoom) {
+	char* end;
+	*min_zoom = strtol(arg, &end, 10);
+	if (end == arg)
+		return false;
+	*max_zoom = *min_zoom;
+	if (*end == '-') {
+		arg = end + 1;
+		*max_zoom = strtol(arg, &end, 10);
+		if (end == arg)
+			return false;
+	}
+	return *end == 0 && *min_zoom >= 0 && *min_zoom <= *max_zoom;
+}
+
+// a tileset as the per-tileset directives name it: name, or version/name for one added with MbtilesAddEx
+static void splitTilesetName(const char* arg, apr_pool_t* pool, const char** version, const char** name) {
+	const char* slash = strchr(arg, '/');
+	*version = slash ? apr_pstrndup(pool, arg, slash - arg) : DEFAULT_VERSION;
+	*name = slash ? slash + 1 : arg;
+}
+
+static int findConfiguredTileset(const char* arg, apr_pool_t* pool) {
+	const char* version;
+	const char* name;
+	splitTilesetName(arg, pool, &version, &name);
+	return findTileset(version, name);
+}
+
+static const char* missingTileset(cmd_parms* cmd, const char* directive, const char* arg) {
+	// a name only added under a version would otherwise be reported as not added at all
+	for (int i = 0; i < numLoaded && !strchr(arg, '/'); i++) {
+		if (!strcmp(tilesets[i].name, arg))
+			return apr_psprintf(cmd->pool, "%s: %s was added with MbtilesAddEx, name it %s/%s", directive, arg, tilesets[i].version, arg);
+	}
+	return apr_psprintf(cmd->pool, "%s must follow the MbtilesAdd of its tileset", directive);
+}
+
+const char* mbtiles_add_cache_rule(cmd_parms* cmd, void* cfg, const char* name, const char* zooms, const char* max_age) {
+	// global like MbtilesAdd
+	if (numCacheRules == MAX_CACHE_RULES)
+		return "Too many MbtilesCacheMaxAge rules";
+
+	CacheRule* rule = &cache_rules[numCacheRules];
+	if (!parseZoomRange(zooms, &rule->min_zoom, &rule->max_zoom))
+		return "MbtilesCacheMaxAge zoom must be a zoom or a range like 0-8";
+	rule->max_age = atoi(max_age);
+	if (rule->max_age < 0)
+		return "MbtilesCacheMaxAge max-age must be positive";
+	apr_cpystrn(rule->name, name, MAX_TILESET_NAME);
+	numCacheRules++;
+	return NULL;
+}
+
+const char* mbtiles_set_immutable_max_age(cmd_parms* cmd, void* cfg, const char* arg) {
+	immutable_max_age = atoi(arg);
+	if (immutable_max_age <= 0)
+		return "MbtilesImmutableMaxAge must be positive";
+	return NULL;
+}
+
+const char* mbtiles_set_preload(cmd_parms* cmd, void* cfg, const char* name, const char* zooms) {
+	int c = findConfiguredTileset(name, cmd->temp_pool);
+	if (c == -1)
+		return missingTileset(cmd, "MbtilesPreload", name);
+	if (!parseZoomRange(zooms, &tilesets[c].preload_min_zoom, &tilesets[c].preload_max_zoom))
+		return "MbtilesPreload zoom must be a zoom or a range like 0-8";
+	return NULL;
+}
+
+const char* mbtiles_set_in_memory(cmd_parms* cmd, void* cfg, const char* name) {
+	int c = findConfiguredTileset(name, cmd->temp_pool);
+	if (c == -1)
+		return missingTileset(cmd, "MbtilesInMemory", name);
+	tilesets[c].inMemory = ON;
+	tilesets[c].preload_min_zoom = 0;
+	tilesets[c].preload_max_zoom = MAX_ZOOM;
+	return NULL;
+}
+
+const char* mbtiles_set_sqlite_option(cmd_parms* cmd, void* cfg, const char* name, const char* option) {
+	int c = findConfiguredTileset(name, cmd->temp_pool);
+	if (c == -1)
+		return missingTileset(cmd, "MbtilesSqlite", name);
+	Tileset* tileset = &tilesets[c];
+
+	if (!strcasecmp(option, "immutable"))
+		tileset->sqlite_immutable = ON;
+	else if (!strncasecmp(option, "mmap=", 5))
+		tileset->sqlite_mmap_size = apr_atoi64(&option[5]);
+	else if (!strncasecmp(option, "cache=", 6)) {
+		tileset->sqlite_cache_size = atoi(&option[6]);
+		tileset->sqlite_cache_size_set = ON;
+	}
+	else if (!strcasecmp(option, "threading=serialized"))
+		tileset->sqlite_open_flags = SQLITE_OPEN_FULLMUTEX;
+	else if (!strcasecmp(option, "threading=multi"))
+		tileset->sqlite_open_flags = SQLITE_OPEN_NOMUTEX;
+	else
+		return "MbtilesSqlite options are immutable, mmap=<bytes>, cache=<n> and threading=serialized|multi";
+	return NULL;
+}
+
+const char* mbtiles_set_tile_cache(cmd_parms* cmd, void* cfg, const char* arg) {
+	char* end;
+	apr_int64_t size = apr_strtoi64(arg, &end, 10);
+	switch (*end) {
+		case 'k': case 'K': size <<= 10; end++; break;
+		case 'm': case 'M': size <<= 20; end++; break;
+		case 'g': case 'G': size <<= 30; end++; break;
+	}
+	if (end == arg || *end || size < 0)
+		return "MbtilesTileCache must be a size like 65536, 512K or 64M";
+	tile_cache_size = (apr_size_t)size;
+	return NULL;
+}
+
+const char* mbtiles_set_hot_tiles(cmd_parms* cmd, void* cfg, const char* path, const char* interval) {
+	hot_tiles_path = ap_server_root_relative(cmd->pool, path);
+	if (!hot_tiles_path)
+		return "MbtilesHotTiles has an invalid path";
+	if (interval) {
+		hot_tiles_interval = atoi(interval);
+		if (hot_tiles_interval <= 0)
+			return "MbtilesHotTiles save interval must be positive";
+	}
+	return NULL;
+}
+
+const char* mbtiles_set_read_ahead(cmd_parms* cmd, void* cfg, const char* name, const char* radius) {
+	int c = findConfiguredTileset(name, cmd->temp_pool);
+	if (c == -1)
+		return missingTileset(cmd, "MbtilesReadAhead", name);
+	tilesets[c].read_ahead = atoi(radius);
+	if (tilesets[c].read_ahead < 0 || tilesets[c].read_ahead > READAHEAD_MAX_RADIUS)
+		return apr_psprintf(cmd->pool, "MbtilesReadAhead radius must be between 0 and %d", READAHEAD_MAX_RADIUS);
+	return NULL;
+}
+
+const char* mbtiles_set_concurrency(cmd_parms* cmd, void* cfg, int argc, char* const argv[]) {
+	if (argc < 2 || argc > 4)
+		return "MbtilesConcurrency takes a tileset name, a limit, and optionally a queue length and a wait in milliseconds";
+	int c = findConfiguredTileset(argv[0], cmd->temp_pool);
+	if (c == -1)
+		return missingTileset(cmd, "MbtilesConcurrency", argv[0]);
+	Tileset* tileset = &tilesets[c];
+	tileset->concurrency = atoi(argv[1]);
+	tileset->concurrency_queue = argc > 2 ? atoi(argv[2]) : tileset->concurrency;
+	tileset->concurrency_wait = argc > 3 ? atoi(argv[3]) : DEFAULT_ADMISSION_WAIT;
+	if (tileset->concurrency < 1 || tileset->concurrency_queue < 0 || tileset->concurrency_wait < 0)
+		return "MbtilesConcurrency limit must be 1 or more, queue and wait 0 or more";
+	return NULL;
+}
+
+const char* mbtiles_set_tile_budget(cmd_parms* cmd, void* cfg, const char* ms, const char* action) {
+	int budget = atoi(ms);
+	if (budget < 0)
+		return "MbtilesTileBudget must be 0 (no limit) or more milliseconds";
+	tile_budget = apr_time_from_msec(budget);
+	if (!action || !strcmp(action, "503"))
+		tile_budget_empty = OFF;
+	else if (!strcasecmp(action, "empty"))
+		tile_budget_empty = ON;
+	else
+		return "MbtilesTileBudget action must be 503 or empty";
+	return NULL;
+}
+
+const char* mbtiles_set_shared_pages(cmd_parms* cmd, void* cfg, const char* arg) {
+	shared_pages = (!strcasecmp(arg, "true") || !strcasecmp(arg, "on")) ? ON : OFF;
+	return NULL;
+}
+
+const char* mbtiles_set_extract_limit(cmd_parms* cmd, void* cfg, const char* arg) {
+	apr_int64_t limit = apr_atoi64(arg);
+	if (limit <= 0)
+		return "MbtilesExtractLimit must be a number of tiles";
+	extract_max_tiles = (apr_uint64_t)limit;
+	return NULL;
+}
+
+const char* mbtiles_set_webp(cmd_parms* cmd, void* cfg, const char* name, const char* quality) {
+	if (!mbtiles_webp_supported())
+		return "MbtilesWebP needs mod_mbtiles built with -DMBTILES_WITH_WEBP";
+	int c = findConfiguredTileset(name, cmd->temp_pool);
+	if (c == -1)
+		return missingTileset(cmd, "MbtilesWebP", name);
+	int value = strcasecmp(quality, "lossless") ? atoi(quality) : WEBP_LOSSLESS;
+	if (value != WEBP_LOSSLESS && (value < 1 || value > 100))
+		return "MbtilesWebP quality must be lossless or 1-100";
+	tilesets[c].webp = ON;
+	tilesets[c].webp_quality = value;
+	return NULL;
+}
+
+const char* mbtiles_set_patch(cmd_parms* cmd, void* cfg, const char* name, const char* path) {
+	int c = findConfiguredTileset(name, cmd->temp_pool);
+	if (c == -1)
+		return missingTileset(cmd, "MbtilesPatch", name);
+	tilesets[c].patch_path = ap_server_root_relative(cmd->pool, path);
+	if (!tilesets[c].patch_path)
+		return "MbtilesPatch has an invalid path";
+	return NULL;
+}
+
+const char* mbtiles_set_overzoom(cmd_parms* cmd, void* cfg, const char* name, const char* zoom) {
+	int c = findConfiguredTileset(name, cmd->temp_pool);
+	if (c == -1)
+		return missingTileset(cmd, "MbtilesOverzoom", name);
+	tilesets[c].overzoom = atoi(zoom);
+	if (tilesets[c].overzoom < 1 || tilesets[c].overzoom > MAX_ZOOM)
+		return apr_psprintf(cmd->pool, "MbtilesOverzoom zoom must be between 1 and %d", MAX_ZOOM);
+	return NULL;
+}
+
+static Composite* findComposite(const char* name, apr_size_t len) {
+	if (len >= MAX_TILESET_NAME)
+		return NULL;
+	for (int i = 0; i < numComposites; i++)
+		if (strncmp(composites[i].name, name, len) == 0 && composites[i].name[len] == 0)
+			return &composites[i];
+	return NULL;
+}
+
+const char* mbtiles_add_composite(cmd_parms* cmd, void* cfg, const char* name, const char* sources) {
+	if (numComposites == MAX_COMPOSITES)
+		return "Maximum composites already added";
+	if (strlen(name) >= MAX_TILESET_NAME || strchr(name, ','))
+		return "MbtilesComposite has an invalid name";
+	if (findTS(name) != -1 || findComposite(name, strlen(name)))
+		return apr_psprintf(cmd->pool, "MbtilesComposite %s is already the name of a tileset or composite", name);
+
+	Composite* composite = &composites[numComposites];
+	memset(composite, 0, sizeof(Composite));
+	strcpy(composite->name, name);
+	composite->names = apr_pstrdup(cmd->pool, sources);
+	char* state;
+	for (char* part = apr_strtok(apr_pstrdup(cmd->temp_pool, sources), ",", &state); part; part = apr_strtok(NULL, ",", &state)) {
+		int c = findTS(part);
+		if (c == -1)
+			return apr_psprintf(cmd->pool, "MbtilesComposite must follow the MbtilesAdd of its tilesets (%s)", part);
+		if (composite->count == MAX_TILESETS)
+			return "MbtilesComposite has too many tilesets";
+		composite->sources[composite->count++] = c;
+	}
+	if (!composite->count)
+		return "MbtilesComposite needs at least one tileset";
+	numComposites++;
+	return NULL;
+}
+
+const char* mbtiles_set_composite_compression(cmd_parms* cmd, void* cfg, const char* fast, const char* normal, const char* best) {
+	composite_fast_level = atoi(fast);
+	composite_level = atoi(normal);
+	if (composite_fast_level < 1 || composite_level > 9 || composite_fast_level > composite_level)
+		return "MbtilesCompositeCompression needs levels from 1 to 9, the busy one first";
+	if (best) {
+		composite_best_level = atoi(best);
+		if (composite_best_level && (composite_best_level < composite_level || composite_best_level > 9))
+			return "MbtilesCompositeCompression best level must be 0 or from the normal level to 9";
+	}
+	return NULL;
+}
+
+// tiles inside bounds (west, south, east, north in degrees) at zoom z; an edge on a tile border doesn't take the next tile
+static void boundsToTileRange(const float* bounds, int z, TileRange* range) {
+	int last = (1 << z) - 1;
+	double n = (double)(1 << z);
+	double lat[2] = { bounds[3], bounds[1] };
+	double row[2];	// XYZ, from the north
+	for (int i = 0; i < 2; i++) {
+		double l = lat[i] > 85.0511 ? 85.0511 : (lat[i] < -85.0511 ? -85.0511 : lat[i]);
+		double r = l * M_PI / 180.0;
+		row[i] = (1.0 - log(tan(r) + 1.0 / cos(r)) / M_PI) / 2.0 * n;
+	}
+	int north = (int)floor(row[0]);
+	int south = (int)ceil(row[1]) - 1;
+	range->min_x = (int)floor((bounds[0] + 180.0) / 360.0 * n);
+	range->max_x = (int)ceil((bounds[2] + 180.0) / 360.0 * n) - 1;
+	if (range->max_x < range->min_x) range->max_x = range->min_x;
+	if (south < north) south = north;
+	range->min_y = last - south;
+	range->max_y = last - north;
+	if (range->min_x < 0) range->min_x = 0;
+	if (range->max_x > last) range->max_x = last;
+	if (range->min_y < 0) range->min_y = 0;
+	if (range->max_y > last) range->max_y = last;
+}
+
+const char* mbtiles_add_shard(cmd_parms* cmd, void* cfg, int argc, char* const argv[]) {
+	// global like MbtilesAdd
+	if (argc != 3 && argc != 4)
+		return "MbtilesShard takes a tileset name, a zoom range, optional bounds and a path";
+	const char* version;
+	const char* name;
+	splitTilesetName(argv[0], cmd->pool, &version, &name);
+	const char* path = argv[argc - 1];
+
+	int min_zoom, max_zoom;
+	if (!parseZoomRange(argv[1], &min_zoom, &max_zoom) || max_zoom > MAX_ZOOM)
+		return apr_psprintf(cmd->pool, "MbtilesShard zoom must be a zoom or a range like 0-8, up to %d", MAX_ZOOM);
+	float bounds[4] = { -180, -85.0511f, 180, 85.0511f };
+	if (argc == 4 && (sscanf(argv[2], "%f,%f,%f,%f", &bounds[0], &bounds[1], &bounds[2], &bounds[3]) != 4 || bounds[0] > bounds[2] || bounds[1] > bounds[3]))
+		return "MbtilesShard bounds must be west,south,east,north";
+
+	int c = findTileset(version, name);
+	if (c == -1) {
+		// a tileset made only of shards
+		mbtiles_add_path_ext(cmd, cfg, version, name, "");
+		c = findTileset(version, name);
+		if (c == -1)
+			return "Maximum tilesets already loaded";
+	}
+	if (numLoaded == MAX_TILESETS)
+		return "Maximum tilesets already loaded";
+	if (!tilesets[c].shards)
+		tilesets[c].shards = apr_pcalloc(cmd->pool, sizeof(ShardRouting));
+	ShardRouting* routing = tilesets[c].shards;
+	if (routing->count == MAX_SHARDS)
+		return apr_psprintf(cmd->pool, "%s has too many shards", name);
+
+	// the shard is a tileset of its own that no URL can name, with the settings its tileset has so far
+	Tileset* shard_tileset = &tilesets[numLoaded];
+	*shard_tileset = tilesets[c];
+	shard_tileset->shards = NULL;
+	shard_tileset->isShard = ON;
+	shard_tileset->preload_min_zoom = shard_tileset->preload_max_zoom = NOT_SET_ZOOM;
+	shard_tileset->inMemory = OFF;
+	apr_cpystrn(shard_tileset->path, path, sizeof(shard_tileset->path));
+	apr_snprintf(shard_tileset->name, MAX_TILESET_NAME, "%s#%d", name, routing->count);
+
+	Shard* shard = &routing->shards[routing->count];
+	shard->tileset = numLoaded;
+	shard->min_zoom = min_zoom;
+	shard->max_zoom = max_zoom;
+	for (int z = min_zoom; z <= max_zoom; z++) {
+		boundsToTileRange(bounds, z, &shard->ranges[z]);
+		routing->by_zoom[z][routing->zoom_count[z]++] = routing->count;
+	}
+	routing->count++;
+	numLoaded++;
+	return NULL;
+}
+
+// constant time: false if z/x/y (TMS) is outside the zooms or bounds the tileset's metadata gives
+static bool tileInRange(const Tileset* tileset, int z, int x, int y) {
+	if (z < 0 || x < 0 || y < 0 || z > 31 || x >= (1 << z) || y >= (1 << z))
+		return false;
+	if ((tileset->min_zoom != NOT_SET_ZOOM && z < tileset->min_zoom) || (tileset->max_zoom != NOT_SET_ZOOM && z > tileset->max_zoom))
+		return false;
+	if (tileset->coverage && z <= MAX_ZOOM) {
+		const TileRange* range = &tileset->coverage[z];
+		return x >= range->min_x && x <= range->max_x && y >= range->min_y && y <= range->max_y;
+	}
+	return true;
+}
+
+// the tileset index of the shard holding z/x/y (TMS), -1 if none does
+static int routeShard(const ShardRouting* routing, int z, int x, int y) {
+	if (z < 0 || z > MAX_ZOOM)
+		return -1;
+	for (int i = 0; i < routing->zoom_count[z]; i++) {
+		const Shard* shard = &routing->shards[routing->by_zoom[z][i]];
+		const TileRange* range = &shard->ranges[z];
+		if (x >= range->min_x && x <= range->max_x && y >= range->min_y && y <= range->max_y)
+			return shard->tileset;
+	}
+	return -1;
+}
+
+static int openDatabase(Tileset* tileset, sqlite3** db, apr_pool_t* pool) {
+	int flags = SQLITE_OPEN_READONLY | tileset->sqlite_open_flags;
+	const char* filename = tileset->path;
+
+	if (tileset->sqlite_immutable) {
+		// file: URI, escaping what would end the path
+		const char* path = tileset->path;
+		char* uri = apr_palloc(pool, strlen(path) * 3 + sizeof("file:/?immutable=1"));
+		char* u = uri;
+		u += sprintf(u, (path[0] && path[1] == ':') ? "file:/" : "file:");
+		for (; *path; path++) {
+			if (*path == '?' || *path == '#' || *path == '%')
+				u += sprintf(u, "%%%02X", (unsigned char)*path);
+			else
+				*u++ = (*path == '\\') ? '/' : *path;
+		}
+		strcpy(u, "?immutable=1");
+		filename = uri;
+		flags |= SQLITE_OPEN_URI;
+	}
+
+	int rc = sqlite3_open_v2(filename, db, flags, NULL);
+	if (rc != SQLITE_OK)
+		return rc;
+
+	if (tileset->sqlite_mmap_size >= 0)
+		rc = sqlite3_exec(*db, apr_psprintf(pool, "PRAGMA mmap_size=%" APR_INT64_T_FMT ";", tileset->sqlite_mmap_size), NULL, NULL, NULL);
+	if (rc == SQLITE_OK && tileset->sqlite_cache_size_set)
+		rc = sqlite3_exec(*db, apr_psprintf(pool, "PRAGMA cache_size=%d;", tileset->sqlite_cache_size), NULL, NULL, NULL);
+	return rc;
+}
+
+// true if the tile lookup is answered through an index, not a table scan
+static bool checkTileIndex(sqlite3* db) {
+	const char* sql = "EXPLAIN QUERY PLAN SELECT tile_data FROM tiles WHERE zoom_level=? AND tile_column=? AND tile_row=?;";
+	sqlite3_stmt* pStmt;
+	bool indexed = true;
+
+	if (SQLITE_OK != sqlite3_prepare_v2(db, sql, -1, &pStmt, NULL))
+		return false;
+	int detail = sqlite3_column_count(pStmt) - 1;
+	while (sqlite3_step(pStmt) == SQLITE_ROW) {
+		const char* plan = (const char*)sqlite3_column_text(pStmt, detail);
+		if (plan && strncmp(plan, "SCAN", 4) == 0)
+			indexed = false;
+	}
+	sqlite3_finalize(pStmt);
+	return indexed;
+}
+
+// reads last run's hottest tiles, so they come from the caches instead of the disk
+static void warmUp(apr_pool_t* pool, server_rec* s) {
+	HotTile* hot = apr_palloc(pool, HOT_TOP_K * sizeof(HotTile));
+	int count = mbtiles_hot_load(hot_tiles_path, hot, HOT_TOP_K, pool);
+	if (!count)
+		return;
+
+	apr_time_t start = apr_time_now();
+	apr_pool_t* tile_pool;
+	apr_pool_create(&tile_pool, pool);
+	int read = 0;
+	for (int i = 0; i < count; i++) {
+		int c = findTileset(hot[i].version, hot[i].name);
+		if (c == -1 || !tilesets[c].opened || hot[i].z < 0 || hot[i].z > 30)
+			continue;
+		unsigned char* tile;
+		int size;
+		if (SQLITE_OK == getTile(&tilesets[c], hot[i].z, hot[i].x, hot[i].y, tile_pool, &tile, &size))
+			read++;
+		apr_pool_clear(tile_pool);
+	}
+	apr_pool_destroy(tile_pool);
+	ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "Warmed up %d hot tiles in %d ms", read, (int)apr_time_as_msec(apr_time_now() - start));
+}
+
+// by magic bytes: gzip 1f 8b, zlib 78 xx (any level), anything else is taken as raw
+static int tileEncoding(const unsigned char* data, apr_size_t size) {
+	if (size >= 2 && data[0] == 0x1F && data[1] == 0x8B)
+		return TILE_ENCODING_GZIP;
+	if (size >= 2 && (data[0] & 0x0F) == Z_DEFLATED && (data[0] >> 4) <= 7 && ((data[0] << 8) | data[1]) % 31 == 0)
+		return TILE_ENCODING_ZLIB;
+	return TILE_ENCODING_RAW;
+}
+
+static int sampleTileEncoding(sqlite3* db) {
+	sqlite3_stmt* pStmt;
+	int encoding = TILE_ENCODING_GZIP;
+	if (SQLITE_OK != sqlite3_prepare_v2(db, "SELECT tile_data FROM tiles LIMIT 1;", -1, &pStmt, NULL))
+		return encoding;
+	if (sqlite3_step(pStmt) == SQLITE_ROW)
+		encoding = tileEncoding(sqlite3_column_blob(pStmt, 0), sqlite3_column_bytes(pStmt, 0));
+	sqlite3_finalize(pStmt);
+	return encoding;
+}
+
+// read-ahead thread: one range query for the window, into the tile cache
+static void prefetchWindow(const ReadAheadJob* job, apr_pool_t* pool) {
+	Tileset* tileset = &tilesets[job->source];
+	if (!tileset->read_ahead_db && SQLITE_OK != openDatabase(tileset, &tileset->read_ahead_db, pool)) {
+		sqlite3_close(tileset->read_ahead_db);
+		tileset->read_ahead_db = NULL;
+		return;
+	}
+
+	int last = (1 << job->z) - 1;
+	int min_x = job->x - job->radius < 0 ? 0 : job->x - job->radius;
+	int max_x = job->x + job->radius > last ? last : job->x + job->radius;
+	int min_y = job->y - job->radius < 0 ? 0 : job->y - job->radius;
+	int max_y = job->y + job->radius > last ? last : job->y + job->radius;
+	int width = max_x - min_x + 1;
+	char found[(2 * READAHEAD_MAX_RADIUS + 1) * (2 * READAHEAD_MAX_RADIUS + 1)];
+	memset(found, 0, sizeof(found));
+
+	const char* sql = "SELECT tile_column, tile_row, tile_data FROM tiles WHERE zoom_level=? AND tile_column BETWEEN ? AND ? AND tile_row BETWEEN ? AND ?;";
+	sqlite3_stmt* pStmt;
+	if (SQLITE_OK != sqlite3_prepare_v2(tileset->read_ahead_db, sql, -1, &pStmt, NULL))
+		return;
+	sqlite3_bind_int(pStmt, 1, job->z);
+	sqlite3_bind_int(pStmt, 2, min_x);
+	sqlite3_bind_int(pStmt, 3, max_x);
+	sqlite3_bind_int(pStmt, 4, min_y);
+	sqlite3_bind_int(pStmt, 5, max_y);
+
+	while (sqlite3_step(pStmt) == SQLITE_ROW) {
+		int x = sqlite3_column_int(pStmt, 0);
+		int y = sqlite3_column_int(pStmt, 1);
+		found[(y - min_y) * width + (x - min_x)] = 1;
+		if (mbtiles_cache_contains(&tile_cache, tileset->path, job->z, x, y))
+			continue;
+		mbtiles_cache_put(&tile_cache, tileset->path, job->z, x, y, sqlite3_column_blob(pStmt, 2), sqlite3_column_bytes(pStmt, 2), TILE_PREFETCHED);
+		apr_atomic_inc32(&read_ahead.stats.tiles);
+	}
+	sqlite3_finalize(pStmt);
+
+	// the rest of the window has no tiles, which is worth knowing too
+	for (int y = min_y; y <= max_y; y++)
+		for (int x = min_x; x <= max_x; x++)
+			if (!found[(y - min_y) * width + (x - min_x)] && !mbtiles_cache_contains(&tile_cache, tileset->path, job->z, x, y))
+				mbtiles_cache_put(&tile_cache, tileset->path, job->z, x, y, NULL, 0, TILE_PREFETCHED);
+}
+
+static apr_status_t closeReadAheadDatabases(void* data) {
+	for (int i = 0; i < numLoaded; i++) {
+		sqlite3_close(tilesets[i].read_ahead_db);
+		tilesets[i].read_ahead_db = NULL;
+	}
+	return APR_SUCCESS;
+}
+
+static bool readMetadata(Tileset* tileset, TilesetMetadata* metadata, apr_pool_t* pool);
+
+static void cacheMetadata(Tileset* tileset, apr_pool_t* pool, server_rec* s) {
+	TilesetMetadata metadata_default = tileset_metadata_init_default;
+	TilesetMetadata* metadata = apr_palloc(pool, sizeof(TilesetMetadata));
+	*metadata = metadata_default;
+	if (!readMetadata(tileset, metadata, pool)) {
+		ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "%s: couldn't read metadata", tileset->name);
+		return;
+	}
+
+	tileset->min_zoom = metadata->min_zoom;
+	tileset->max_zoom = metadata->max_zoom;
+	if (metadata->bounds[0] != NOT_SET_BOUNDS && metadata->bounds[1] != NOT_SET_BOUNDS &&
+		metadata->bounds[2] != NOT_SET_BOUNDS && metadata->bounds[3] != NOT_SET_BOUNDS &&
+		metadata->bounds[0] < metadata->bounds[2] && metadata->bounds[1] < metadata->bounds[3]) {
+		tileset->coverage = apr_palloc(pool, (MAX_ZOOM + 1) * sizeof(TileRange));
+		for (int z = 0; z <= MAX_ZOOM; z++)
+			boundsToTileRange(metadata->bounds, z, &tileset->coverage[z]);
+	}
+	tileset->metadata = metadata;
+}
+
+// reads a patch file whole into pool; NULL if it couldn't be
+static TilePatch* loadPatch(Tileset* tileset, const apr_finfo_t* finfo, apr_pool_t* pool, server_rec* s) {
+	TilePatch* patch = apr_pcalloc(pool, sizeof(TilePatch));
+	patch->pool = pool;
+	patch->mtime = finfo->mtime;
+	patch->size = finfo->size;
+
+	sqlite3* db;
+	apr_status_t rv = APR_EGENERAL;
+	if (SQLITE_OK == sqlite3_open_v2(tileset->patch_path, &db, SQLITE_OPEN_READONLY, NULL))
+		rv = mbtiles_memtable_load(&patch->tiles, db, 0, MAX_ZOOM, pool);
+	sqlite3_close(db);
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "%s: couldn't read patch %s", tileset->name, tileset->patch_path);
+		return NULL;
+	}
+
+	int deleted = 0;
+	for (apr_size_t i = 0; i < patch->tiles.count; i++)
+		if (!patch->tiles.entries[i].length)
+			deleted++;
+	ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, "%s: patch %s changes %d tiles and deletes %d", tileset->name, tileset->patch_path,
+		(int)patch->tiles.count - deleted, deleted);
+	return patch;
+}
+
+// parent: checks a tileset and learns what it needs to know about it; SQLite handles stay open until the end of post_config
+static void validateTileset(Tileset* tileset, apr_pool_t* pconf, apr_pool_t* ptemp, server_rec* s) {
+	if (mbtiles_is_pmtiles_path(tileset->path)) {
+		// the mapping is inherited by the children
+		tileset->isPmtiles = 1;
+		tileset->pmtiles = apr_palloc(pconf, sizeof(PmtilesArchive));
+		apr_status_t rv = mbtiles_pmtiles_open(tileset->pmtiles, tileset->path, pconf);
+		if (rv != APR_SUCCESS) {
+			ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "%s: couldn't open pmtiles", tileset->name);
+			return;
+		}
+
+		// brotli or zstd tiles could only be sent as they are, under the wrong Content-Encoding
+		int compression = tileset->pmtiles->header.tile_compression;
+		if (compression != PMTILES_COMPRESSION_NONE && compression != PMTILES_COMPRESSION_GZIP) {
+			ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "%s: pmtiles tile compression %d isn't supported, only none or gzip", tileset->name, compression);
+			return;
+		}
+
+		strcpy_s(tileset->format, MAX_FORMAT_NAME, mbtiles_pmtiles_format(tileset->pmtiles));
+		tileset->opened = ON;
+		tileset->isPBF = (strcmp(tileset->format, "pbf") == 0) ? 1 : 0;
+		tileset->encoding = compression == PMTILES_COMPRESSION_GZIP ? TILE_ENCODING_GZIP : TILE_ENCODING_RAW;
+		if (tileset->isPBF && tileset->encoding != TILE_ENCODING_GZIP) {
+			ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, "%s: vector tiles in pmtiles aren't gzip compressed, they will be compressed when served", tileset->name);
+			need_tile_cache = true;
+		}
+		if (tileset->preload_min_zoom != NOT_SET_ZOOM)
+			ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "%s: MbtilesPreload and MbtilesInMemory are ignored for pmtiles", tileset->name);
+		tileset->inMemory = OFF;
+		ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, tileset->isPBF ? "%s: successfully opened vector pmtiles" : "%s: successfully opened raster pmtiles", tileset->name);
+		return;
+	}
+
+	// the whole file is mapped, so every child reads the same OS pages and keeps only a small page cache of its own
+	if (shared_pages && tileset->sqlite_mmap_size < 0) {
+		apr_finfo_t finfo;
+		if (APR_SUCCESS == apr_stat(&finfo, tileset->path, APR_FINFO_SIZE, ptemp))
+			tileset->sqlite_mmap_size = finfo.size;
+		if (!tileset->sqlite_cache_size_set) {
+			tileset->sqlite_cache_size = SHARED_PAGES_CACHE_SIZE;
+			tileset->sqlite_cache_size_set = ON;
+		}
+	}
+
+	// Attempt to open the database
+	sqlite3* db;
+	if (SQLITE_OK != openDatabase(tileset, &db, ptemp)) {
+		sqlite3_close(db);
+		ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "%s: couldn't open mbtiles %s", tileset->name, tileset->path);
+		return;
+	}
+
+	// Successfully opened, so find out what format it is
+	const char *sql = "SELECT value FROM metadata WHERE name='format';";
+	sqlite3_stmt *pStmt;
+	int rc = sqlite3_prepare(db, sql, -1, &pStmt, 0);
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(pStmt);
+	if (rc != SQLITE_ROW) {
+		ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "%s: couldn't find format in mbtiles", tileset->name);
+		sqlite3_finalize(pStmt);
+		sqlite3_close(db);
+		return;
+	}
+	const char *fmt = sqlite3_column_text(pStmt, 0);
+	strcpy_s(tileset->format, MAX_FORMAT_NAME, fmt);
+	rc = sqlite3_finalize(pStmt);
+
+	if (!checkTileIndex(db))
+		ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "%s: tiles has no index on (zoom_level, tile_column, tile_row), every tile is a table scan", tileset->name);
+
+	// All good!
+	tileset->db = db;
+	tileset->opened = ON;
+	tileset->isPBF = (strcmp(tileset->format,"pbf")==0) ? 1 : 0;
+	ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, tileset->isPBF ? "%s: successfully opened vector mbtiles" : "%s: successfully opened raster mbtiles", tileset->name);
+
+	tileset->encoding = sampleTileEncoding(db);
+	if (tileset->isPBF && tileset->encoding != TILE_ENCODING_GZIP) {
+		ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, tileset->encoding == TILE_ENCODING_ZLIB ? "%s: vector tiles are zlib compressed, they will be gzipped when served" : "%s: vector tiles are uncompressed, they will be gzipped when served", tileset->name);
+		need_tile_cache = true;
+	}
+
+	// Packed sidecar is optional
+	tileset->hasPack = (!tileset->inMemory && APR_SUCCESS == mbtiles_pack_open(&tileset->pack, tileset->path, pconf)) ? 1 : 0;
+	if (tileset->hasPack)
+		ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "%s: serving %" APR_UINT64_T_FMT " tiles from packed sidecar", tileset->name, tileset->pack.count);
+
+	if (tileset->preload_min_zoom != NOT_SET_ZOOM) {
+		apr_time_t start = apr_time_now();
+		apr_status_t rv = mbtiles_memtable_load(&tileset->preload, db, tileset->preload_min_zoom, tileset->preload_max_zoom, pconf);
+		if (rv != APR_SUCCESS) {
+			ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, tileset->inMemory ? "%s: couldn't load into memory, reading from SQLite instead" : "%s: couldn't preload zoom %d-%d",
+				tileset->name, tileset->preload_min_zoom, tileset->preload_max_zoom);
+			tileset->preload.count = 0;
+			tileset->inMemory = OFF;
+		}
+		else if (tileset->inMemory)
+			ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, "%s: loaded all %d tiles into memory in %d ms, %d KB resident (%d KB of distinct tiles)",
+				tileset->name, (int)tileset->preload.count, (int)apr_time_as_msec(apr_time_now() - start),
+				(int)(mbtiles_memtable_bytes(&tileset->preload) / 1024), (int)(tileset->preload.arena_size / 1024));
+		else
+			ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, "%s: preloaded %d tiles of zoom %d-%d in %d ms, %d KB resident",
+				tileset->name, (int)tileset->preload.count, tileset->preload_min_zoom, tileset->preload_max_zoom,
+				(int)apr_time_as_msec(apr_time_now() - start), (int)(mbtiles_memtable_bytes(&tileset->preload) / 1024));
+	}
+}
+
+static int mbtiles_pre_config(apr_pool_t* pconf, apr_pool_t* plog, apr_pool_t* ptemp) {
+	// the configuration is read again on every restart, and what it built lived in the old pconf
+	numLoaded = 0;
+	numComposites = 0;
+	numCacheRules = 0;
+	immutable_max_age = 31536000;
+	tile_cache_size = 0;
+	hot_tiles_path = NULL;
+	hot_tiles_interval = HOT_TILES_SAVE_INTERVAL;
+	shared_pages = OFF;
+	tile_budget = 0;
+	tile_budget_empty = OFF;
+	extract_max_tiles = DEFAULT_EXTRACT_MAX_TILES;
+	composite_fast_level = COMPOSITE_FAST_LEVEL;
+	composite_level = COMPOSITE_LEVEL;
+	composite_best_level = COMPOSITE_BEST_LEVEL;
+	return OK;
+}
+
+// drops the sources that can't be served, and merges what a request would otherwise work out from the names
+static void planComposite(Composite* composite, apr_pool_t* pool, server_rec* s) {
+	TilesetMetadata* parts = apr_palloc(pool, composite->count * sizeof(TilesetMetadata));
+	TilesetMetadata metadata_default = tileset_metadata_init_default;
+	int count = 0;
+	int described = 0;
+	composite->min_zoom = MAX_ZOOM;
+	composite->max_zoom = 0;
+	for (int z = 0; z <= MAX_ZOOM; z++)
+		composite->max_age[z] = -1;
+
+	for (int i = 0; i < composite->count; i++) {
+		Tileset* tileset = &tilesets[composite->sources[i]];
+		if (!tileset->opened) {
+			ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "%s: %s isn't open, its tiles won't be served", composite->name, tileset->name);
+			continue;
+		}
+		if (count && tileset->isPBF != composite->isPBF) {
+			ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "%s: %s is %s, vector and raster tiles can't be merged, its tiles won't be served",
+				composite->name, tileset->name, tileset->format);
+			continue;
+		}
+		composite->isPBF = tileset->isPBF;
+		composite->sources[count++] = composite->sources[i];
+
+		int min_zoom = tileset->min_zoom == NOT_SET_ZOOM ? 0 : tileset->min_zoom;
+		int max_zoom = tileset->overzoom ? tileset->overzoom : tileset->max_zoom == NOT_SET_ZOOM ? MAX_ZOOM : tileset->max_zoom;
+		if (min_zoom < composite->min_zoom)
+			composite->min_zoom = min_zoom;
+		if (max_zoom > composite->max_zoom)
+			composite->max_zoom = max_zoom;
+		for (int z = 0; z <= MAX_ZOOM; z++) {
+			int max_age = cacheMaxAge(tileset->name, z);
+			if (max_age >= 0 && (composite->max_age[z] < 0 || max_age < composite->max_age[z]))
+				composite->max_age[z] = max_age;
+		}
+
+		parts[described] = metadata_default;
+		if (readMetadata(tileset, &parts[described], pool))
+			described++;
+	}
+	composite->count = count;
+
+	// a patch can change a source's tiles at any time, so its merged ones can't be kept
+	bool patched = false;
+	for (int i = 0; i < count; i++)
+		patched = patched || tilesets[composite->sources[i]].patch_path;
+	if (composite->isPBF && count > 1 && !patched) {
+		composite->cache_source = apr_psprintf(pool, "composite:%s", composite->name);
+		need_tile_cache = true;
+	}
+
+	if (described) {
+		composite->metadata = apr_palloc(pool, sizeof(TilesetMetadata));
+		*composite->metadata = mbtiles_metadata_merge(parts, described, pool);
+	}
+	ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "%s: composite of %d tilesets, zooms %d-%d", composite->name, count, composite->min_zoom, composite->max_zoom);
+}
+
+// runs in the parent, so whatever is loaded here is shared copy-on-write by the children,
+// which only have to open their own SQLite handles
+static int mbtiles_post_config(apr_pool_t* pconf, apr_pool_t* plog, apr_pool_t* ptemp, server_rec* s) {
+	apr_time_t start = apr_time_now();
+	need_tile_cache = false;
+	use_read_ahead = false;
+
+	for (int i = 0; i < numLoaded; i++) {
+		if (!tilesets[i].path[0]) {
+			if (tilesets[i].preload_min_zoom != NOT_SET_ZOOM)
+				ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "%s: MbtilesPreload and MbtilesInMemory are ignored for a tileset made of shards", tilesets[i].name);
+			tilesets[i].inMemory = OFF;
+			continue;	// only shards, resolved below
+		}
+		validateTileset(&tilesets[i], pconf, ptemp, s);
+		if (tilesets[i].read_ahead && !tilesets[i].isPmtiles && !tilesets[i].inMemory)
+			use_read_ahead = true;
+	}
+
+	// a tileset made of shards is served as its first shard's format
+	for (int i = 0; i < numLoaded; i++) {
+		if (!tilesets[i].shards)
+			continue;
+		for (int j = 0; j < tilesets[i].shards->count && !tilesets[i].opened; j++) {
+			Tileset* shard = &tilesets[tilesets[i].shards->shards[j].tileset];
+			if (!shard->opened)
+				continue;
+			strcpy_s(tilesets[i].format, MAX_FORMAT_NAME, shard->format);
+			tilesets[i].isPBF = shard->isPBF;
+			tilesets[i].encoding = shard->encoding;
+			tilesets[i].opened = ON;
+		}
+		for (int j = 0; j < tilesets[i].shards->count; j++) {
+			Tileset* shard = &tilesets[tilesets[i].shards->shards[j].tileset];
+			if (!shard->opened)
+				ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "%s: shard %s isn't open, its tiles won't be served", tilesets[i].name, shard->path);
+			else if (strcmp(shard->format, tilesets[i].format))
+				ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "%s: shard %s is %s, not %s", tilesets[i].name, shard->path, shard->format, tilesets[i].format);
+		}
+	}
+
+	for (int i = 0; i < numLoaded; i++)
+		if (tilesets[i].opened && !tilesets[i].isShard)
+			cacheMetadata(&tilesets[i], pconf, s);
+
+	// the children share these until the files are replaced
+	for (int i = 0; i < numLoaded; i++) {
+		Tileset* tileset = &tilesets[i];
+		if (!tileset->patch_path || !tileset->opened)
+			continue;
+		apr_finfo_t finfo;
+		apr_pool_t* pool;
+		tileset->patch_checked = apr_time_now();
+		if (APR_SUCCESS != apr_stat(&finfo, tileset->patch_path, APR_FINFO_SIZE | APR_FINFO_MTIME, ptemp)) {
+			ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "%s: no patch at %s yet", tileset->name, tileset->patch_path);
+			continue;
+		}
+		apr_pool_create(&pool, pconf);
+		tileset->patch = loadPatch(tileset, &finfo, pool, s);
+		if (!tileset->patch)
+			apr_pool_destroy(pool);
+	}
+
+	// SQLite handles mustn't be shared across fork
+	for (int i = 0; i < numLoaded; i++) {
+		sqlite3_close(tilesets[i].db);
+		tilesets[i].db = NULL;
+	}
+
+	// encoded WebP tiles are kept in the tile cache
+	for (int i = 0; i < numLoaded; i++) {
+		Tileset* tileset = &tilesets[i];
+		if (!tileset->webp || !tileset->opened || tileset->isShard)
+			continue;
+		if (strcmp(tileset->format, "png") && strcmp(tileset->format, "jpg")) {
+			ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "%s: MbtilesWebP only re-encodes png and jpg tiles, not %s", tileset->name, tileset->format);
+			tileset->webp = OFF;
+			continue;
+		}
+		tileset->webp_source = apr_psprintf(pconf, "webp:%s/%s", tileset->version, tileset->name);
+		need_tile_cache = true;
+	}
+
+	// cut tiles are kept in the tile cache, and metadata.json offers their zooms
+	for (int i = 0; i < numLoaded; i++) {
+		Tileset* tileset = &tilesets[i];
+		if (!tileset->overzoom || !tileset->opened || tileset->isShard)
+			continue;
+		if (!tileset->isPBF || tileset->max_zoom == NOT_SET_ZOOM || tileset->overzoom <= tileset->max_zoom) {
+			ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "%s: MbtilesOverzoom needs vector tiles with a maxzoom in their metadata below %d",
+				tileset->name, tileset->overzoom);
+			tileset->overzoom = 0;
+			continue;
+		}
+		tileset->overzoom_source = apr_psprintf(pconf, "overzoom:%s/%s", tileset->version, tileset->name);
+		if (tileset->metadata)
+			tileset->metadata->max_zoom = tileset->overzoom;
+		need_tile_cache = true;
+	}
+
+	// after the tilesets' metadata, zooms included, is final
+	for (int i = 0; i < numComposites; i++)
+		planComposite(&composites[i], pconf, s);
+
+	if ((need_tile_cache || use_read_ahead) && !tile_cache_size) {
+		tile_cache_size = DEFAULT_TILE_CACHE_SIZE;
+		ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "Using a %d MB tile cache", (int)(tile_cache_size >> 20));
+	}
+
+	ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "Checked %d tilesets in %d ms", numLoaded, (int)apr_time_as_msec(apr_time_now() - start));
+	return OK;
+}
+
+static void lockHandles(void) {
+#if APR_HAS_THREADS
+	if (open_mutex)
+		apr_thread_mutex_lock(open_mutex);
+#endif
+}
+
+static void unlockHandles(void) {
+#if APR_HAS_THREADS
+	if (open_mutex)
+		apr_thread_mutex_unlock(open_mutex);
+#endif
+}
+
+// SQLite progress handler: a read past its deadline is interrupted
+static int overBudget(void* data) {
+	TilesetHandle* handle = (TilesetHandle*)data;
+	return handle->deadline && apr_time_now() > handle->deadline;
+}
+
+// under the mutex: 1, 2, 4... seconds before the next attempt
+static void backOff(Tileset* tileset) {
+	int delay = tileset->failures < 6 ? 1 << tileset->failures : MAX_REOPEN_BACKOFF;
+	tileset->failures++;
+	tileset->reopen_at = apr_time_now() + apr_time_from_sec(delay < MAX_REOPEN_BACKOFF ? delay : MAX_REOPEN_BACKOFF);
+}
+
+// errors after which the handle is replaced rather than reused; any other fails only its request
+static bool brokenHandle(int rc) {
+	switch (rc & 0xff) {
+	case SQLITE_IOERR:
+	case SQLITE_CORRUPT:
+	case SQLITE_NOTADB:
+	case SQLITE_CANTOPEN:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// children open their SQLite handle on first use, and again after an error once the backoff has passed; NULL until then
+static TilesetHandle* acquireDatabase(Tileset* tileset) {
+	lockHandles();
+	TilesetHandle* handle = tileset->handle;
+	if (!handle && apr_time_now() >= tileset->reopen_at) {
+		sqlite3* db;
+		if (SQLITE_OK == openDatabase(tileset, &db, open_pool) && (handle = malloc(sizeof(TilesetHandle)))) {
+			handle->db = db;
+			handle->users = 0;
+			handle->deadline = 0;
+			if (tile_budget)
+				sqlite3_progress_handler(db, BUDGET_CHECK_OPS, overBudget, handle);
+			tileset->handle = handle;
+		}
+		else {
+			sqlite3_close(db);
+			backOff(tileset);
+		}
+	}
+	if (handle)
+		handle->users++;
+	unlockHandles();
+	return handle;
+}
+
+static void releaseDatabase(Tileset* tileset, TilesetHandle* handle, int rc) {
+	lockHandles();
+	handle->users--;
+	if (handle == tileset->handle) {
+		if (rc == SQLITE_OK)
+			tileset->failures = 0;
+		else if (brokenHandle(rc)) {
+			tileset->handle = NULL;
+			backOff(tileset);
+		}
+	}
+	if (handle != tileset->handle && handle->users == 0) {
+		sqlite3_close(handle->db);
+		free(handle);
+	}
+	unlockHandles();
+}
+
+static void releasePatch(TilePatch* patch) {
+	lockHandles();
+	patch->users--;
+	if (patch->replaced && !patch->users)
+		apr_pool_destroy(patch->pool);
+	unlockHandles();
+}
+
+// only the WebP of a patched tile is cached: the rest of the tile cache holds the file's tiles, which the patch is read over
+static void invalidatePatched(Tileset* tileset, const TilePatch* patch) {
+	if (!patch || !tileset->webp_source)
+		return;
+	for (apr_size_t i = 0; i < patch->tiles.count; i++) {
+		int z;
+		uint32_t x, y;
+		mbtiles_tileid_to_zxy(patch->tiles.entries[i].tile_id, &z, &x, &y);
+		mbtiles_cache_remove(&tile_cache, tileset->webp_source, z, x, mbtiles_flip_y(z, y));
+	}
+}
+
+// child: a patch file that was replaced (renamed over) or removed is read again, by the thread that noticed
+static void reloadPatch(Tileset* tileset) {
+	apr_pool_t* pool;
+	lockHandles();
+	apr_status_t rv = apr_pool_create(&pool, open_pool);
+	TilePatch* old = tileset->patch;
+	if (old)
+		old->users++;	// its tiles are uncached below
+	unlockHandles();
+	if (rv != APR_SUCCESS) {
+		if (old)
+			releasePatch(old);
+		return;
+	}
+
+	apr_finfo_t finfo;
+	bool exists = APR_SUCCESS == apr_stat(&finfo, tileset->patch_path, APR_FINFO_SIZE | APR_FINFO_MTIME, pool);
+	TilePatch* patch = NULL;
+	if (exists ? !(old && old->mtime == finfo.mtime && old->size == finfo.size) : old != NULL) {
+		patch = exists ? loadPatch(tileset, &finfo, pool, main_server) : NULL;
+		// a file that can't be read leaves the old patch in place, and is tried again at the next check
+		if (patch || !exists) {
+			lockHandles();
+			tileset->patch = patch;
+			tileset->patch_loads++;
+			if (old)
+				old->replaced = ON;
+			unlockHandles();
+			invalidatePatched(tileset, old);
+			invalidatePatched(tileset, patch);
+			if (!exists)
+				ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, main_server, "%s: patch %s removed", tileset->name, tileset->patch_path);
+		}
+	}
+	if (!patch) {
+		lockHandles();
+		apr_pool_destroy(pool);
+		unlockHandles();
+	}
+	if (old)
+		releasePatch(old);
+}
+
+// the patch's version of z/x/y (TMS): false if the patch doesn't have it, true with *pTile NULL if it deletes it
+static bool readPatchedTile(Tileset* tileset, const int z, const int x, const int y, apr_pool_t* pool, unsigned char** pTile, int* psTile) {
+	apr_time_t now = apr_time_now();
+	lockHandles();
+	bool check = open_pool && now - tileset->patch_checked >= apr_time_from_sec(PATCH_CHECK_INTERVAL);
+	if (check)
+		tileset->patch_checked = now;
+	unlockHandles();
+	if (check)
+		reloadPatch(tileset);
+
+	lockHandles();
+	TilePatch* patch = tileset->patch;
+	if (patch)
+		patch->users++;
+	unlockHandles();
+	if (!patch)
+		return false;
+
+	const unsigned char* data;
+	apr_size_t size;
+	bool found = mbtiles_memtable_find(&patch->tiles, z, x, mbtiles_flip_y(z, y), &data, &size);
+	if (found) {
+		*pTile = size ? apr_pmemdup(pool, data, size) : NULL;
+		*psTile = (int)size;
+	}
+	releasePatch(patch);
+	return found;
+}
+
+// seconds until the tileset's file is tried again
+static int reopenDelay(Tileset* tileset) {
+	lockHandles();
+	apr_interval_time_t wait = tileset->handle ? 0 : tileset->reopen_at - apr_time_now();
+	unlockHandles();
+	return wait > 0 ? (int)apr_time_sec(wait) + 1 : 1;
+}
+
+// never shrinks; a lost race only means another thread starts with a smaller buffer
+static void growMergeBuffer(apr_size_t size) {
+	apr_uint32_t seen = apr_atomic_read32(&dynamic_tiles_size);
+	while (seen < size) {
+		apr_uint32_t prev = apr_atomic_cas32(&dynamic_tiles_size, (apr_uint32_t)size, seen);
+		if (prev == seen)
+			break;
+		seen = prev;
+	}
+}
+
+static bool recompressTile(const DeflateJob* job, int level, apr_pool_t* pool);
+
 void processStarting(apr_pool_t *pool, server_rec *s) {
+	apr_time_t start = apr_time_now();
+
 	//regexpc_match_uri = ap_pregcomp(pool, "^\\/?(?'path'[\\w\\/,-]+)\\/(?'z'\\d+)\\/(?'x'\\d+)\\/(?'y'\\d+)\\.(?'format'.*)$", (AP_REG_EXTENDED | AP_REG_ICASE));
 	regexpc_match_uri = ap_pregcomp(pool, "^\\/?(?'v'[\\w]+\/)?\\/?(?'path'[\\w,-_]+)\\/(?'z'\\d+)\\/(?'x'\\d+)\\/(?'y'\\d+)\\.(?'format'.*)$", (AP_REG_EXTENDED | AP_REG_ICASE));
 	ap_assert(regexpc_match_uri != NULL);
 
-	for (int i=0; i<numLoaded; i++) {
-		// Attempt to open the database
-		if (SQLITE_OK!=sqlite3_open_v2(tilesets[i].path, &tilesets[i].db, SQLITE_OPEN_READONLY, NULL)) {
-			sqlite3_close(tilesets[i].db);
-			tilesets[i].opened = OFF;
-			ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Couldn't open mbtiles");
-			return;
+	apr_pool_create(&open_pool, pool);
+	main_server = s;
+#if APR_HAS_THREADS
+	if (APR_SUCCESS != apr_thread_mutex_create(&open_mutex, APR_THREAD_MUTEX_DEFAULT, pool))
+		ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "Couldn't create the mutex for opening tilesets");
+#endif
+
+	if (APR_SUCCESS != mbtiles_flight_init(&composite_flights, pool))
+		ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "Couldn't set up composite request coalescing");
+	if (hot_tiles_path && APR_SUCCESS != mbtiles_hot_init(&hot_tiles, hot_tiles_path, apr_time_from_sec(hot_tiles_interval), pool))
+		ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "Couldn't set up hot tile counting");
+	if (APR_SUCCESS != mbtiles_cache_init(&tile_cache, tile_cache_size, pool))
+		ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "Couldn't set up the tile cache");
+
+	// without SQLite's own mutex, sqlite3_db_mutex() is NULL and threads sharing a handle would run into each other
+	int threaded = AP_MPMQ_NOT_SUPPORTED;
+	if (APR_SUCCESS == ap_mpm_query(AP_MPMQ_IS_THREADED, &threaded) && threaded != AP_MPMQ_NOT_SUPPORTED) {
+		for (int i = 0; i < numLoaded; i++) {
+			if (tilesets[i].sqlite_open_flags != SQLITE_OPEN_NOMUTEX)
+				continue;
+			ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "%s: threading=multi is only safe with the prefork MPM, using serialized", tilesets[i].name);
+			tilesets[i].sqlite_open_flags = SQLITE_OPEN_FULLMUTEX;
 		}
+	}
 
-		// Successfully opened, so find out what format it is
-		const char *sql = "SELECT value FROM metadata WHERE name='format';";
-		sqlite3_stmt *pStmt;
-		int rc = sqlite3_prepare(tilesets[i].db, sql, -1, &pStmt, 0);
-		if (rc!=SQLITE_OK) { ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Couldn't find format in mbtiles"); return; }
-		rc = sqlite3_step(pStmt);
-		if (rc!=SQLITE_ROW) { ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Couldn't find format in mbtiles"); return; }
-		const char *fmt = sqlite3_column_text(pStmt, 0);
-		strcpy_s(tilesets[i].format, MAX_FORMAT_NAME, fmt);
-		rc = sqlite3_finalize(pStmt);
+	for (int i = 0; i < numLoaded; i++) {
+		if (!tilesets[i].concurrency || tilesets[i].isPmtiles || tilesets[i].inMemory)
+			continue;
+		tilesets[i].admission = apr_palloc(pool, sizeof(Admission));
+		if (APR_SUCCESS != mbtiles_admission_init(tilesets[i].admission, tilesets[i].concurrency, tilesets[i].concurrency_queue,
+												   apr_time_from_msec(tilesets[i].concurrency_wait), pool)) {
+			ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "%s: couldn't set up the concurrency limit", tilesets[i].name);
+			tilesets[i].admission = NULL;
+		}
+	}
 
-		// All good!
-		tilesets[i].opened = ON;
-		tilesets[i].isPBF = (strcmp(tilesets[i].format,"pbf")==0) ? 1 : 0;
-		ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, tilesets[i].isPBF ? "%s: successfully opened vector mbtiles" : "%s: successfully opened raster mbtiles", tilesets[i].name);
+	// the child's threads are its capacity: a tile is compressed faster the more of them are busy
+	int threads = 1;
+	if (APR_SUCCESS != ap_mpm_query(AP_MPMQ_MAX_THREADS, &threads))
+		threads = 1;
+	mbtiles_deflate_init(&composite_deflate, composite_fast_level, composite_level, composite_best_level, threads);
+	bool recompress = false;
+	for (int i = 0; i < numComposites; i++)
+		recompress = recompress || composites[i].cache_source;
+	if (recompress && composite_best_level > composite_fast_level && mbtiles_cache_enabled(&tile_cache)) {
+		apr_status_t rv = mbtiles_deflate_start(&composite_deflate, recompressTile, pool);
+		if (rv != APR_SUCCESS)
+			ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, "Couldn't start the composite compression thread");
 	}
+
+	if (use_read_ahead) {
+		// the thread is stopped by its cleanup before its handles are closed
+		apr_pool_cleanup_register(pool, NULL, closeReadAheadDatabases, apr_pool_cleanup_null);
+		apr_status_t rv = mbtiles_readahead_start(&read_ahead, prefetchWindow, pool);
+		if (rv != APR_SUCCESS)
+			ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, "Couldn't start the read-ahead thread");
+	}
+
+	ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "mod_mbtiles child started in %d ms", (int)apr_time_as_msec(apr_time_now() - start));
+
+	if (hot_tiles_path)
+		warmUp(pool, s);
 }
 
 static apr_status_t processEnding(void *d) {
 	if (regexpc_match_uri)
 		ap_regfree(regexpc_match_uri);
 	for (int i=0; i<numLoaded; i++) {
-		sqlite3_close(tilesets[i].db);
+		if (tilesets[i].handle && tilesets[i].handle->users == 0) {
+			sqlite3_close(tilesets[i].handle->db);
+			free(tilesets[i].handle);
+			tilesets[i].handle = NULL;
+		}
 		tilesets[i].opened = OFF;
 		//mbtiles_metadata_release(&tilesets[i].metadata);
 	}
@@ -262,8 +1678,12 @@ static apr_status_t processEnding(void *d) {
 
 static void mbtiles_register_hooks(apr_pool_t *p) {
 	ap_hook_handler(mbtiles_composite_handler, NULL, NULL, APR_HOOK_FIRST);
+	ap_hook_handler(mbtiles_status_handler, NULL, NULL, APR_HOOK_MIDDLE);
+	ap_hook_handler(mbtiles_extract_handler, NULL, NULL, APR_HOOK_MIDDLE);
 	apr_pool_cleanup_register(p, NULL, processEnding, apr_pool_cleanup_null);
 	ap_hook_child_init(processStarting, NULL, NULL, APR_HOOK_FIRST);
+	ap_hook_pre_config(mbtiles_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+	ap_hook_post_config(mbtiles_post_config, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 static int readTile(sqlite3 *db, const int z, const int x, const int y, apr_pool_t *pool, unsigned char **pTile, int *psTile ) {
@@ -296,6 +1716,335 @@ static int readTile(sqlite3 *db, const int z, const int x, const int y, apr_pool
 	return rc;
 }
 
+static int readStoredTile(Tileset* tileset, const int z, const int x, const int y, apr_pool_t* pool, unsigned char** pTile, int* psTile) {
+	if ((tileset->inMemory || tileset->preload.count) && z >= tileset->preload.min_zoom && z <= tileset->preload.max_zoom) {
+		// the whole zoom is in memory, a miss is final
+		const unsigned char* data;
+		apr_size_t size;
+		*pTile = NULL;
+		if (mbtiles_memtable_find(&tileset->preload, z, x, mbtiles_flip_y(z, y), &data, &size)) {
+			*pTile = (unsigned char*)data;
+			*psTile = (int)size;
+		}
+		return SQLITE_OK;
+	}
+
+	if (tileset->isPmtiles) {
+		const unsigned char* data;
+		apr_size_t size;
+		if (!mbtiles_pmtiles_find(tileset->pmtiles, z, x, mbtiles_flip_y(z, y), &data, &size))
+			return SQLITE_CORRUPT;
+		*pTile = (unsigned char*)data;
+		*psTile = (int)size;
+		return SQLITE_OK;
+	}
+
+	if (tileset->hasPack) {
+		// the sidecar holds every tile of the .mbtiles, so a miss is final
+		const unsigned char* data;
+		apr_size_t size;
+		*pTile = NULL;
+		if (mbtiles_pack_find(&tileset->pack, z, x, mbtiles_flip_y(z, y), &data, &size)) {
+			*pTile = (unsigned char*)data;
+			*psTile = (int)size;
+		}
+		return SQLITE_OK;
+	}
+
+	apr_size_t size;
+	int flags;
+	if (mbtiles_cache_get(&tile_cache, tileset->path, z, x, y, pool, pTile, &size, &flags)) {
+		if (flags & TILE_PREFETCHED)
+			apr_atomic_inc32(&read_ahead.stats.hits);
+		*psTile = (int)size;
+		return SQLITE_OK;
+	}
+
+	// only reads that reach the file count against the limit
+	if (tileset->admission && !mbtiles_admission_enter(tileset->admission))
+		return TILE_REJECTED;
+	TilesetHandle* handle = acquireDatabase(tileset);
+	if (!handle) {
+		if (tileset->admission)
+			mbtiles_admission_leave(tileset->admission);
+		return SQLITE_CANTOPEN;
+	}
+	// threads take turns on a handle anyway; holding its mutex keeps the deadline theirs
+	sqlite3_mutex* mutex = sqlite3_db_mutex(handle->db);
+	sqlite3_mutex_enter(mutex);
+	handle->deadline = tile_budget ? apr_time_now() + tile_budget : 0;
+	int rc = readTile(handle->db, z, x, y, pool, pTile, psTile);
+	handle->deadline = 0;
+	sqlite3_mutex_leave(mutex);
+	releaseDatabase(tileset, handle, rc);
+	if (tileset->admission)
+		mbtiles_admission_leave(tileset->admission);
+	if (rc == SQLITE_OK) {
+		mbtiles_cache_put(&tile_cache, tileset->path, z, x, y, *pTile, *pTile ? *psTile : 0, 0);
+		if (tileset->read_ahead)
+			mbtiles_readahead_queue(&read_ahead, (int)(tileset - tilesets), z, x, y, tileset->read_ahead);
+	}
+	return rc;
+}
+
+// the tile uncompressed, in pool unless it's stored that way; false if it's corrupt
+static bool inflateTile(unsigned char* data, apr_size_t size, apr_pool_t* pool, unsigned char** raw, apr_size_t* raw_size) {
+	*raw = data;
+	*raw_size = size;
+	if (tileEncoding(data, size) == TILE_ENCODING_RAW)
+		return true;
+	apr_size_t buffer_size = size * 4;
+	do {
+		if (buffer_size > MAX_RAW_TILE_SIZE)
+			return false;
+		*raw = apr_palloc(pool, buffer_size);
+		*raw_size = decompressGzip(*raw, buffer_size, data, size);
+		buffer_size *= 2;
+	} while (*raw_size == (apr_size_t)Z_BUF_ERROR);
+	return *raw_size != 0;
+}
+
+// vector tiles are always served gzipped: others are compressed once and kept in the tile cache under source, unless it's NULL
+static int gzipTile(const char* source, const int z, const int x, const int y, apr_pool_t* pool, unsigned char** pTile, int* psTile) {
+	unsigned char* cached;
+	apr_size_t size;
+	if (source && mbtiles_cache_get(&tile_cache, source, z, x, y, pool, &cached, &size, NULL) && cached && tileEncoding(cached, size) == TILE_ENCODING_GZIP) {
+		*pTile = cached;
+		*psTile = (int)size;
+		return SQLITE_OK;
+	}
+
+	unsigned char* raw;
+	apr_size_t raw_size;
+	if (!inflateTile(*pTile, *psTile, pool, &raw, &raw_size))
+		return SQLITE_CORRUPT;
+
+	apr_size_t buffer_size = compressBound(raw_size) + 32;	// gzip header and trailer
+	unsigned char* gzipped = apr_palloc(pool, buffer_size);
+	size = compressGzip(gzipped, buffer_size, raw, raw_size, Z_DEFAULT_COMPRESSION);
+	if (!size)
+		return SQLITE_NOMEM;
+
+	if (source)
+		mbtiles_cache_put(&tile_cache, source, z, x, y, gzipped, size, 0);
+	*pTile = gzipped;
+	*psTile = (int)size;
+	return SQLITE_OK;
+}
+
+// the deflate thread: a composite tile sent at a low level while the child was busy is compressed again at the best one
+static bool recompressTile(const DeflateJob* job, int level, apr_pool_t* pool) {
+	unsigned char* data;
+	apr_size_t size;
+	if (!mbtiles_cache_get(&tile_cache, job->source, job->z, job->x, job->y, pool, &data, &size, NULL) || !data)
+		return false;	// evicted since
+	unsigned char* raw;
+	apr_size_t raw_size;
+	if (!inflateTile(data, size, pool, &raw, &raw_size))
+		return false;
+	apr_size_t buffer_size = compressBound(raw_size) + 32;	// gzip header and trailer
+	unsigned char* best = apr_palloc(pool, buffer_size);
+	apr_size_t best_size = compressGzip(best, buffer_size, raw, raw_size, level);
+	if (!best_size || best_size >= size)
+		return false;
+	mbtiles_cache_put(&tile_cache, job->source, job->z, job->x, job->y, best, best_size, 0);
+	return true;
+}
+
+// a vector tile past the tileset's maxzoom (TMS z/x/y), cut out of its ancestor at maxzoom and kept in the tile cache
+static int overzoomTile(Tileset* tileset, const int z, const int x, const int y, apr_pool_t* pool, unsigned char** pTile, int* psTile) {
+	*pTile = NULL;
+	if (x < 0 || y < 0 || x >= (1 << z) || y >= (1 << z))
+		return SQLITE_OK;
+
+	// a replaced patch leaves the cuts of the old one to age out of the cache
+	const char* source = tileset->patch_path ? apr_psprintf(pool, "%s#%d", tileset->overzoom_source, tileset->patch_loads) : tileset->overzoom_source;
+	apr_size_t size;
+	if (mbtiles_cache_get(&tile_cache, source, z, x, y, pool, pTile, &size, NULL)) {
+		*psTile = (int)size;
+		return SQLITE_OK;
+	}
+
+	int dz = z - tileset->max_zoom;
+	unsigned char* parent;
+	int parent_size;
+	int rc = getTile(tileset, tileset->max_zoom, x >> dz, y >> dz, pool, &parent, &parent_size);
+	if (rc != SQLITE_OK)
+		return rc;
+
+	if (parent) {
+		unsigned char* raw;
+		apr_size_t raw_size;
+		unsigned char* child;
+		apr_size_t child_size;
+		uint32_t mask = (1u << dz) - 1;
+		if (!inflateTile(parent, parent_size, pool, &raw, &raw_size)
+			|| !mbtiles_mvt_overzoom(raw, raw_size, dz, x & mask, mbtiles_flip_y(z, y) & mask, pool, &child, &child_size))
+			return SQLITE_CORRUPT;
+		if (child_size) {
+			apr_size_t buffer_size = compressBound(child_size) + 32;	// gzip header and trailer
+			*pTile = apr_palloc(pool, buffer_size);
+			*psTile = (int)compressGzip(*pTile, buffer_size, child, child_size, Z_DEFAULT_COMPRESSION);
+			if (!*psTile)
+				return SQLITE_NOMEM;
+			apr_atomic_inc32(&overzoom_tiles);
+		}
+	}
+	// nothing of the ancestor in this child is worth knowing too
+	mbtiles_cache_put(&tile_cache, source, z, x, y, *pTile, *pTile ? *psTile : 0, 0);
+	return SQLITE_OK;
+}
+
+static int getTile(Tileset* tileset, const int z, const int x, const int y, apr_pool_t* pool, unsigned char** pTile, int* psTile) {
+	if (tileset->overzoom && z > tileset->max_zoom && z <= tileset->overzoom)
+		return overzoomTile(tileset, z, x, y, pool, pTile, psTile);
+
+	if (!tileInRange(tileset, z, x, y)) {
+		*pTile = NULL;
+		return SQLITE_OK;
+	}
+
+	if (tileset->patch_path && readPatchedTile(tileset, z, x, y, pool, pTile, psTile)) {
+		// not cached: under the file's key it would outlive the patch
+		if (*pTile && tileset->isPBF && tileEncoding(*pTile, *psTile) != TILE_ENCODING_GZIP)
+			return gzipTile(NULL, z, x, y, pool, pTile, psTile);
+		return SQLITE_OK;
+	}
+
+	if (tileset->shards) {
+		int c = routeShard(tileset->shards, z, x, y);
+		if (c != -1 && tilesets[c].opened)
+			tileset = &tilesets[c];
+		else if (!tileset->path[0]) {
+			*pTile = NULL;
+			return SQLITE_OK;
+		}
+	}
+
+	int rc = readStoredTile(tileset, z, x, y, pool, pTile, psTile);
+	if (rc == SQLITE_OK && *pTile && tileset->isPBF && tileEncoding(*pTile, *psTile) != TILE_ENCODING_GZIP)
+		rc = gzipTile(tileset->path, z, x, y, pool, pTile, psTile);
+	return rc;
+}
+
+static bool readFileMetadata(Tileset* tileset, TilesetMetadata* metadata, apr_pool_t* pool) {
+	if (tileset->isPmtiles)
+		return mbtiles_pmtiles_read_metadata(tileset->pmtiles, metadata, pool);
+	if (!open_pool)
+		return tileset->db && mbtile_read_metadata(tileset->db, metadata, pool);
+	TilesetHandle* handle = acquireDatabase(tileset);
+	if (!handle)
+		return false;
+	bool read = mbtile_read_metadata(handle->db, metadata, pool);
+	releaseDatabase(tileset, handle, SQLITE_OK);
+	return read;
+}
+
+static bool readMetadata(Tileset* tileset, TilesetMetadata* metadata, apr_pool_t* pool) {
+	if (tileset->metadata) {
+		*metadata = *tileset->metadata;
+		return true;
+	}
+	if (!tileset->shards)
+		return readFileMetadata(tileset, metadata, pool);
+
+	TilesetMetadata* parts = apr_palloc(pool, (MAX_SHARDS + 1) * sizeof(TilesetMetadata));
+	TilesetMetadata metadata_default = tileset_metadata_init_default;
+	int count = 0;
+	if (tileset->path[0]) {
+		parts[count] = metadata_default;
+		if (readFileMetadata(tileset, &parts[count], pool))
+			count++;
+	}
+	for (int i = 0; i < tileset->shards->count; i++) {
+		Tileset* shard = &tilesets[tileset->shards->shards[i].tileset];
+		if (!shard->opened)
+			continue;
+		parts[count] = metadata_default;
+		if (readFileMetadata(shard, &parts[count], pool))
+			count++;
+	}
+	if (!count)
+		return false;
+
+	// zooms, bounds and attribution are merged, but the shards are one tileset with one name and one set of layers
+	*metadata = mbtiles_metadata_merge(parts, count, pool);
+	metadata->name = parts[0].name;
+	metadata->vector_layers = parts[0].vector_layers;
+	metadata->center[0] = parts[0].center[0];
+	metadata->center[1] = parts[0].center[1];
+	metadata->center[2] = parts[0].center[2];
+	metadata->custom_json = parts[0].custom_json;
+	metadata->custom_len = parts[0].custom_len;
+	return true;
+}
+
+// max-age for a tileset at a zoom, -1 if no rule; a rule naming the tileset beats *
+static int cacheMaxAge(const char* name, int zoom) {
+	int wildcard = -1;
+	for (int i = 0; i < numCacheRules; i++) {
+		CacheRule* rule = &cache_rules[i];
+		if (zoom < rule->min_zoom || zoom > rule->max_zoom)
+			continue;
+		if (strcmp(rule->name, name) == 0)
+			return rule->max_age;
+		if (wildcard == -1 && strcmp(rule->name, "*") == 0)
+			wildcard = rule->max_age;
+	}
+	return wildcard;
+}
+
+// immutable only when every layer came from a tileset added under the requested version (MbtilesAddEx)
+static void setCacheHeaders(const request_rec* r, bool immutable, int max_age) {
+	if (immutable)
+		max_age = immutable_max_age;
+	if (max_age < 0)
+		return;
+
+	apr_table_setn(r->headers_out, "Cache-Control",
+		immutable ? apr_psprintf(r->pool, "public, max-age=%d, immutable", max_age) : apr_psprintf(r->pool, "public, max-age=%d", max_age));
+
+	char* expires = apr_palloc(r->pool, APR_RFC822_DATE_LEN);
+	apr_rfc822_date(expires, r->request_time + apr_time_from_sec(max_age));
+	apr_table_setn(r->headers_out, "Expires", expires);
+}
+
+static bool acceptsWebp(const request_rec* r) {
+	const char* accept = apr_table_get(r->headers_in, "Accept");
+	return accept && ap_strcasestr(accept, "image/webp");
+}
+
+// the tile as WebP if that's smaller; the WebP, or an empty entry when it isn't, is cached so a tile is
+// encoded once per child, and the original is left to the tile cache entry it already has
+static void webpTile(Tileset* tileset, const TileRequest* tileRequest, apr_pool_t* pool, unsigned char** pTile, int* psTile) {
+	unsigned char* cached;
+	apr_size_t size;
+	if (mbtiles_cache_get(&tile_cache, tileset->webp_source, tileRequest->zoom, tileRequest->x, tileRequest->y, pool, &cached, &size, NULL)) {
+		if (cached) {
+			*pTile = cached;
+			*psTile = (int)size;
+		}
+		return;
+	}
+
+	unsigned char* webp;
+	if (!mbtiles_webp_encode(*pTile, *psTile, tileset->webp_quality, pool, &webp, &size) || size >= (apr_size_t)*psTile) {
+		mbtiles_cache_put(&tile_cache, tileset->webp_source, tileRequest->zoom, tileRequest->x, tileRequest->y, NULL, 0, 0);
+		return;
+	}
+	apr_atomic_inc32(&webp_tiles);
+	apr_atomic_add64(&webp_bytes_saved, *psTile - size);
+	*pTile = webp;
+	*psTile = (int)size;
+	mbtiles_cache_put(&tile_cache, tileset->webp_source, tileRequest->zoom, tileRequest->x, tileRequest->y, *pTile, *psTile, 0);
+}
+
+// for answers missing a layer that was over the tile budget
+static void setNoStore(const request_rec* r) {
+	apr_table_setn(r->headers_out, "Cache-Control", "no-store");
+	apr_table_unset(r->headers_out, "Expires");
+}
+
 int findTileset(const char* version, const char* name) {
 	for (int i=0; i<numLoaded; i++) {
 		if (strcmp(tilesets[i].name, name)==0 && strcmp(tilesets[i].version, version)==0) { return i; }
@@ -303,6 +2052,454 @@ int findTileset(const char* version, const char* name) {
 	return -1;
 }
 
+int mbtiles_status_handler(request_rec* r) {
+	if (!r->handler || strcmp(r->handler, "mbtiles-status"))
+		return DECLINED;
+
+	TileCacheStats cache;
+	mbtiles_cache_get_stats(&tile_cache, &cache);
+	apr_uint32_t prefetched = apr_atomic_read32(&read_ahead.stats.tiles);
+	apr_uint32_t prefetch_hits = apr_atomic_read32(&read_ahead.stats.hits);
+
+	ap_set_content_type(r, "text/plain");
+	ap_rputs("counters of the child serving this request\n", r);
+	ap_rprintf(r, "tile cache: %" APR_SIZE_T_FMT " of %" APR_SIZE_T_FMT " bytes, %" APR_SIZE_T_FMT " tiles\n", cache.bytes, tile_cache.max_bytes, cache.entries);
+	ap_rprintf(r, "tile cache hits: %" APR_UINT64_T_FMT ", misses: %" APR_UINT64_T_FMT ", evictions: %" APR_UINT64_T_FMT "\n", cache.hits, cache.misses, cache.evictions);
+	ap_rprintf(r, "read-ahead windows: %u queued, %u dropped, %u read\n",
+		apr_atomic_read32(&read_ahead.stats.queued), apr_atomic_read32(&read_ahead.stats.dropped), apr_atomic_read32(&read_ahead.stats.windows));
+	ap_rprintf(r, "read-ahead tiles: %u prefetched, %u hit (%d%%)\n", prefetched, prefetch_hits, prefetched ? (int)(100.0 * prefetch_hits / prefetched) : 0);
+	int handles = 0;
+	sqlite3_int64 page_cache = 0;
+	int unavailable = 0;
+	lockHandles();
+	for (int i = 0; i < numLoaded; i++) {
+		TilesetHandle* handle = tilesets[i].handle;
+		int used, highwater;
+		if (handle && SQLITE_OK == sqlite3_db_status(handle->db, SQLITE_DBSTATUS_CACHE_USED, &used, &highwater, 0)) {
+			page_cache += used;
+			handles++;
+		}
+		if (!handle && tilesets[i].failures)
+			unavailable++;
+	}
+	unlockHandles();
+	ap_rprintf(r, "sqlite page cache: %" APR_INT64_T_FMT " bytes in %d handles\n", (apr_int64_t)page_cache, handles);
+	ap_rprintf(r, "sqlite files waiting to be reopened: %d\n", unavailable);
+	ap_rprintf(r, "tiles over budget: %u\n", apr_atomic_read32(&over_budget_count));
+	ap_rprintf(r, "webp tiles encoded: %u, %" APR_UINT64_T_FMT " bytes saved\n", apr_atomic_read32(&webp_tiles), apr_atomic_read64(&webp_bytes_saved));
+	ap_rprintf(r, "overzoomed tiles cut: %u\n", apr_atomic_read32(&overzoom_tiles));
+	for (int i = 0; i < numLoaded; i++) {
+		if (!tilesets[i].patch_path)
+			continue;
+		lockHandles();
+		TilePatch* patch = tilesets[i].patch;
+		int tiles = patch ? (int)patch->tiles.count : 0;
+		int bytes = patch ? (int)mbtiles_memtable_bytes(&patch->tiles) : 0;
+		int loads = tilesets[i].patch_loads;
+		unlockHandles();
+		ap_rprintf(r, "patch %s: %d tiles, %d KB, reloaded %d times\n", tilesets[i].name, tiles, bytes / 1024, loads);
+	}
+	ap_rprintf(r, "composite gzip level: %u (%d busy to %d idle), %u queued and %u compressed again at %d, %u dropped\n",
+		apr_atomic_read32(&composite_deflate.current), composite_deflate.fast_level, composite_deflate.normal_level,
+		apr_atomic_read32(&composite_deflate.stats.queued), apr_atomic_read32(&composite_deflate.stats.recompressed),
+		composite_deflate.best_level, apr_atomic_read32(&composite_deflate.stats.dropped));
+	for (int i = 0; i < numComposites; i++)
+		ap_rprintf(r, "composite %s: %s, %d tilesets served, zooms %d-%d\n", composites[i].name, composites[i].names,
+			composites[i].count, composites[i].min_zoom, composites[i].max_zoom);
+	for (int i = 0; i < numLoaded; i++) {
+		if (!tilesets[i].admission)
+			continue;
+		AdmissionStats admission;
+		mbtiles_admission_get_stats(tilesets[i].admission, &admission);
+		ap_rprintf(r, "concurrency %s: %d of %d reading, %d waiting, %u admitted, %u after waiting, %u rejected\n", tilesets[i].name,
+			admission.running, tilesets[i].concurrency, admission.waiting, admission.admitted, admission.waited, admission.rejected);
+	}
+	return OK;
+}
+
+// one tileset of an extract, read with its own handle a zoom at a time in column, row order
+typedef struct ExtractSource {
+	Tileset* tileset;
+	sqlite3* db;
+	sqlite3_stmt* scan;
+	bool has_row;	// the scan stands on a tile
+	int x;
+	int y;			// TMS
+	bool is_patch;	// scans the tileset's MbtilesPatch file
+	int patch;		// index of the source scanning this one's patch, -1 for none
+} ExtractSource;
+
+// reused from tile to tile, so an extract holds no more than its largest tile
+typedef struct ExtractBuffer {
+	unsigned char* data;
+	apr_size_t size;
+} ExtractBuffer;
+
+// where the tiles of an extract go, in the order they are read
+typedef struct ExtractOutput {
+	TarWriter* tar;				// one of the two
+	MbtilesWriter* mbtiles;
+	const char* dir;			// of the tiles in the tar
+	const char* format;
+	apr_uint64_t tiles;
+	ExtractBuffer raw;			// layers of a composite tile
+	ExtractBuffer gzipped;
+} ExtractOutput;
+
+static apr_status_t closeExtractSource(void* data) {
+	ExtractSource* source = (ExtractSource*)data;
+	sqlite3_finalize(source->scan);
+	sqlite3_close(source->db);
+	return APR_SUCCESS;
+}
+
+static int stepExtractSource(ExtractSource* source) {
+	int rc = sqlite3_step(source->scan);
+	source->has_row = rc == SQLITE_ROW;
+	if (source->has_row) {
+		source->x = sqlite3_column_int(source->scan, 0);
+		source->y = sqlite3_column_int(source->scan, 1);
+		return SQLITE_OK;
+	}
+	return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// grown by doubling; the first used bytes are kept
+static void growExtractBuffer(ExtractBuffer* buffer, apr_size_t size, apr_size_t used, apr_pool_t* pool) {
+	if (size <= buffer->size)
+		return;
+	apr_size_t new_size = buffer->size ? buffer->size * 2 : MERGE_TILES_BUFFER_SIZE;
+	while (new_size < size)
+		new_size *= 2;
+	unsigned char* data = apr_palloc(pool, new_size);
+	if (used)
+		memcpy(data, buffer->data, used);
+	buffer->data = data;
+	buffer->size = new_size;
+}
+
+static bool standsOn(const ExtractSource* source, int x, int y) {
+	return source->has_row && source->x == x && source->y == y;
+}
+
+// the source holding tileset i's tile at x/y: its patch if that has the tile, NULL if neither has it or the patch deletes it
+static ExtractSource* tileSource(ExtractSource* sources, int i, int x, int y) {
+	ExtractSource* source = &sources[i];
+	if (source->patch != -1 && standsOn(&sources[source->patch], x, y))
+		source = &sources[source->patch];
+	else if (!standsOn(source, x, y))
+		return NULL;
+	return source->is_patch && !sqlite3_column_bytes(source->scan, 2) ? NULL : source;
+}
+
+// the tile the first count sources (and their patches) make at x/y: the first one's for rasters, all their layers gzipped together
+// for vector tiles; NULL if the patches delete it
+static int extractTile(ExtractSource* sources, int count, int x, int y, ExtractOutput* output, apr_pool_t* pool, const unsigned char** pTile, apr_size_t* psTile) {
+	int first = -1;
+	int matching = 0;
+	for (int i = 0; i < count; i++) {
+		if (!tileSource(sources, i, x, y))
+			continue;
+		if (first == -1)
+			first = i;
+		matching++;
+	}
+	*pTile = NULL;
+	if (first == -1)
+		return SQLITE_OK;
+
+	ExtractSource* source = tileSource(sources, first, x, y);
+	*pTile = sqlite3_column_blob(source->scan, 2);
+	*psTile = sqlite3_column_bytes(source->scan, 2);
+	if (!source->tileset->isPBF || (matching == 1 && tileEncoding(*pTile, *psTile) == TILE_ENCODING_GZIP))
+		return SQLITE_OK;
+
+	apr_size_t used = 0;
+	growExtractBuffer(&output->raw, MERGE_TILES_BUFFER_SIZE, 0, pool);
+	for (int i = first; i < count; i++) {
+		if (!(source = tileSource(sources, i, x, y)))
+			continue;
+		unsigned char* data = (unsigned char*)sqlite3_column_blob(source->scan, 2);
+		apr_size_t size = sqlite3_column_bytes(source->scan, 2);
+		apr_size_t raw_size;
+		while ((raw_size = decompressGzip(&output->raw.data[used], output->raw.size - used, data, size)) == (apr_size_t)Z_BUF_ERROR) {
+			if (output->raw.size > MAX_RAW_TILE_SIZE)
+				return SQLITE_CORRUPT;
+			growExtractBuffer(&output->raw, output->raw.size * 2, used, pool);
+		}
+		used += raw_size;
+	}
+
+	growExtractBuffer(&output->gzipped, compressBound(used) + 32, 0, pool);
+	*psTile = compressGzip(output->gzipped.data, output->gzipped.size, output->raw.data, used, 6);
+	*pTile = output->gzipped.data;
+	return *psTile ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+static bool writeExtractTile(ExtractOutput* output, int z, int x, int y, const unsigned char* data, apr_size_t size) {
+	output->tiles++;
+	if (output->mbtiles)
+		return SQLITE_OK == mbtiles_writer_add(output->mbtiles, z, x, y, data, size);
+
+	char path[256];
+	apr_snprintf(path, sizeof(path), "%s/%d/%d/%d.%s", output->dir, z, x, (1 << z) - 1 - y, output->format);
+	return mbtiles_tar_add(output->tar, path, data, size);
+}
+
+// merges the range scans of all sources over one zoom, so each tile is read once and written in order;
+// the first count are the tilesets, the patches of some of them follow up to total
+static int extractZoom(ExtractSource* sources, int count, int total, int z, const TileRange* range, ExtractOutput* output, apr_pool_t* pool) {
+	int rc = SQLITE_OK;
+	for (int i = 0; i < total && rc == SQLITE_OK; i++) {
+		sqlite3_stmt* scan = sources[i].scan;
+		sqlite3_reset(scan);
+		sqlite3_bind_int(scan, 1, z);
+		sqlite3_bind_int(scan, 2, range->min_x);
+		sqlite3_bind_int(scan, 3, range->max_x);
+		sqlite3_bind_int(scan, 4, range->min_y);
+		sqlite3_bind_int(scan, 5, range->max_y);
+		rc = stepExtractSource(&sources[i]);
+	}
+
+	while (rc == SQLITE_OK) {
+		int x = -1, y = -1;
+		for (int i = 0; i < total; i++) {
+			ExtractSource* source = &sources[i];
+			if (source->has_row && (x == -1 || source->x < x || (source->x == x && source->y < y))) {
+				x = source->x;
+				y = source->y;
+			}
+		}
+		if (x == -1)
+			break;
+
+		const unsigned char* tile;
+		apr_size_t size;
+		rc = extractTile(sources, count, x, y, output, pool, &tile, &size);
+		if (rc == SQLITE_OK && tile && !writeExtractTile(output, z, x, y, tile, size))
+			rc = SQLITE_ABORT;
+
+		// the blobs written above are only valid until the scans move on
+		for (int i = 0; i < total && rc == SQLITE_OK; i++)
+			if (standsOn(&sources[i], x, y))
+				rc = stepExtractSource(&sources[i]);
+	}
+	return rc;
+}
+
+static int extractRegion(ExtractSource* sources, int count, int total, const float* bbox, int min_zoom, int max_zoom, ExtractOutput* output, apr_pool_t* pool) {
+	int rc = SQLITE_OK;
+	for (int z = min_zoom; z <= max_zoom && rc == SQLITE_OK; z++) {
+		TileRange range;
+		boundsToTileRange(bbox, z, &range);
+		rc = extractZoom(sources, count, total, z, &range, output, pool);
+	}
+	return rc;
+}
+
+static bool writeToClient(void* ctx, const void* data, apr_size_t size) {
+	request_rec* r = (request_rec*)ctx;
+	return !r->connection->aborted && ap_rwrite(data, (int)size, r) >= 0;
+}
+
+// GET ?tileset=vt[,overlay...]&bbox=west,south,east,north&zoom=min-max[&format=tar|mbtiles]
+int mbtiles_extract_handler(request_rec* r) {
+	if (!r->handler || strcmp(r->handler, "mbtiles-extract"))
+		return DECLINED;
+	if (r->method_number != M_GET)
+		return HTTP_METHOD_NOT_ALLOWED;
+
+	const char* names = NULL;
+	const char* bbox_arg = NULL;
+	const char* zoom_arg = NULL;
+	const char* format = "tar";
+	char* args = apr_pstrdup(r->pool, r->args ? r->args : "");
+	char* last;
+	for (char* arg = apr_strtok(args, "&", &last); arg; arg = apr_strtok(NULL, "&", &last)) {
+		char* value = strchr(arg, '=');
+		if (!value)
+			continue;
+		*value++ = 0;
+		ap_unescape_url(value);
+		if (!strcmp(arg, "tileset"))
+			names = value;
+		else if (!strcmp(arg, "bbox"))
+			bbox_arg = value;
+		else if (!strcmp(arg, "zoom"))
+			zoom_arg = value;
+		else if (!strcmp(arg, "format"))
+			format = value;
+	}
+
+	float bbox[4];
+	int min_zoom, max_zoom;
+	if (!names || !names[0] || strlen(names) >= 100 || !bbox_arg || !zoom_arg
+		|| sscanf(bbox_arg, "%f,%f,%f,%f", &bbox[0], &bbox[1], &bbox[2], &bbox[3]) != 4 || bbox[0] > bbox[2] || bbox[1] > bbox[3]
+		|| !parseZoomRange(zoom_arg, &min_zoom, &max_zoom) || max_zoom > MAX_ZOOM
+		|| (strcmp(format, "tar") && strcmp(format, "mbtiles"))) {
+		ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "an extract needs tileset, bbox=west,south,east,north, zoom=min-max and format=tar or mbtiles: %s", r->args ? r->args : "");
+		return HTTP_BAD_REQUEST;
+	}
+
+	ExtractSource* sources = apr_pcalloc(r->pool, 2 * MAX_TILESETS * sizeof(ExtractSource));
+	int count = 0;
+	char* file_name = apr_pstrdup(r->pool, names);
+	for (char* name = apr_strtok(apr_pstrdup(r->pool, names), ",", &last); name; name = apr_strtok(NULL, ",", &last)) {
+		int c = findTS(name);
+		if (c == -1 || !tilesets[c].opened) {
+			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "couldn't find tileset: %s", name);
+			return HTTP_NOT_FOUND;
+		}
+		if (tilesets[c].isPmtiles || tilesets[c].shards) {
+			ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "%s can't be extracted, only tilesets of one .mbtiles file can", name);
+			return HTTP_BAD_REQUEST;
+		}
+		if (count == MAX_TILESETS || (count && strcmp(tilesets[c].format, sources[0].tileset->format))) {
+			ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "an extract takes up to %d tilesets of one format: %s", MAX_TILESETS, names);
+			return HTTP_BAD_REQUEST;
+		}
+		sources[count].patch = -1;
+		sources[count++].tileset = &tilesets[c];
+	}
+	// patches are read over their tileset's file like when serving, from the file as it is now
+	int total = count;
+	for (int i = 0; i < count; i++) {
+		apr_finfo_t finfo;
+		Tileset* tileset = sources[i].tileset;
+		if (!tileset->patch_path || APR_SUCCESS != apr_stat(&finfo, tileset->patch_path, APR_FINFO_TYPE, r->pool))
+			continue;
+		sources[i].patch = total;
+		sources[total].tileset = tileset;
+		sources[total].is_patch = true;
+		sources[total++].patch = -1;
+	}
+	for (char* p = file_name; *p; p++)
+		if (*p == ',')
+			*p = '+';
+
+	// counted over the bounding box, whether the tiles exist or not
+	apr_uint64_t covered = 0;
+	for (int z = min_zoom; z <= max_zoom && covered <= extract_max_tiles; z++) {
+		TileRange range;
+		boundsToTileRange(bbox, z, &range);
+		covered += (apr_uint64_t)(range.max_x - range.min_x + 1) * (range.max_y - range.min_y + 1);
+	}
+	if (covered > extract_max_tiles) {
+		ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "extract of %s covers more than MbtilesExtractLimit (%" APR_UINT64_T_FMT " tiles)", names, extract_max_tiles);
+		return HTTP_REQUEST_ENTITY_TOO_LARGE;
+	}
+
+	for (int i = 0; i < total; i++) {
+		ExtractSource* source = &sources[i];
+		int rc = source->is_patch ? sqlite3_open_v2(source->tileset->patch_path, &source->db, SQLITE_OPEN_READONLY, NULL)
+			: openDatabase(source->tileset, &source->db, r->pool);
+		apr_pool_cleanup_register(r->pool, source, closeExtractSource, apr_pool_cleanup_null);
+		if (rc == SQLITE_OK)
+			rc = sqlite3_prepare_v2(source->db, "SELECT tile_column, tile_row, tile_data FROM tiles WHERE zoom_level=?"
+				" AND tile_column BETWEEN ? AND ? AND tile_row BETWEEN ? AND ? ORDER BY tile_column, tile_row;", -1, &source->scan, NULL);
+		if (rc != SQLITE_OK) {
+			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "sqlite error %d while opening %s for an extract", rc,
+				source->is_patch ? source->tileset->patch_path : source->tileset->path);
+			return HTTP_INTERNAL_SERVER_ERROR;
+		}
+	}
+
+	TilesetMetadata metadata_default = tileset_metadata_init_default;
+	TilesetMetadata* parts = apr_palloc(r->pool, count * sizeof(TilesetMetadata));
+	int parts_count = 0;
+	for (int i = 0; i < count; i++) {
+		parts[parts_count] = metadata_default;
+		if (readMetadata(sources[i].tileset, &parts[parts_count], r->pool))
+			parts_count++;
+	}
+	TilesetMetadata metadata = metadata_default;
+	if (parts_count == 1)
+		metadata = parts[0];
+	else if (parts_count > 1)
+		metadata = mbtiles_metadata_merge(parts, parts_count, r->pool);
+	// it covers what was asked for, and is used without this server
+	for (int b = 0; b < 4; b++)
+		metadata.bounds[b] = bbox[b];
+	metadata.center[0] = metadata.center[1] = metadata.center[2] = NOT_SET_CENTER;
+	metadata.min_zoom = min_zoom;
+	metadata.max_zoom = max_zoom;
+	metadata.tiles = NULL;
+	if (!metadata.format)
+		metadata.format = sources[0].tileset->format;
+
+	apr_time_t started = apr_time_now();
+	ExtractOutput output;
+	memset(&output, 0, sizeof(output));
+	output.dir = file_name;
+	output.format = sources[0].tileset->format;
+	int rc;
+
+	if (!strcmp(format, "tar")) {
+		// streamed as it's read: the status is sent before the first tile
+		TarWriter tar;
+		mbtiles_tar_init(&tar, writeToClient, r, r->request_time);
+		output.tar = &tar;
+		ap_set_content_type(r, "application/x-tar");
+		apr_table_setn(r->headers_out, "Content-Disposition", apr_psprintf(r->pool, "attachment; filename=\"%s.tar\"", file_name));
+
+		char* json = mbtiles_metadata_tojson(&metadata, r->pool);
+		rc = mbtiles_tar_add(&tar, apr_pstrcat(r->pool, file_name, "/metadata.json", NULL), json, strlen(json)) ? SQLITE_OK : SQLITE_ABORT;
+		if (rc == SQLITE_OK)
+			rc = extractRegion(sources, count, total, bbox, min_zoom, max_zoom, &output, r->pool);
+		if (rc == SQLITE_OK && !mbtiles_tar_finish(&tar))
+			rc = SQLITE_ABORT;
+		if (rc == SQLITE_ABORT)
+			ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "extract of %s stopped after %" APR_UINT64_T_FMT " tiles, the client went away", names, output.tiles);
+		else if (rc != SQLITE_OK)
+			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "sqlite error %d after %" APR_UINT64_T_FMT " tiles of an extract of %s, the tar is cut short", rc, output.tiles, names);
+		else
+			ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "extracted %" APR_UINT64_T_FMT " tiles of %s (%" APR_UINT64_T_FMT " bytes) in %d ms",
+				output.tiles, names, tar.bytes, (int)apr_time_as_msec(apr_time_now() - started));
+		return OK;
+	}
+
+	// SQLite needs a file to write to: build it, then send it whole
+	const char* temp_dir;
+	apr_file_t* file;
+	apr_finfo_t finfo;
+	if (APR_SUCCESS != apr_temp_dir_get(&temp_dir, r->pool)) {
+		ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "no temporary directory for an extract");
+		return HTTP_INTERNAL_SERVER_ERROR;
+	}
+	char* temp_path = apr_pstrcat(r->pool, temp_dir, "/mbtiles-extract-XXXXXX", NULL);
+	// deleted when the request is done
+	if (APR_SUCCESS != apr_file_mktemp(&file, temp_path, APR_CREATE | APR_READ | APR_WRITE | APR_EXCL | APR_BINARY | APR_DELONCLOSE, r->pool)) {
+		ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "couldn't create a temporary file in %s for an extract", temp_dir);
+		return HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	MbtilesWriter writer;
+	output.mbtiles = &writer;
+	rc = mbtiles_writer_open(&writer, temp_path);
+	if (rc == SQLITE_OK)
+		rc = mbtiles_writer_put_metadata(&writer, &metadata, r->pool);
+	if (rc == SQLITE_OK)
+		rc = extractRegion(sources, count, total, bbox, min_zoom, max_zoom, &output, r->pool);
+	if (writer.db) {
+		int close_rc = mbtiles_writer_close(&writer, rc == SQLITE_OK);
+		if (rc == SQLITE_OK)
+			rc = close_rc;
+	}
+	if (rc != SQLITE_OK || APR_SUCCESS != apr_file_info_get(&finfo, APR_FINFO_SIZE, file)) {
+		ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "sqlite error %d while writing an extract of %s to %s", rc, names, temp_path);
+		return HTTP_INTERNAL_SERVER_ERROR;
+	}
+	ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "extracted %" APR_UINT64_T_FMT " tiles of %s (%" APR_OFF_T_FMT " bytes) in %d ms",
+		output.tiles, names, finfo.size, (int)apr_time_as_msec(apr_time_now() - started));
+
+	ap_set_content_type(r, "application/x-sqlite3");
+	apr_table_setn(r->headers_out, "Content-Disposition", apr_psprintf(r->pool, "attachment; filename=\"%s.mbtiles\"", file_name));
+	ap_set_content_length(r, finfo.size);
+	apr_size_t sent;
+	ap_send_fd(file, r, 0, (apr_size_t)finfo.size, &sent);
+	return OK;
+}
+
 int mbtiles_composite_handler(const request_rec* r) {
 	if (r->method_number == M_OPTIONS)
 	{
@@ -313,6 +2510,8 @@ int mbtiles_composite_handler(const request_rec* r) {
 #ifndef TEST_MOD
 	DirectoryConfig* config = (DirectoryConfig*)ap_get_module_config(r->per_dir_config, &mbtiles_module);
 	if (config->enabled == OFF) return(DECLINED);
+#else
+	DirectoryConfig* config = NULL;
 #endif
 
 	TileRequest tileRequest;
@@ -321,67 +2520,209 @@ int mbtiles_composite_handler(const request_rec* r) {
 	if (isMatch == MATCH_NO)
 		return(DECLINED);	// pattern didn't match
 
+	// named composites are served unversioned, from the plan made in post_config
+	Composite* composite = NULL;
+	apr_size_t names_len = tileRequest.name_position.rm_eo - tileRequest.name_position.rm_so;
+	if (numComposites && tileRequest.version_position.rm_so == -1)
+		composite = findComposite(&r->uri[tileRequest.name_position.rm_so], names_len);
+
+	// merged tiles of named composites are kept in the tile cache
+	if (composite && composite->cache_source && !tileRequest.metadata
+		&& tileRequest.zoom >= composite->min_zoom && tileRequest.zoom <= composite->max_zoom) {
+		unsigned char* data;
+		apr_size_t size;
+		if (mbtiles_cache_get(&tile_cache, composite->cache_source, tileRequest.zoom, tileRequest.x, tileRequest.y, r->pool, &data, &size, NULL) && data) {
+			ap_set_content_type(r, "application/x-protobuf");
+			apr_table_setn(r->headers_out, "Content-Encoding", "gzip");
+			setCacheHeaders(r, false, composite->max_age[tileRequest.zoom]);
+			ap_set_content_length(r, size);
+			ap_rwrite(data, size, r);
+			return OK;
+		}
+	}
+
+	// identical composite tiles requested at the same time are built once
+	TileFlight* flight = NULL;
+	mbtiles_deflate_enter(&composite_deflate);
+	if (!tileRequest.metadata && (composite ? composite->isPBF && composite->count > 1 : memchr(&r->uri[tileRequest.name_position.rm_so], ',', names_len) != NULL)) {
+		// the version is part of the key: /v2/a,b and /a,b can be different tiles
+		const char* version = "";
+		int version_len = 0;
+		if (tileRequest.version_position.rm_so != -1) {
+			version = &r->uri[tileRequest.version_position.rm_so];
+			version_len = tileRequest.version_position.rm_eo - tileRequest.version_position.rm_so;
+		}
+		char* key = apr_psprintf(r->pool, "%.*s/%.*s/%d/%d/%d", version_len, version, (int)names_len, &r->uri[tileRequest.name_position.rm_so],
+								 tileRequest.zoom, tileRequest.x, tileRequest.y);
+		bool leader;
+		flight = mbtiles_flight_join(&composite_flights, key, &leader);
+		if (flight && !leader) {
+			unsigned char* data;
+			apr_size_t size;
+			int max_age;
+			bool immutable;
+			bool shared = mbtiles_flight_wait(&composite_flights, flight, r->pool, &data, &size, &max_age, &immutable);
+			flight = NULL;
+			if (shared) {
+				ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Writing coalesced composite tile (size:%d) : %d/%d/%d", (int)size, tileRequest.zoom, tileRequest.x, tileRequest.y);
+				ap_set_content_type(r, "application/x-protobuf");
+				apr_table_setn(r->headers_out, "Content-Encoding", "gzip");
+				setCacheHeaders(r, immutable, max_age);
+				ap_set_content_length(r, size);
+				ap_rwrite(data, size, r);
+				mbtiles_deflate_leave(&composite_deflate);
+				return OK;
+			}
+		}
+	}
+
+	int rc = serveTile(r, config, tileRequest, composite, flight);
+
+	if (flight)
+		mbtiles_flight_leave(&composite_flights, flight);
+	mbtiles_deflate_leave(&composite_deflate);
+
+	return rc;
+}
+
+static int serveTile(const request_rec* r, const DirectoryConfig* config, TileRequest tileRequest, const Composite* composite, TileFlight* flight) {
 	apr_size_t tile_name_last_position;
 	apr_size_t tile_name_position;
 	tile_name_last_position = tile_name_position = tileRequest.name_position.rm_so;
 	TileRecord list_raw_tiles[MAX_TILESETS];
 
-	char name[MAX_TILESET_NAME];
+	if (composite && tileRequest.metadata) {
+		if (!composite->metadata)
+			return HTTP_NOT_FOUND;
+		// merged in post_config, only the tiles URL depends on the request
+		TilesetMetadata metadata = *composite->metadata;
+		mbtiles_metadata_fill_tiles(&metadata, r->hostname, NULL, (char*)composite->name, r->pool);
+		char* json = mbtiles_metadata_tojson(&metadata, r->pool);
+		ap_set_content_type(r, "application/json");
+		setCacheHeaders(r, false, -1);
+		ap_rputs(json, r);
+		return OK;
+	}
 
+	char name_buffer[MAX_TILESET_NAME];
+	char* name = name_buffer;
+	char version[MAX_TILESET_NAME];
+	version[0] = 0;
+	if (tileRequest.version_position.rm_so != -1) {
+		apr_size_t version_len = tileRequest.version_position.rm_eo - tileRequest.version_position.rm_so;
+		apr_cpystrn(version, &r->uri[tileRequest.version_position.rm_so], version_len < MAX_TILESET_NAME ? version_len + 1 : MAX_TILESET_NAME);
+	}
+
+	bool immutable = version[0] != 0;	// until a layer comes from an unversioned tileset
+	int max_age = -1;
 	unsigned int tile_count = 0;
 	unsigned int tileSize = 0;
 	unsigned char* tile = NULL;
+	bool over_budget = false;	// a layer was left out, so the answer mustn't be cached
+	int rc;
 
-	do	{
-		char* separator = strchr(&r->uri[tile_name_position], ',');
-		//apr_size_t offsetSeparator = index_of_char(&r->uri[tile_name_position], ',', tileRequest.name_position.rm_eo - tile_name_position);
-		if (separator == NULL) {
-			tile_name_position = tileRequest.name_position.rm_eo;
+	// a composite's sources are read only within its zooms, and its max-age is known
+	int planned = 0;
+	int plan_count = 0;
+	if (composite && tileRequest.zoom >= composite->min_zoom && tileRequest.zoom <= composite->max_zoom) {
+		plan_count = composite->count;
+		max_age = composite->max_age[tileRequest.zoom];
+	}
+
+	while (composite ? planned < plan_count : tile_name_position < tileRequest.name_position.rm_eo) {
+		int c;
+		if (composite) {
+			c = composite->sources[planned++];
+			name = tilesets[c].name;
 		}
 		else {
-			tile_name_position += separator - &r->uri[tile_name_position];
-		}
+			char* separator = strchr(&r->uri[tile_name_position], ',');
+			//apr_size_t offsetSeparator = index_of_char(&r->uri[tile_name_position], ',', tileRequest.name_position.rm_eo - tile_name_position);
+			if (separator == NULL) {
+				tile_name_position = tileRequest.name_position.rm_eo;
+			}
+			else {
+				tile_name_position += separator - &r->uri[tile_name_position];
+			}
 
-		apr_size_t len = tile_name_position - tile_name_last_position;
+			apr_size_t len = tile_name_position - tile_name_last_position;
 
-		if (len == 0)
-		{
-			break;
-		}
+			if (len == 0)
+			{
+				break;
+			}
 
-		errno_t copy_ret = strncpy_s(name, MAX_TILESET_NAME, &r->uri[tile_name_last_position], len);
+			errno_t copy_ret = strncpy_s(name, MAX_TILESET_NAME, &r->uri[tile_name_last_position], len);
 
-		// find which tileset it is
-		int c = findTS(name);
-		if (c == -1) {
-			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "couldn't find tileset: %s", name);
-			ap_set_content_type(r, "text/html");
-			ap_rprintf(r, "couldn't find tileset: %s", name);
-			return HTTP_NOT_FOUND;
+			// find which tileset it is: the exact version first, then the default one
+			c = -1;
+			if (version[0])
+				c = findTileset(version, name);
+			if (c == -1) {
+				c = findTS(name);
+				immutable = false;	// a mutable tileset standing in for an unknown version
+			}
+			if (c == -1) {
+				ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "couldn't find tileset: %s", name);
+				ap_set_content_type(r, "text/html");
+				ap_rprintf(r, "couldn't find tileset: %s", name);
+				return HTTP_NOT_FOUND;
+			}
 		}
 		if (tilesets[c].opened == 0) {
 			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "mbtiles file isn't open");
 			return HTTP_INTERNAL_SERVER_ERROR;
 		}
 
+		if (!tileRequest.metadata)
+			mbtiles_hot_record(&hot_tiles, tilesets[c].version, tilesets[c].name, tileRequest.zoom, tileRequest.x, tileRequest.y);
+
+		if (!composite) {
+			int tileset_max_age = cacheMaxAge(tilesets[c].name, tileRequest.zoom);
+			if (tileset_max_age >= 0 && (max_age < 0 || tileset_max_age < max_age))
+				max_age = tileset_max_age;
+		}
+
 		if (tileRequest.metadata) {
 			TilesetMetadata* metadata = apr_palloc(r->pool, sizeof(TilesetMetadata));
 			TilesetMetadata metadata_default = tileset_metadata_init_default;
 			memcpy(metadata, &metadata_default, sizeof(TilesetMetadata));
 
-			mbtile_read_metadata(tilesets[c].db, metadata, r->pool);
+			readMetadata(&tilesets[c], metadata, r->pool);
 			ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "readed mbtiles metadata OK");
 
 			list_raw_tiles[tile_count].metadata = metadata;
 			tile_count++;
 		}
 		// read tile
-		else if (SQLITE_OK != readTile(tilesets[c].db, tileRequest.zoom, tileRequest.x, tileRequest.y, r->pool, &tile, &tileSize)) {
-			// SQLite error
-			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "sqlite error while reading %s %d/%d/%d from mbtiles", name, tileRequest.zoom, tileRequest.x, tileRequest.y);
-			sqlite3_close(tilesets[c].db);
-			tilesets[c].opened = OFF;
-			return HTTP_INTERNAL_SERVER_ERROR;
+		else if (SQLITE_OK != (rc = getTile(&tilesets[c], tileRequest.zoom, tileRequest.x, tileRequest.y, r->pool, &tile, &tileSize))) {
+			if (rc == SQLITE_INTERRUPT) {
+				apr_atomic_inc32(&over_budget_count);
+				ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "reading %s %d/%d/%d took longer than MbtilesTileBudget", name, tileRequest.zoom, tileRequest.x, tileRequest.y);
+				if (!tile_budget_empty || !tilesets[c].isPBF) {
+					apr_table_setn(r->err_headers_out, "Retry-After", "1");
+					return HTTP_SERVICE_UNAVAILABLE;
+				}
+				over_budget = true;
+				tile = NULL;
+			}
+			else if (rc == TILE_REJECTED) {
+				// shed: the tileset already has as many readers and waiters as it may
+				ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "%s is busy, turned away %d/%d/%d", name, tileRequest.zoom, tileRequest.x, tileRequest.y);
+				apr_table_setn(r->err_headers_out, "Retry-After", "1");
+				return HTTP_SERVICE_UNAVAILABLE;
+			}
+			else if (rc == SQLITE_CANTOPEN) {
+				// the file is reopened after a backoff
+				ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "couldn't open %s to read %d/%d/%d", name, tileRequest.zoom, tileRequest.x, tileRequest.y);
+				apr_table_setn(r->err_headers_out, "Retry-After", apr_itoa(r->pool, reopenDelay(&tilesets[c])));
+				return HTTP_SERVICE_UNAVAILABLE;
+			}
+			else {
+				// a broken handle is replaced on a later request; other threads may still be using it
+				ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "sqlite error %d while reading %s %d/%d/%d from mbtiles", rc, name, tileRequest.zoom, tileRequest.x, tileRequest.y);
+				return HTTP_INTERNAL_SERVER_ERROR;
+			}
 		} else if (NULL == tile && tilesets[c].isPBF) {
 			// Vector tile not found
 			ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "VTile %s %d/%d/%d not found", name, tileRequest.zoom, tileRequest.x, tileRequest.y);
@@ -403,11 +2744,19 @@ int mbtiles_composite_handler(const request_rec* r) {
 		}
 		else {
 			// Write raster tile
+			if (tilesets[c].webp) {
+				// the same URL is a PNG or a WebP depending on who asks
+				apr_table_mergen(r->headers_out, "Vary", "Accept");
+				if (acceptsWebp(r))
+					webpTile(&tilesets[c], &tileRequest, r->pool, &tile, &tileSize);
+			}
 			ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Writing raster tile (size:%d) : %s %d/%d/%d", tileSize, name, tileRequest.zoom, tileRequest.x, tileRequest.y);
-			if (strcmp(tilesets[c].format, "png") == 0) { ap_set_content_type(r, "image/png"); }
+			if (mbtiles_is_webp(tile, tileSize)) { ap_set_content_type(r, "image/webp"); }
+			else if (strcmp(tilesets[c].format, "png") == 0) { ap_set_content_type(r, "image/png"); }
 			else if (strcmp(tilesets[c].format, "jpg") == 0) { ap_set_content_type(r, "image/jpeg"); }
 			else if (strcmp(tilesets[c].format, "webp") == 0) { ap_set_content_type(r, "image/webp"); }
 			else { ap_set_content_type(r, tilesets[c].format); }
+			setCacheHeaders(r, immutable, max_age);
 			ap_set_content_length(r, tileSize);
 			ap_rwrite(tile, tileSize, r);
 			return OK;
@@ -415,15 +2764,24 @@ int mbtiles_composite_handler(const request_rec* r) {
 
 		tile_name_position++;	// skip ,
 		tile_name_last_position = tile_name_position;
-	} while (tile_name_position < tileRequest.name_position.rm_eo);
+	}
 
-	if (tile_count == 0)	{
+	if (tile_count == 0 && over_budget) {
+		ap_set_content_type(r, "application/x-protobuf");
+		apr_table_setn(r->headers_out, "Content-Encoding", "gzip");
+		setNoStore(r);
+		ap_set_content_length(r, sizeof(EMPTY_TILE));
+		ap_rwrite(EMPTY_TILE, sizeof(EMPTY_TILE), r);
+		return OK;
+	}
+	else if (tile_count == 0)	{
 		// tile not found
 		//ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Tile %d/%d/%d not found", tileRequest.zoom, tileRequest.x, tileRequest.y);
 #ifndef TEST_MOD
 		if (config->return_empty_tile) {
 			ap_set_content_type(r, "application/x-protobuf");
 			apr_table_setn(r->headers_out, "Content-Encoding", "gzip");
+			setCacheHeaders(r, immutable, max_age);
 			ap_set_content_length(r, 36);
 			ap_rwrite(EMPTY_TILE, 36, r);
 			return OK;
@@ -435,9 +2793,10 @@ int mbtiles_composite_handler(const request_rec* r) {
 		}
 	} else if (tile_count == 1)	{
 		if (tileRequest.metadata) {
-			mbtiles_metadata_fill_tiles(list_raw_tiles[0].metadata, r->hostname, NULL, name, r->pool);
+			mbtiles_metadata_fill_tiles(list_raw_tiles[0].metadata, r->hostname, version[0] ? version : NULL, name, r->pool);
 			char* json = mbtiles_metadata_tojson(list_raw_tiles[0].metadata, r->pool);
 			ap_set_content_type(r, "application/json");
+			setCacheHeaders(r, immutable, -1);
 			ap_rputs(json, r);
 			return OK;
 		}
@@ -447,6 +2806,9 @@ int mbtiles_composite_handler(const request_rec* r) {
 		ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Writing vector tile (size:%d) : %d/%d/%d", tileSize, tileRequest.zoom, tileRequest.x, tileRequest.y);
 		ap_set_content_type(r, "application/x-protobuf");
 		apr_table_setn(r->headers_out, "Content-Encoding", "gzip");
+		setCacheHeaders(r, immutable, max_age);
+		if (over_budget)
+			setNoStore(r);
 		ap_set_content_length(r, tileRecord->compressedSize);
 		ap_rwrite(tileRecord->compressedData, tileRecord->compressedSize, r);
 
@@ -461,17 +2823,19 @@ int mbtiles_composite_handler(const request_rec* r) {
 
 			apr_size_t full_name_len = tileRequest.name_position.rm_eo - tileRequest.name_position.rm_so;
 			char* full_name = apr_pstrmemdup(r->pool, &r->uri[tileRequest.name_position.rm_so], full_name_len);
-			mbtiles_metadata_fill_tiles(&combined_metadata, r->hostname, NULL, full_name, r->pool);
+			mbtiles_metadata_fill_tiles(&combined_metadata, r->hostname, version[0] ? version : NULL, full_name, r->pool);
 			char* json = mbtiles_metadata_tojson(&combined_metadata, r->pool);
 			ap_set_content_type(r, "application/json");
+			setCacheHeaders(r, immutable, -1);
 			ap_rputs(json, r);
 			return OK;
 		}
 
-		unsigned char* raw_tiles_buffer = apr_palloc(r->pool, dynamic_tiles_size);
+		apr_size_t buffer_size = apr_atomic_read32(&dynamic_tiles_size);
+		unsigned char* raw_tiles_buffer = apr_palloc(r->pool, buffer_size);
 		if (!raw_tiles_buffer)
 		{
-			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Out of memory (buffer %d bytes)", dynamic_tiles_size);
+			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Out of memory (buffer %" APR_SIZE_T_FMT " bytes)", buffer_size);
 			return HTTP_INTERNAL_SERVER_ERROR;
 		}
 		apr_size_t usedBuffer = 0;
@@ -482,20 +2846,21 @@ int mbtiles_composite_handler(const request_rec* r) {
 
 			apr_size_t decompressedSize = decompressGzip(
 				&raw_tiles_buffer[usedBuffer],
-				dynamic_tiles_size - usedBuffer,
+				buffer_size - usedBuffer,
 				tileRecord->compressedData,
 				tileRecord->compressedSize
 			);
 
 			if (Z_BUF_ERROR == decompressedSize) {
-				unsigned char* new_raw_tiles_buffer = apr_palloc(r->pool, dynamic_tiles_size + MERGE_TILES_BUFFER_SIZE);
+				unsigned char* new_raw_tiles_buffer = apr_palloc(r->pool, buffer_size + MERGE_TILES_BUFFER_SIZE);
 				if (!new_raw_tiles_buffer) {
-					ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Out of memory (buffer %d bytes)", dynamic_tiles_size);
+					ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Out of memory (buffer %" APR_SIZE_T_FMT " bytes)", buffer_size);
 					return HTTP_INTERNAL_SERVER_ERROR;
 				}
-				memcpy(new_raw_tiles_buffer, raw_tiles_buffer, dynamic_tiles_size);
+				memcpy(new_raw_tiles_buffer, raw_tiles_buffer, buffer_size);
 
-				dynamic_tiles_size += MERGE_TILES_BUFFER_SIZE;
+				buffer_size += MERGE_TILES_BUFFER_SIZE;
+				growMergeBuffer(buffer_size);
 				raw_tiles_buffer = new_raw_tiles_buffer;
 
 				i--;	// retry
@@ -518,18 +2883,31 @@ int mbtiles_composite_handler(const request_rec* r) {
 
 		//newTileRecord.compressedData = &raw_tiles_buffer[usedBuffer];
 		//newTileRecord.compressedSize = MERGE_TILES_BUFFER_SIZE - usedBuffer;
-		apr_size_t compressedSize = compressGzip(&raw_tiles_buffer[usedBuffer], dynamic_tiles_size - usedBuffer,
-											     raw_tiles_buffer, usedBuffer, 6);
+		int level = mbtiles_deflate_level(&composite_deflate);
+		apr_size_t compressedSize = compressGzip(&raw_tiles_buffer[usedBuffer], buffer_size - usedBuffer,
+											     raw_tiles_buffer, usedBuffer, level);
 
 		if (!compressedSize)
 		{
 			ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "failed compressing tiles");
 			return DONE;
 		}
+		// a tile missing a layer isn't shared: the waiting requests read it themselves
+		if (flight && !over_budget)
+			mbtiles_flight_publish(&composite_flights, flight, &raw_tiles_buffer[usedBuffer], compressedSize, max_age, immutable);
+		if (composite && composite->cache_source && !over_budget) {
+			mbtiles_cache_put(&tile_cache, composite->cache_source, tileRequest.zoom, tileRequest.x, tileRequest.y,
+				&raw_tiles_buffer[usedBuffer], compressedSize, 0);
+			if (level < composite_deflate.best_level)
+				mbtiles_deflate_queue(&composite_deflate, composite->cache_source, tileRequest.zoom, tileRequest.x, tileRequest.y);
+		}
 		//newTileRecord.compressedSize = compressedSize;
 
 		ap_set_content_type(r, "application/x-protobuf");
 		apr_table_setn(r->headers_out, "Content-Encoding", "gzip");
+		setCacheHeaders(r, immutable, max_age);
+		if (over_budget)
+			setNoStore(r);
 		ap_set_content_length(r, compressedSize);
 		ap_rwrite(&raw_tiles_buffer[usedBuffer], compressedSize, r);
 	}
@@ -551,10 +2929,15 @@ static int extractTileRequest(char *uri, TileRequest *tileRequest)
 	size_t meta_position = len - sizeof(metadata_json) + 1;
 	if (!strcmpi(uri + meta_position, metadata_json)) {
 		char* slash = strchr(&uri[1], '/');
+		tileRequest->version_position.rm_so = -1;
+		tileRequest->zoom = -1;
 		if (slash - uri == meta_position)
 			tileRequest->name_position.rm_so = 1;
-		else
+		else {
 			tileRequest->name_position.rm_so = slash - uri + 1;
+			tileRequest->version_position.rm_so = 1;
+			tileRequest->version_position.rm_eo = slash - uri;
+		}
 		tileRequest->name_position.rm_eo = meta_position;
 		//strcpy(tileRequest->format, &metadata_json[1]);
 		tileRequest->metadata = ON;
@@ -587,6 +2970,11 @@ static int extractTileRequest(char *uri, TileRequest *tileRequest)
 	// invert y for TMS
 	tileRequest->y = ((1 << tileRequest->zoom) - tileRequest->y - 1);
 
+	// version group includes the trailing slash
+	tileRequest->version_position = regm[REG_MATCH_INDEX_VERSION];
+	if (tileRequest->version_position.rm_so != -1)
+		tileRequest->version_position.rm_eo--;
+
 	regm_i = regm[REG_MATCH_INDEX_NAME];
 	len = regm_i.rm_eo - regm_i.rm_so;
 
@@ -609,11 +2997,19 @@ static int extractTileRequest(char *uri, TileRequest *tileRequest)
 }
 
 static apr_size_t decompressGzip(unsigned char* dest, apr_size_t buffer_size, unsigned char* source, apr_size_t size) {
+	if (tileEncoding(source, size) == TILE_ENCODING_RAW) {
+		// stored uncompressed
+		if (size > buffer_size)
+			return Z_BUF_ERROR;
+		memcpy(dest, source, size);
+		return size;
+	}
+
 	z_stream zs;                        // z_stream is zlib's control structure
 
 	memset(&zs, 0, sizeof(zs));
 
-	if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK)
+	if (inflateInit2(&zs, 32 + MAX_WBITS) != Z_OK)	// gzip or zlib header
 		return 0;
 
 	zs.next_in = (Bytef*)source;
@@ -624,11 +3020,15 @@ static apr_size_t decompressGzip(unsigned char* dest, apr_size_t buffer_size, un
 	zs.avail_out = (uInt)buffer_size;
 
 	ret = inflate(&zs, Z_FINISH);
+	apr_size_t total = zs.total_out;
+	inflateEnd(&zs);
 
 	if (Z_BUF_ERROR == ret)
 		return Z_BUF_ERROR;
+	if (Z_STREAM_END != ret)
+		return 0;	// corrupt
 
-	return zs.total_out;
+	return total;
 }
 
 static apr_size_t compressGzip(unsigned char* dest, apr_size_t dsize,